@@ -0,0 +1,674 @@
+// the benchmarks don't need SDL to take over main, only its types
+#define SDL_MAIN_HANDLED
+#include <SDL.h>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "vector.h"
+#include "matrix.h"
+#include "random.h"
+#include "span.h"
+#include "texture.h"
+#include "transform.h"
+#include "cull.h"
+#include "raster.h"
+
+/*
+* the kernels of the demo on their own, without a window, audio or the
+* rest of the frame: the vector and matrix operations, the vertex
+* transform, the back-face test, the edge scan and the span fill. every
+* benchmark is timed for a while, several times, in a few rounds over the
+* whole set so a busy moment of the host doesn't hit all the runs of one,
+* and the fastest run is kept. the scan and the fill work on the quads of a
+* frame of the default torus, or on quads recorded from the demo with
+* --record-quads
+*/
+
+// the screen of the synthetic frame, recorded quads bring their own
+int screenWidth = 640;
+int screenHeight = 480;
+
+// the synthetic torus, the same shape and pose as the demo's
+#define RING_RADIUS 50.0f
+#define TUBE_RADIUS 20.0f
+#define FRAME_SLICES 32
+#define FRAME_SPANS 16
+// the transform and the cull run on a finer mesh, so the loops dominate
+#define MESH_SLICES 256
+#define MESH_SPANS 128
+
+// each benchmark runs for at least this long, this many times, in every
+// one of rounds passes over all of them
+double minSeconds = 0.2;
+int repeats = 5;
+int rounds = 3;
+// a benchmark slower than the baseline is measured again this many times
+// before it counts as a regression
+#define CONFIRM_ROUNDS 5
+
+const char *inputPath = NULL;
+const char *outputPath = NULL;
+const char *baselinePath = NULL;
+const char *filter = NULL;
+// slower than the baseline by more than this many percent is a regression
+double threshold = 10;
+
+typedef struct {
+	std::string name;
+	double nsPerOp;
+	double perSecond;
+	std::string unit;
+	double threshold;
+} bench_result;
+
+std::vector<bench_result> results;
+// when not empty, only these benchmarks run, to confirm a regression
+std::vector<std::string> confirming;
+
+// what the benchmarks compute ends up here, so it can't be optimised away
+volatile float sink;
+
+typedef struct {
+	vertex_streams org;
+	face_streams faces;
+	std::vector<int> quads;
+	std::vector<int> sliceRefs, spanRefs;
+	int slices, spans;
+} bench_torus;
+
+/*
+* the torus of init_object: vertices, normals, the 4 vertices of every quad
+* and its face normal and centre
+*/
+void MakeTorus(bench_torus &t, const int slices, const int spans)
+{
+	t.slices = slices;
+	t.spans = spans;
+	AllocStreams(t.org, slices * spans);
+	for (int i = 0, k = 0; i < slices; i++)
+	{
+		const float ext = (float)i * (float)M_PI * 2.0f / slices;
+		for (int j = 0; j < spans; j++, k++)
+		{
+			const float in = (float)j * (float)M_PI * 2.0f / spans, r = RING_RADIUS + TUBE_RADIUS * cosf(in);
+			const VECTOR vertex(r * cosf(ext), TUBE_RADIUS * sinf(in), r * sinf(ext));
+			const VECTOR normal = normalize(vertex - VECTOR(RING_RADIUS * cosf(ext), 0, RING_RADIUS * sinf(ext)));
+			t.org.x[k] = vertex[0];
+			t.org.y[k] = vertex[1];
+			t.org.z[k] = vertex[2];
+			t.org.nx[k] = normal[0];
+			t.org.ny[k] = normal[1];
+			t.org.nz[k] = normal[2];
+		}
+	}
+	PadStreams(t.org);
+
+	t.quads.resize(slices * spans * 4);
+	AllocFaces(t.faces, slices * spans);
+	for (int i = 0; i < slices; i++)
+		for (int j = 0; j < spans; j++)
+		{
+			const int n = i * spans + j;
+			int *p = &t.quads[n * 4];
+			p[0] = i * spans + j;
+			p[1] = i * spans + (j + 1) % spans;
+			p[2] = (i + 1) % slices * spans + (j + 1) % spans;
+			p[3] = (i + 1) % slices * spans + j;
+			VECTOR corner[4];
+			for (int k = 0; k < 4; k++)
+				corner[k] = VECTOR(t.org.x[p[k]], t.org.y[p[k]], t.org.z[p[k]]);
+			const VECTOR normal = normalize(cross(normalize(corner[2] - corner[0]), normalize(corner[3] - corner[1])));
+			SetFace(t.faces, n, normal, (corner[0] + corner[1] + corner[2] + corner[3]) * 0.25f);
+		}
+	PadFaces(t.faces);
+
+	for (int i = 0; i <= slices; i++)
+		t.sliceRefs.push_back((int)((Sint64)i * 512 / slices) << 16);
+	for (int j = 0; j <= spans; j++)
+		t.spanRefs.push_back((int)((Sint64)j * 512 / spans) << 16);
+}
+
+void FreeTorus(bench_torus &t)
+{
+	FreeStreams(t.org);
+	FreeFaces(t.faces);
+}
+
+// the pose of the demo's transform benchmark
+const MATRIX benchRot = Multiply(Multiply(rotX(0.3f), rotY(0.7f)), rotZ(1.1f));
+const VECTOR benchPos(0, 0, 250);
+const float benchScale = 1.2f, benchBulk = 3;
+
+transform_setup BenchSetup()
+{
+	return SetupTransform(AFFINE(Multiply(scale(benchScale), benchRot), benchPos), benchRot, benchBulk, screenWidth, screenHeight);
+}
+
+// the camera in object space, like CullInstance
+VECTOR BenchEye()
+{
+	return Transform(benchRot.transposed(), benchPos) * -1.0f;
+}
+
+/*
+* the quads of the torus facing the camera, on the screen, front to back
+* like the demo draws them
+*/
+void FrameQuads(std::vector<screen_quad> &quads)
+{
+	bench_torus t;
+	MakeTorus(t, FRAME_SLICES, FRAME_SPANS);
+	vertex_streams cur;
+	AllocStreams(cur, t.org.count);
+	TransformStreams(t.org, cur, BenchSetup(), 0, t.org.padded);
+	std::vector<int> facing(t.faces.padded);
+	const int count = CullFaces(t.faces, BenchEye(), facing.data());
+	std::vector<std::pair<float, screen_quad> > sorted;
+	for (int v = 0; v < count; v++)
+	{
+		const int n = facing[v];
+		screen_quad q;
+		QuadCorners(cur, &t.quads[n * 4], n, t.spans, t.sliceRefs.data(), t.spanRefs.data(), q.c);
+		float depth = 0;
+		for (int i = 0; i < 4; i++)
+			depth += q.c[i].z;
+		sorted.push_back(std::make_pair(depth, q));
+	}
+	std::stable_sort(sorted.begin(), sorted.end(),
+		[](const std::pair<float, screen_quad> &a, const std::pair<float, screen_quad> &b) { return a.first < b.first; });
+	quads.clear();
+	for (size_t i = 0; i < sorted.size(); i++)
+		quads.push_back(sorted[i].second);
+	FreeStreams(cur);
+	FreeTorus(t);
+}
+
+bool Selected(const char *name)
+{
+	if (!confirming.empty())
+		return std::find(confirming.begin(), confirming.end(), name) != confirming.end();
+	return !filter || strstr(name, filter);
+}
+
+// the index of the result called name in list, or -1
+int FindResult(const std::vector<bench_result> &list, const std::string &name)
+{
+	for (size_t i = 0; i < list.size(); i++)
+		if (list[i].name == name)
+			return (int)i;
+	return -1;
+}
+
+/*
+* time run() after prepare(), which isn't timed, until minSeconds have
+* passed, repeats times, and keep the fastest of these and of the earlier
+* rounds. ops is the work of one run
+*/
+template <typename PREPARE, typename RUN>
+void Measure(const char *name, const char *unit, const double ops, PREPARE prepare, RUN run)
+{
+	if (!Selected(name))
+		return;
+	typedef std::chrono::steady_clock clock;
+	double best = 0;
+	for (int r = 0; r < repeats; r++)
+	{
+		double seconds = 0;
+		Sint64 runs = 0;
+		while (seconds < minSeconds / repeats || runs < 2)
+		{
+			prepare();
+			const clock::time_point start = clock::now();
+			run();
+			seconds += std::chrono::duration<double>(clock::now() - start).count();
+			runs++;
+		}
+		const double ns = seconds * 1e9 / (runs * ops);
+		if (r == 0 || ns < best)
+			best = ns;
+	}
+	const int earlier = FindResult(results, name);
+	if (earlier >= 0)
+	{
+		if (best < results[earlier].nsPerOp)
+		{
+			results[earlier].nsPerOp = best;
+			results[earlier].perSecond = 1e9 / best;
+		}
+		return;
+	}
+	bench_result b = { name, best, 1e9 / best, unit, threshold };
+	results.push_back(b);
+}
+
+void PrintResults()
+{
+	for (size_t i = 0; i < results.size(); i++)
+	{
+		const bench_result &r = results[i];
+		std::cout << std::left << std::setw(26) << r.name << std::right << std::fixed
+			<< std::setprecision(3) << std::setw(12) << r.nsPerOp << " ns/" << std::left << std::setw(8) << r.unit
+			<< std::right << std::setprecision(1) << std::setw(14) << r.perSecond / 1e6 << " M" << r.unit << "/s" << std::endl;
+	}
+}
+
+template <typename RUN>
+void Measure(const char *name, const char *unit, const double ops, RUN run)
+{
+	Measure(name, unit, ops, [] {}, run);
+}
+
+void MathBenchmarks()
+{
+	const int count = 1024;
+	std::vector<VECTOR> in(count), out(count);
+	RANDOM random(1);
+	for (int i = 0; i < count; i++)
+		in[i] = VECTOR(random(2001) - 1000.0f, random(2001) - 1000.0f, random(2001) - 1000.0f + 0.5f);
+	const MATRIX m = benchRot;
+	const AFFINE a(m, benchPos);
+
+	Measure("rotation_chain", "chain", 1000, [&] {
+		VECTOR sum;
+		for (int n = 0; n < 1000; n++)
+			sum = sum + Multiply(Multiply(rotX(n * 0.001f), rotY(n * 0.002f)), rotZ(n * 0.003f))[n % 3];
+		sink = sum[0];
+	});
+	Measure("matrix_vector_operator", "vector", count, [&] {
+		for (int i = 0; i < count; i++)
+			out[i] = m * in[i];
+		sink = out[count - 1][0];
+	});
+	Measure("matrix_vector_transform", "vector", count, [&] {
+		for (int i = 0; i < count; i++)
+			out[i] = Transform(m, in[i]);
+		sink = out[count - 1][0];
+	});
+	Measure("affine_transform", "vector", count, [&] {
+		for (int i = 0; i < count; i++)
+			out[i] = Transform(a, in[i]);
+		sink = out[count - 1][0];
+	});
+	Measure("vector_normalize", "vector", count, [&] {
+		for (int i = 0; i < count; i++)
+			out[i] = normalize(in[i]);
+		sink = out[count - 1][0];
+	});
+}
+
+void GeometryBenchmarks()
+{
+	bench_torus t;
+	MakeTorus(t, MESH_SLICES, MESH_SPANS);
+	vertex_streams cur;
+	AllocStreams(cur, t.org.count);
+	const transform_setup setup = BenchSetup();
+	Measure("transform_streams", "vertex", t.org.count, [&] {
+		TransformStreams(t.org, cur, setup, 0, t.org.padded);
+		sink = cur.x[0];
+	});
+
+	std::vector<int> facing(t.faces.padded);
+	const VECTOR eye = BenchEye();
+	Measure("cull_faces", "face", t.faces.count, [&] {
+		sink = (float)CullFaces(t.faces, eye, facing.data());
+	});
+	FreeStreams(cur);
+	FreeTorus(t);
+}
+
+// the two edges of one row of a quad, as DrawSpan gets them
+typedef struct {
+	int y;
+	edge_data e[2];
+} bench_row;
+
+// reset the rows of a quad and scan its edges, like InitEdgeTable and ScanQuad
+void ScanScreenQuad(raster_band &band, const screen_quad &q)
+{
+	int minY = band.y1, maxY = band.y0 - 1;
+	for (int i = 0; i < 4; i++)
+	{
+		minY = std::min(minY, (int)q.c[i].y);
+		maxY = std::max(maxY, (int)q.c[i].y);
+	}
+	for (int y = std::max(minY, band.y0); y < std::min(maxY + 1, band.y1); y++)
+		band.edge_table[y - band.y0][0].x = band.edge_table[y - band.y0][1].x = -1;
+	band.poly_minY = band.y1;
+	band.poly_maxY = -1;
+	for (int i = 0; i < 4; i++)
+	{
+		const quad_corner &a = q.c[i], &b = q.c[(i + 1) & 3];
+		ScanEdge(band, VECTOR(a.x, a.y, a.z), a.tx, a.ty, a.px, a.py,
+			VECTOR(b.x, b.y, b.z), b.tx, b.ty, b.px, b.py);
+	}
+	band.poly_minY = std::max(band.poly_minY, band.y0);
+	band.poly_maxY = std::min(band.poly_maxY, band.y1);
+}
+
+void RasterBenchmarks(const std::vector<screen_quad> &quads)
+{
+	raster_band band = raster_band();
+	band.y0 = 0;
+	band.y1 = band.rows = screenHeight;
+	std::vector<edge_data[2]> table(screenHeight);
+	band.edge_table = table.data();
+
+	Measure("scan_edge", "edge", 4.0 * quads.size(), [&] {
+		for (size_t i = 0; i < quads.size(); i++)
+			ScanScreenQuad(band, quads[i]);
+		sink = (float)band.edge_table[screenHeight / 2][0].x;
+	});
+
+	// the block rasterizer's side of it: the edges, the spans of each block
+	// row and the coverage of its blocks, per quad
+	Measure("block_coverage", "quad", (double)quads.size(), [&] {
+		int covered = 0;
+		for (size_t i = 0; i < quads.size(); i++)
+		{
+			block_poly p;
+			if (!SetupPoly(p, quads[i].c, 4))
+				continue;
+			const int y0 = std::max(p.y0, 0), y1 = std::min(p.y1, screenHeight);
+			for (int by = y0 / BLOCK_SIZE * BLOCK_SIZE; by < y1; by += BLOCK_SIZE)
+			{
+				int x1[BLOCK_SIZE], x2[BLOCK_SIZE], mask[BLOCK_SIZE], left = screenWidth, right = 0;
+				for (int r = 0; r < BLOCK_SIZE; r++)
+				{
+					edge_data a, b;
+					span_data span;
+					x1[r] = x2[r] = 0;
+					if (by + r < y0 || by + r >= y1)
+						continue;
+					PolyRow(p, by + r, a, b);
+					if (!SetupSpan(&a, &b, screenWidth, x1[r], x2[r], span))
+						x1[r] = x2[r] = 0;
+					else
+					{
+						left = std::min(left, x1[r]);
+						right = std::max(right, x2[r]);
+					}
+				}
+				for (int bx = left / BLOCK_SIZE * BLOCK_SIZE; bx < right; bx += BLOCK_SIZE)
+					covered += BlockCoverage(bx, x1, x2, mask);
+			}
+		}
+		sink = (float)covered;
+	});
+
+	// every row of every quad once, then fill them with each kernel
+	std::vector<bench_row> rows;
+	for (size_t i = 0; i < quads.size(); i++)
+	{
+		ScanScreenQuad(band, quads[i]);
+		for (int y = band.poly_minY; y < band.poly_maxY; y++)
+		{
+			bench_row r = { y, { band.edge_table[y][0], band.edge_table[y][1] } };
+			rows.push_back(r);
+		}
+	}
+	double pixels = 0;
+	for (size_t i = 0; i < rows.size(); i++)
+	{
+		int x1, x2;
+		span_data span;
+		if (SetupSpan(&rows[i].e[0], &rows[i].e[1], screenWidth, x1, x2, span))
+			pixels += x2 - x1;
+	}
+	if (pixels == 0)
+	{
+		std::cout << "no pixels to fill" << std::endl;
+		return;
+	}
+
+	// a texture of noisy stripes with its mip chain, and the light map
+	std::vector<Uint32> image(256 * 256);
+	RANDOM random(2);
+	for (int i = 0; i < 256 * 256; i++)
+		image[i] = 0xFF000000 | (((i >> 4 & 1) ? 0x806040 : 0x204080) + random(32) * 0x010101);
+	SDL_Surface surface = SDL_Surface();
+	surface.w = surface.h = 256;
+	surface.pitch = 256 * 4;
+	surface.pixels = image.data();
+	MIP_TEXTURE texels;
+	texels.load(&surface);
+	std::vector<unsigned char> light(256 * 256 + 3);
+	for (int j = 0; j < 256; j++)
+		for (int i = 0; i < 256; i++)
+			light[(j << 8) + i] = (unsigned char)(255 - std::min(255, ((128 - i) * (128 - i) + (128 - j) * (128 - j)) / 35));
+	shade_setup shade;
+	shade.light = light.data();
+	shade.colour = 0xFF000000 | texels.average();
+	shade.depthNear = 200 * 16;
+	shade.depthShift = 3;
+
+	std::vector<Uint32> pixelsOut(screenWidth * screenHeight);
+	std::vector<unsigned short> zbuffer(screenWidth * screenHeight);
+	static const char *const names[SHADE_MODES] = { "lit", "texture", "light", "flat", "depth" };
+	for (int mode = 0; mode <= SHADE_MODES; mode++)
+	{
+		// the kernels with the z-buffer, then the lit one for visible spans
+		const bool z = mode < SHADE_MODES;
+		const span_function fill = SpanFunction(z ? mode : SHADE_TEXTURE_LIGHT, z);
+		char name[64];
+		snprintf(name, sizeof(name), "fill_%s_%s", names[z ? mode : SHADE_TEXTURE_LIGHT], z ? "z" : "visible");
+		Measure(name, "pixel", pixels, [&] {
+			std::fill(zbuffer.begin(), zbuffer.end(), (unsigned short)0xFFFF);
+		}, [&] {
+			for (size_t i = 0; i < rows.size(); i++)
+			{
+				int x1, x2;
+				span_data span;
+				if (!SetupSpan(&rows[i].e[0], &rows[i].e[1], screenWidth, x1, x2, span))
+					continue;
+				const int offset = rows[i].y * screenWidth + x1;
+				fill(pixelsOut.data() + offset, zbuffer.data() + offset, x2 - x1, texels.select(span.dtx, span.dty), shade, span);
+			}
+			sink = (float)pixelsOut[screenHeight / 2 * screenWidth + screenWidth / 2];
+		});
+	}
+}
+
+// results written by --output: name, ns per op, ops per second, unit, threshold
+bool SaveResults(const char *path)
+{
+	std::ofstream out(path);
+	if (!out) return false;
+	out << "name,ns_per_op,per_second,unit,threshold_pct" << std::endl;
+	for (size_t i = 0; i < results.size(); i++)
+		out << results[i].name << "," << std::setprecision(6) << results[i].nsPerOp << ","
+			<< results[i].perSecond << "," << results[i].unit << "," << results[i].threshold << std::endl;
+	return (bool)out;
+}
+
+bool LoadResults(const char *path, std::vector<bench_result> &loaded)
+{
+	std::ifstream in(path);
+	if (!in) return false;
+	std::string line;
+	while (std::getline(in, line))
+	{
+		if (line.empty() || line.compare(0, 5, "name,") == 0) continue;
+		std::istringstream fields(line);
+		bench_result b;
+		std::string ns, perSecond, limit;
+		if (!std::getline(fields, b.name, ',') || !std::getline(fields, ns, ',') || !std::getline(fields, perSecond, ',')
+			|| !std::getline(fields, b.unit, ','))
+			return false;
+		b.nsPerOp = atof(ns.c_str());
+		b.perSecond = atof(perSecond.c_str());
+		// a threshold in the baseline overrides --threshold for its benchmark
+		b.threshold = std::getline(fields, limit, ',') && !limit.empty() ? atof(limit.c_str()) : threshold;
+		loaded.push_back(b);
+	}
+	return true;
+}
+
+// how much slower than in the baseline a result is, in percent
+double Change(const bench_result &r, const bench_result &b)
+{
+	return (r.nsPerOp / b.nsPerOp - 1) * 100;
+}
+
+// the benchmarks slower than the baseline allows
+std::vector<std::string> Regressions(const std::vector<bench_result> &baseline)
+{
+	std::vector<std::string> names;
+	for (size_t i = 0; i < results.size(); i++)
+	{
+		const int k = FindResult(baseline, results[i].name);
+		if (k >= 0 && baseline[k].nsPerOp > 0 && Change(results[i], baseline[k]) > baseline[k].threshold)
+			names.push_back(results[i].name);
+	}
+	return names;
+}
+
+/*
+* the change of every benchmark against the baseline, the number of those
+* slower than their threshold allows
+*/
+int CompareResults(const std::vector<bench_result> &baseline)
+{
+	int regressions = 0;
+	std::cout << std::endl << "against " << baselinePath << ":" << std::endl;
+	for (size_t i = 0; i < results.size(); i++)
+	{
+		const bench_result &r = results[i];
+		const int k = FindResult(baseline, r.name);
+		const bench_result *b = k >= 0 ? &baseline[k] : NULL;
+		std::cout << std::left << std::setw(26) << r.name << std::right;
+		if (!b || b->nsPerOp <= 0)
+		{
+			std::cout << "  not in the baseline" << std::endl;
+			continue;
+		}
+		const double change = Change(r, *b);
+		const bool slower = change > b->threshold;
+		regressions += slower;
+		std::cout << std::fixed << std::setprecision(1) << std::setw(9) << std::showpos << change << std::noshowpos
+			<< "%  (" << std::setprecision(3) << b->nsPerOp << " -> " << r.nsPerOp << " ns)"
+			<< (slower ? "  REGRESSION" : change < -b->threshold ? "  faster" : "") << std::endl;
+	}
+	return regressions;
+}
+
+/*
+* command line:
+*   --quick             shorter runs in a single round, for a rough figure
+*   --rounds N          passes over all the benchmarks, 3 by default, each keeps its
+*                       fastest run
+*   --filter TEXT       only the benchmarks with TEXT in their name
+*   --input FILE        scan and fill the quads written by the demo's --record-quads
+*   --output FILE       write the results as CSV
+*   --baseline FILE     compare with the CSV of an earlier run, exit 1 on a regression.
+*                       slower benchmarks are measured again before they count as one
+*   --threshold PCT     slower than the baseline by more than this is a regression,
+*                       10 by default, the baseline's own column takes precedence
+*/
+bool ParseArgs(int argc, char *args[])
+{
+	for (int i = 1; i < argc; i++)
+	{
+		const char *arg = args[i];
+		const bool hasValue = i + 1 < argc;
+		if (!strcmp(arg, "--quick"))
+		{
+			minSeconds = 0.05;
+			repeats = 3;
+			rounds = 1;
+		}
+		else if (!strcmp(arg, "--rounds") && hasValue)
+			rounds = atoi(args[++i]);
+		else if (!strcmp(arg, "--filter") && hasValue)
+			filter = args[++i];
+		else if (!strcmp(arg, "--input") && hasValue)
+			inputPath = args[++i];
+		else if (!strcmp(arg, "--output") && hasValue)
+			outputPath = args[++i];
+		else if (!strcmp(arg, "--baseline") && hasValue)
+			baselinePath = args[++i];
+		else if (!strcmp(arg, "--threshold") && hasValue)
+			threshold = atof(args[++i]);
+		else
+		{
+			std::cout << "Unknown or incomplete option: " << arg << std::endl;
+			return false;
+		}
+	}
+	if (threshold <= 0)
+	{
+		std::cout << "--threshold must be positive" << std::endl;
+		return false;
+	}
+	if (rounds < 1)
+	{
+		std::cout << "--rounds must be at least 1" << std::endl;
+		return false;
+	}
+	return true;
+}
+
+void RunBenchmarks(const std::vector<screen_quad> &quads)
+{
+	MathBenchmarks();
+	GeometryBenchmarks();
+	RasterBenchmarks(quads);
+}
+
+int main(int argc, char *args[])
+{
+	if (!ParseArgs(argc, args))
+		return 1;
+	std::vector<bench_result> baseline;
+	if (baselinePath && !LoadResults(baselinePath, baseline))
+	{
+		std::cout << "Baseline can't be read: " << baselinePath << std::endl;
+		return 1;
+	}
+
+	std::vector<screen_quad> quads;
+	if (inputPath)
+	{
+		if (!LoadQuads(inputPath, screenWidth, screenHeight, quads))
+		{
+			std::cout << "Quads can't be read: " << inputPath << std::endl;
+			return 1;
+		}
+		std::cout << quads.size() << " quads from " << inputPath << ", " << screenWidth << "x" << screenHeight << std::endl;
+	}
+	else
+		FrameQuads(quads);
+
+	for (int r = 0; r < rounds; r++)
+		RunBenchmarks(quads);
+	// a busy host makes anything look slower, but not for long, so only
+	// what stays slower over a few more rounds is a regression
+	for (int r = 0; r < CONFIRM_ROUNDS && baselinePath; r++)
+	{
+		confirming = Regressions(baseline);
+		if (confirming.empty())
+			break;
+		RunBenchmarks(quads);
+	}
+	confirming.clear();
+	PrintResults();
+
+	if (outputPath && !SaveResults(outputPath))
+	{
+		std::cout << "Results can't be written: " << outputPath << std::endl;
+		return 1;
+	}
+	if (baselinePath && CompareResults(baseline))
+		return 1;
+	return 0;
+}
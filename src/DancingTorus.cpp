@@ -3,100 +3,383 @@
 #include <SDL_mixer.h>
 #include <iostream>
 #include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include <algorithm>
+#include <mutex>
+#include <condition_variable>
 
 #include "vector.h"
 #include "matrix.h"
-
-//Screen dimension constants
-const int SCREEN_WIDTH = 640;
-const int SCREEN_HEIGHT = 480;
+#include "random.h"
+#include "benchmark.h"
+#include "span.h"
+#include "workers.h"
+#include "sbuffer.h"
+#include "raster.h"
+#include "arena.h"
+#include "transform.h"
+#include "cull.h"
+#include "clip.h"
+#include "beat.h"
+#include "pacer.h"
+#include "audioclock.h"
+#include "export.h"
+#include "timeline.h"
+#include "profile.h"
+
+//Screen dimensions, set with --size
+int screenWidth = 640;
+int screenHeight = 480;
+#define MAX_SCREEN_WIDTH 3840
+#define MAX_SCREEN_HEIGHT 2160
 
 //The window we'll be rendering to
 SDL_Window* window = NULL;
 //The surface contained by the window
 SDL_Surface* screenSurface = NULL;
 
+// the frame as we draw it, ARGB8888 whatever the window uses, with rows
+// aligned to cache lines. it is the screen surface itself headless and
+// with vsync, the window gets the part that changed copied over
+SDL_Surface* backbuffer = NULL;
+
+// a box of pixels, right and bottom exclusive, empty when it is all 0
+typedef struct {
+	int x1, y1, x2, y2;
+} dirty_box;
+int renderWidth, renderHeight;
+
+// temporal reuse: a torus whose vertices would move less than
+// reuseTolerance pixels from the pose it was last transformed with keeps
+// them, when no torus moved the last frame is shown again, and when only
+// some did just the boxes around where those are and were are drawn
+// again. the window takes REUSE_TOLERANCE, the headless runs only reuse
+// poses that didn't change at all so every frame is exact
+#define REUSE_TOLERANCE 0.5f
+bool reuseFrames = true;
+float reuseTolerance = REUSE_TOLERANCE;
+bool reuseGiven = false;
+bool dynamicResolution = false;
+// the render time we aim for, a bit under the frame time of FPS
+float frameBudget = 1000.0f / 60 * 0.8f;
+// render size relative to the screen, and the smoothed render time
+float resolutionScale = 1;
+float renderTime = 0;
+#define MIN_RESOLUTION_SCALE 0.25f
+
 #define FPS 60
-int lastTime = 0, currentTime, deltaTime;
+int deltaTime;
+// the time step of the headless runs
 float msFrame = 1 / (FPS / 1000.0f);
 
+// how the window frames are paced, set with --pace and --fps
+int paceMode = PACE_FIXED;
+int framesPerSecond = FPS;
+FRAME_PACER framePacer;
+// performance counter ticks since the first frame, and their whole
+// milliseconds handed out as deltaTime so far
+Uint64 frameClock = 0, frameClockMs = 0;
+// with vsync the frame is drawn into an own surface and presented
+// through a renderer, which waits for the vertical blank
+SDL_Renderer *presenter = NULL;
+SDL_Texture *presentTexture = NULL;
+
+/////////////////// HEADLESS ////////////////////
+
+// render into memory with a fixed time step, no window and no audio
+bool headless = false;
+int headlessFrames = 600;
+bool framesGiven = false;
+unsigned int randomSeed = 1;
+// golden checksums to verify against, or to write out
+const char *goldenInput = NULL;
+const char *goldenOutput = NULL;
+// print one line per frame, and the tempo when the detected one changes
+bool verboseFrames = false;
+// where the timers and counters of the stages go, with TORUS_PROFILE
+const char *profilePath = NULL;
+// the quads of the last headless frame, for the kernel benchmarks
+const char *recordPath = NULL;
+// time the vertex transform against the old one vertex at a time path
+bool benchTransform = false;
+bool benchMath = false;
+bool checkMath = false;
+// the SIMD math may differ from the operators by this much, relative to
+// the size of the result. it does the same arithmetic, so it only differs
+// at all when the compiler fuses multiply-adds in one of them
+#define MATH_TOLERANCE 1e-5f
+#define MATH_CHECK_COUNT 100000
+// render the song at a fixed frame rate and write the frames out
+const char *exportPath = NULL;
+int exportFormat = -1;
+int exportFps = FPS;
+int exportThreads = 0;
+
 /////////////////// 3D OBJECT ///////////////////
 
 // Texture
 SDL_Surface* texture;
+// the same texture tiled with its mip levels for the span kernel
+MIP_TEXTURE texels;
+// sample the level that fits each span, or always the full size one
+bool useMipmaps = true;
 // buffer of 256x256 containing the light pattern (fake phong ;)
 unsigned char *light;
+// how the spans are shaded, fixed or changing every few beats
+int shadeMode = SHADE_TEXTURE_LIGHT;
+bool shadeOnBeats = false;
+#define SHADE_BEATS 4
+
+// properties of our torus, the tessellation is set with --mesh and F3/F4
+// halve or double it at runtime
+int meshSlices = 32, meshSpans = 16;
+// the vertex indices and texture refs fit easily, memory is the limit
+#define MAX_QUADS (16 * 1024 * 1024)
+float extRadius = 64, intRadius = 24;
+
+// the choreography, seeded for the random moves on the beats
+TIMELINE timeline;
+
+// the 4 vertices of each quad, 16 bits while the mesh is small enough.
+// that's all the rasterizer reads per quad, the normals and centres used
+// by the culling are in separate face streams, and the texture coordinates
+// follow from the position of the quad in the grid
+typedef struct {
+	Uint16 *p16;
+	Uint32 *p32;
+} quad_indices;
 
-// our 16 bit zbuffer
-unsigned short *zbuffer;
-
-// properties of our torus
-#define SLICES 32
-#define SPANS 16
-#define EXT_RADIUS 64
-#define INT_RADIUS 24
-
-#define BASE_ANGULAR_VELOCITY 0.01f
-#define ANGULAR_VELOCITY_DECAY 0.91f
-#define CONSTANT_ANGULAR_VELOCITY 0.001f
-
-//Current rotation angles
-float angleX = 0, angleY = 0, angleZ = 0;
-
-VECTOR angularVelocity = VECTOR(0, 0, 0);
-
-#define BASE_BULK_MODIFIER 0
-#define BULK_CHANGE_SPEED 0.05f
-#define BULK_SPEED_DECAY 0.95f
+inline int QuadVertex(const quad_indices &q, const int n, const int k)
+{
+	return q.p16 ? q.p16[n * 4 + k] : (int)q.p32[n * 4 + k];
+}
 
-float bulk = BASE_BULK_MODIFIER;
-float bulkChangeSpeed = BULK_CHANGE_SPEED;
+// one tessellation of the torus. the position of the vertices is kept in
+// object space here and in screen space per instance, the coords in world
+// space don't need to be stored. both are separate aligned streams per
+// component, so the transform can work on 4 or 8 at a time
+typedef struct {
+	int slices, spans;
+	vertex_streams org;
+	quad_indices quads;
+	face_streams faces;
+	// static texture coordinates of the grid lines, slices + 1 and spans + 1
+	int *sliceRefs, *spanRefs;
+	int num_polies, num_vertices;
+} torus_mesh;
+
+// level of detail: each level has half the slices and spans of the one
+// before, the level drawn is the coarsest one whose quads are still at most
+// lodQuadSize pixels along the outer ring at the current projected size
+#define MAX_LODS 8
+// a coarser level is only taken when its quads are this much below the limit
+#define LOD_HYSTERESIS 0.8f
+torus_mesh meshes[MAX_LODS];
+int num_meshes;
+// 0 keeps one level for a single torus and all of them for a scene
+int lodLevels = 0;
+float lodQuadSize = 8;
+
+// time spent in the stages of the last frames, for the stress mode
+typedef struct {
+	Uint64 transform, cull, fill;
+} stage_ticks;
+
+// render the choreography at growing tessellations and report how
+// the stages scale
+bool stressMode = false;
+int stressMaxQuads = 2 * 1024 * 1024;
+#define STRESS_FRAMES 120
+
+// bands are handed out dynamically, more bands than threads keeps them
+// all busy even though the torus only covers the middle of the screen
+#define BANDS_PER_THREAD 4
+#define BAND_MIN_HEIGHT TILE_SIZE
+
+// hierarchical z: the z-buffer is split in tiles that know the nearest and
+// farthest depth they hold, so spans and whole polies behind what's already
+// drawn are rejected without touching the pixels. a tile last written in an
+// older frame counts as cleared, which replaces the full memset per frame.
+// band boundaries are tile aligned, so each tile belongs to one thread
+#define TILE_SIZE 8
+// the block rasterizer asks the hi-z about one tile per block
+static_assert(BLOCK_SIZE == TILE_SIZE, "blocks and hi-z tiles must match");
+typedef struct {
+	unsigned short minZ, maxZ;
+	// frame the tile was last cleared in
+	unsigned int frame;
+	// writes may have lowered the farthest depth, maxZ is just a bound
+	bool dirty;
+} hiz_tile;
 
-#define BASE_SCALE 1.0f
-#define SCALE_CHANGE_SPEED 0.005f
-#define SCALE_CHANGE_DECAY 0.91f
+int hizWidth, hizHeight;
+bool useHiZ = true;
 
-float uniformScale = 0;
-float scaleChangeSpeed = SCALE_CHANGE_SPEED;
+// draw the polies roughly front to back, sorted on their centre
+bool depthSort = true;
 
-// we need two structures, one that holds the position of all vertices
-// in object space,  and the other in screen space. the coords in world
-// space doesn't need to be stored
-struct
-{
-	VECTOR *vertices, *normals;
-} org, cur;
+int num_bands;
 
-// this structure contains all the relevant data for each poly
-typedef struct
-{
-	int p[4];  // pointer to the vertices
-	int tx[4]; // static X texture index
-	int ty[4]; // static Y texture index
-	VECTOR normal, centre;
-} POLY;
+WORKER_POOL workers;
+// 0 means one thread per CPU
+int numThreads = 0;
 
-POLY *polies;
+// hidden surface removal: z test every pixel of every span, or collect
+// the spans in a span buffer and shade each pixel once
+enum { HSR_ZBUFFER, HSR_SBUFFER };
+int hsrMode = HSR_ZBUFFER;
 
-// count values
-int num_polies;
-int num_vertices;
+// how the z-buffer polies are rasterized: scanlines through the edge table,
+// or 8x8 blocks tested against the edges. both draw the same pixels
+enum { RASTER_SCANLINE, RASTER_BLOCKS };
+int rasterMode = RASTER_SCANLINE;
 
-// one entry of the edge table
+// a poly that survived culling, with its extent on screen and its depth
 typedef struct {
-	int x, px, py, tx, ty, z;
-} edge_data;
+	int n;
+	int minX, maxX, minY, maxY;
+	// nearest vertex, in z-buffer units
+	int minZ;
+	// depth of the centre, for sorting
+	float depth;
+	// the torus it belongs to
+	int instance;
+	// index in the clipped polygons, -1 when it isn't clipped, or
+	// CLIP_AGAIN when it is but the pool had no room for it
+	int clip;
+} visible_poly;
+
+// the visible quads that cross the near plane or the guard band are
+// clipped to polygons in camera and screen space. they only come from the
+// quads along the edges of what is in view, the pool has room for one
+// torus' worth up to CLIP_POOL_MAX. the quads that don't get a slot are
+// clipped again by every band they cross, which gives the same polygon
+#define CLIP_POOL_MAX 65536
+#define CLIP_AGAIN -2
+int clipCapacity;
+
+// how far in front of the camera the torus is
+float cameraDistance = 250;
 
-// store two edges per horizontal line
-edge_data edge_table[SCREEN_HEIGHT][2];
-
-// remember the highest and the lowest point of the polygon
-int poly_minY, poly_maxY;
+/*
+* one torus of the scene. they all share the meshes and the choreography,
+* each one stands somewhere else, dances a little later and takes the beats
+* harder or softer than the others, and picks its own level of detail
+*/
+typedef struct {
+	// where it is, how big, the turn it has under the dance, how many ms
+	// behind the music it dances and how much of the beats it takes
+	VECTOR position;
+	float size;
+	MATRIX base;
+	float phase, response;
+	// this frame's orientation, scale and bulk, and its level of detail
+	MATRIX rot;
+	float uniformScale, bulk;
+	int level;
+	// the transform of the frame, the clipping redoes it for a few vertices
+	transform_setup setup;
+	// the vertices in screen space, sized for the finest level
+	vertex_streams cur;
+	// how many of its quads are visible, at its place in visible
+	int visibleCount;
+	// transformed this frame, or kept from a pose close enough
+	bool moved;
+	// the pixels its visible quads covered in the last frame drawn
+	dirty_box box;
+} torus_instance;
+
+// a single torus in front of the camera, or a grid of them with --instances
+int instanceCount = 1;
+// the grid cells are this much wider than the tori in them
+#define INSTANCE_SPACING 1.25f
+// the tori furthest from the middle dance this many ms behind it
+#define INSTANCE_WAVE_MS 250
+// the beats move each torus between these fractions of the choreography,
+// never more: its shrinking beats would turn a torus inside out
+#define INSTANCE_RESPONSE_MIN 0.5f
+#define INSTANCE_RESPONSE_MAX 1.0f
 
-// object position and orientation
-MATRIX objrot;
-VECTOR objpos;
-MATRIX objScale;
+/*
+* everything a frame changes as it is drawn: the poses and vertices of the
+* tori, the visible polies, the bands, the z-buffer and its tiles, the
+* dirty boxes and the frame itself, all of it carried on to the next frame
+* drawn with it. the window and the headless runs draw every frame in
+* mainFrame, the export draws several frames at once, each in its own
+*/
+typedef struct {
+	// the music time the frame shows, its beat and the shading it takes
+	int musicTime, musicBeat;
+	int shadeMode;
+	// the span routines for that, picked in update3D for the whole frame
+	shade_setup shade;
+	span_function drawSpanZ, drawSpanVisible;
+
+	// the tori, transformed and culled in parallel, each one by a single
+	// worker. every worker has room for the quads facing the camera of the
+	// torus it is on
+	std::vector<torus_instance> instances;
+	std::atomic<int> nextInstance;
+	// the level of detail of each torus when the export picked them in
+	// frame order, empty when each torus picks its own
+	std::vector<int> levels;
+	int *workerFaces;
+	// the visible polies of every torus, drawn in this order. each torus
+	// has room for all the quads of the finest level while it is culled
+	visible_poly *visible;
+	int num_visible;
+	clip_polygon *clipped;
+	std::atomic<int> clippedCount;
+	std::atomic<int> clipOverflow;
+
+	raster_band *bands;
+	std::atomic<int> nextBand;
+	// our 16 bit zbuffer, and its tiles
+	unsigned short *zbuffer;
+	hiz_tile *hiz;
+	unsigned int hizFrame;
+
+	// what the rasterizer draws into: the backbuffer, or with dynamic
+	// resolution the top left renderWidth x renderHeight of an off-screen
+	// surface that is scaled up to the backbuffer every frame. an export
+	// frame drawn next to others has a surface of its own
+	SDL_Surface *renderSurface;
+	// the pixels the tori cover this frame and covered the last one. only
+	// their union is cleared and presented, the rest of the frame is still
+	// background
+	dirty_box frameBox, lastBox, clearBox, presentBox;
+	// what the rasterizer draws this frame: all of the render area, or
+	// when only some of the tori moved the box around where they are and
+	// were
+	dirty_box drawBox;
+
+	// the last frame can't be shown again: the meshes or the render size
+	// changed, or nothing was drawn yet
+	bool redrawFrame;
+	// this frame is the last one again, and the shading that one was drawn with
+	bool frameReused;
+	int drawnShadeMode;
+	// only the moved tori are drawn again, over what the last frame left
+	bool partialFrame;
+	// drawn on the calling thread alone, the worker pool draws other frames
+	bool alone;
+
+	// totals since the last change of mode, for the overdraw report
+	Uint64 statFrames, statSpanPixels, statTestedPixels, statShadedPixels, statHiddenPolies;
+	Uint64 reusedFrames, partialFrames;
+	stage_ticks stageTicks;
+} frame_state;
+
+frame_state mainFrame;
+
+// the light map, the z-buffer, the edge tables, the meshes and everything
+// sized by them come from here. the meshes and what depends on them are
+// above meshMark and rebuilt from there
+ARENA arena;
+ARENA::arena_mark meshMark;
+bool hugePages = false;
 
 /////////////////////////////////////////////////
 
@@ -109,44 +392,179 @@ int MusicCurrentTime = 0;
 int MusicCurrentTimeBeat = 0;
 int MusicCurrentBeat = 0;
 int MusicPreviousBeat = -1;
+const char *musicFile = "resources/Blastculture-Gravitation.ogg";
+// seconds into the song to start at
+float startTime = 0;
+
+// the beats come from the BPM_MUSIC clock, or from the music as it plays
+#define BEATS_FIXED 0
+#define BEATS_DETECT 1
+int beatSource = BEATS_DETECT;
+// runs in SDL_mixer's post mix callback, hands its results over in a ring
+BEAT_DETECTOR beatDetector;
+Uint16 musicFormat;
+int musicChannels;
+// latest band energies and tempo from the analysis, and the bass level
+// held over the last moments, which sizes the moves on the next beat
+float musicBands[ANALYSIS_BANDS];
+float musicTempo = 0;
+float musicBass = 0;
+// an event that waits for its sample to be heard
+audio_event audioEvent;
+bool eventPending = false;
+
+// the music time comes from the audio output, not from adding up frames
+AUDIO_CLOCK audioClock;
+// samples per chunk the device asks for, fewer means less latency
+int audioBuffer = 1024;
+// output latency beyond the mixer's chunk (e.g. wireless headphones), ms
+float avOffset = 0;
+int musicFrequency = 44100;
+int musicFrameBytes = 4;
+// mixed samples when the music started, and the sample heard this frame
+Sint64 musicStart = 0;
+double audioPosition = 0;
+// print the A/V offsets every avLogInterval seconds, 0 never
+float avLogInterval = 0;
+int avLogNext = 0;
+// the music time by adding up deltaTime, how late the beats were shown
+Sint64 frameMusicTime = 0;
+double beatLagSum = 0, beatLagMax = 0;
+int beatLagCount = 0;
 
 /////////////////////////////////////////////////
 
+bool parseArgs(int argc, char* args[]);
 bool initSDL();
+int runHeadless();
+int runExport();
+int ExportTime(int frame);
+static void ExportFrames(int worker, void *data);
+frame_state *CreateFrame();
+void FreeFrame(frame_state *fs);
+double SongLength();
+void runTransformBenchmark();
+bool runMathBenchmark();
+float MathDifference(int count, unsigned int seed);
 void update();
-void render();
+void render(frame_state &fs);
 
 void close();
+void present();
+SDL_Surface *CreateBackbuffer(int width, int height);
+void FreeBackbuffer(SDL_Surface *surface);
 void waitTime();
 
 void init3D();
-void update3D();
-void render3D();
-
-void InitEdgeTable();
-void ScanEdge(VECTOR p1, int tx1, int ty1, int px1, int py1, VECTOR p2, int tx2, int ty2, int px2, int py2);
-void DrawSpan(int y, edge_data *p1, edge_data *p2);
-void DrawPolies();
-void init_object();
-void TransformPts();
+void update3D(frame_state &fs);
+void render3D(frame_state &fs);
+void RunJob(frame_state &fs, void (*job)(int worker, void *data));
+
+void initRaster();
+void AllocRaster(frame_state &fs);
+void SplitBands(frame_state &fs);
+void setRenderSize(int width, int height);
+void updateResolution(double ms);
+void InitEdgeTable(raster_band &band, const visible_poly &vp);
+void DrawSpan(frame_state &fs, raster_band &band, int y, edge_data *p1, edge_data *p2);
+bool ClipSpan(const frame_state &fs, int &x1, int &x2, span_data &span);
+hiz_tile &TouchTile(frame_state &fs, int tx, int ty);
+int TileMaxZ(frame_state &fs, int tx, int ty);
+bool Behind(frame_state &fs, int tx, int ty, int z, bool rescan);
+void ShadeBand(frame_state &fs, raster_band &band);
+bool PolyTiles(const frame_state &fs, raster_band &band, const visible_poly &vp, int &tx0, int &ty0, int &tx1, int &ty1);
+void MarkPolyTiles(frame_state &fs, raster_band &band, const visible_poly &vp);
+bool PolyHidden(frame_state &fs, raster_band &band, const visible_poly &vp);
+void ScanQuad(const frame_state &fs, raster_band &band, const visible_poly &vp);
+void ScanClipped(raster_band &band, const clip_polygon &p);
+void QuadCorners(const frame_state &fs, const visible_poly &vp, quad_corner c[4]);
+bool SetupBlockPoly(const frame_state &fs, const visible_poly &vp, block_poly &p);
+void DrawBlocks(frame_state &fs, raster_band &band, block_poly &p);
+void DrawRun(frame_state &fs, raster_band &band, int y, int a, int b, int x1, span_data span);
+bool RecordQuads(const char *path);
+void DrawBand(frame_state &fs, raster_band &band);
+void setHsrMode(int mode);
+void setRasterMode(int mode);
+void PrintOverdraw();
+bool ClipQuadPolygon(const frame_state &fs, const torus_instance &t, visible_poly &vp, clip_polygon &p);
+bool ClipQuad(frame_state &fs, torus_instance &t, visible_poly &vp);
+const clip_polygon &ClippedPolygon(const frame_state &fs, const visible_poly &vp, clip_polygon &scratch);
+void CullInstance(frame_state &fs, int index, int *faces);
+void DrawPolies(frame_state &fs);
+void TrackDirtyBox(frame_state &fs);
+dirty_box PadBox(const dirty_box &box);
+dirty_box BoxUnion(const dirty_box &a, const dirty_box &b);
+void init_object(torus_mesh &mesh, int slices, int spans);
+void initMeshes();
+void AllocPolies(frame_state &fs, int threads);
+void initInstances();
+void SelectLod(torus_instance &t);
+int runStress();
+float PoseMovement(const torus_instance &t, const MATRIX &rot, float uniformScale, float bulk);
+void PoseInstance(const torus_instance &t, int time, MATRIX &rot, float &uniformScale, float &bulk);
+void TransformInstance(frame_state &fs, torus_instance &t);
+static void TransformInstances(int worker, void *data);
 
 void initMusic();
+void analyseMusic(void *udata, Uint8 *stream, int len);
 void updateMusic();
+void ApplyAudioEvent(const audio_event &e);
+void BeatShown(double lag);
+void LogAudioSync();
 
 int main( int argc, char* args[] )
 {
+	if (!parseArgs(argc, args))
+		return 1;
+
+	// needs neither SDL nor the resources, so it can run as a test anywhere
+	if (checkMath)
+	{
+		const float difference = MathDifference(MATH_CHECK_COUNT, randomSeed);
+		std::cout << "math: SIMD against operators over " << MATH_CHECK_COUNT << " random inputs, max difference "
+			<< difference << (difference > MATH_TOLERANCE ? ", FAILED" : "") << std::endl;
+		return difference > MATH_TOLERANCE ? 1 : 0;
+	}
+
 	//Start up SDL and create window
 	if (!initSDL())
 	{
 		std::cout << "Failed to initialize!\n";
 		return 1;
 	}
+	else if (headless)
+	{
+		IMG_Init(IMG_INIT_PNG);
+		init3D();
+		initMusic();
+		if (benchTransform || benchMath)
+		{
+			bool ok = true;
+			if (benchTransform)
+				runTransformBenchmark();
+			if (benchMath)
+				ok = runMathBenchmark();
+			close();
+			return ok ? 0 : 1;
+		}
+		int result = stressMode ? runStress() : exportPath ? runExport() : runHeadless();
+		if (profilePath && !PROFILE_DUMP(profilePath) && !result)
+			result = 1;
+		close();
+		return result;
+	}
 	else
 	{
 		IMG_Init(IMG_INIT_PNG);
 		init3D();
         initMusic();
 
+		int fps = framesPerSecond;
+		SDL_DisplayMode display;
+		if (paceMode == PACE_VSYNC)
+			fps = SDL_GetWindowDisplayMode(window, &display) == 0 && display.refresh_rate > 0 ? display.refresh_rate : FPS;
+		framePacer.start(paceMode, fps);
+
 		//Main loop flag
 		bool quit = false;
 
@@ -163,6 +581,38 @@ int main( int argc, char* args[] )
 					if (e.key.keysym.scancode == SDL_SCANCODE_ESCAPE) {
 						quit = true;
 					}
+					// switch between z-buffer and span buffer
+					if (e.key.keysym.scancode == SDL_SCANCODE_F2) {
+						PrintOverdraw();
+						setHsrMode(hsrMode == HSR_ZBUFFER ? HSR_SBUFFER : HSR_ZBUFFER);
+					}
+					// switch between scanlines and blocks
+					if (e.key.keysym.scancode == SDL_SCANCODE_F8)
+						setRasterMode(rasterMode == RASTER_SCANLINE ? RASTER_BLOCKS : RASTER_SCANLINE);
+					// frame time histogram of the last frames
+					if (e.key.keysym.scancode == SDL_SCANCODE_F5)
+						framePacer.print(std::cout);
+					// the stage timers and counters so far
+					if (e.key.keysym.scancode == SDL_SCANCODE_F7 && profilePath)
+						PROFILE_DUMP(profilePath);
+					// next shading mode, and keep it
+					if (e.key.keysym.scancode == SDL_SCANCODE_F6) {
+						shadeMode = (mainFrame.shadeMode + 1) % SHADE_MODES;
+						shadeOnBeats = false;
+					}
+					// halve or double the tessellation
+					if (e.key.keysym.scancode == SDL_SCANCODE_F3 && meshSlices >= 6 && meshSpans >= 6) {
+						meshSlices /= 2;
+						meshSpans /= 2;
+						initMeshes();
+						std::cout << "Mesh: " << meshSlices << "x" << meshSpans << std::endl;
+					}
+					if (e.key.keysym.scancode == SDL_SCANCODE_F4 && (Sint64)meshSlices * meshSpans * 4 <= MAX_QUADS) {
+						meshSlices *= 2;
+						meshSpans *= 2;
+						initMeshes();
+						std::cout << "Mesh: " << meshSlices << "x" << meshSpans << std::endl;
+					}
 				}
 				//User requests quit
 				if (e.type == SDL_QUIT)
@@ -175,12 +625,16 @@ int main( int argc, char* args[] )
 			update();
 
 			//Render
-			render();
+			render(mainFrame);
 
 			//Update the surface
-			SDL_UpdateWindowSurface(window);
+			present();
 			waitTime();
 		}
+		PrintOverdraw();
+		framePacer.print(std::cout);
+		if (profilePath)
+			PROFILE_DUMP(profilePath);
 	}
 
 	//Free resources and close SDL
@@ -189,8 +643,354 @@ int main( int argc, char* args[] )
 	return 0;
 }
 
+/*
+* command line:
+*   --headless          render off-screen with a fixed time step
+*   --size WxH          window size, up to 3840x2160
+*   --dynamic-res       render at a lower resolution when frames take too long
+*   --frame-budget MS   render time the dynamic resolution aims for
+*   --frames N          number of frames to render in headless mode
+*   --seed S            seed for the choreography
+*   --golden FILE       compare each frame against stored checksums
+*   --write-golden FILE store the checksums of this run
+*   --verbose           print timing and checksum of every frame, the detected tempo
+*                       and the dropped analysis events
+*   --record-quads FILE write the quads of the last headless frame, for the kernel benchmarks
+*   --profile FILE      write the stage timers and counters on exit (F7 any time), a Chrome
+*                       trace or for .csv a line per frame. needs a TORUS_PROFILE build
+*   --bench-transform   time the vertex transform against the reference path
+*   --bench-math        time the matrix and vector operators against their SIMD versions,
+*                       fails when they differ by more than MATH_TOLERANCE
+*   --check-math        only compare them, on random inputs (the CMake test)
+*   --threads N         rasterizer threads, 0 for one per CPU; the export draws a frame on each
+*   --hsr zbuffer|sbuffer  hidden surface removal (F2 switches at runtime)
+*   --raster scanline|blocks  rasterize the z-buffer polies by scanline or in 8x8
+*                       blocks (F8 switches at runtime)
+*   --no-hiz            plain z-buffer, cleared every frame
+*   --reuse PIXELS      keep a torus that would move less than this, draw only the
+*                       moved ones again and show the last frame again when none moved,
+*                       REUSE_TOLERANCE in the window and 0 (unchanged poses) headless
+*   --no-reuse          transform and draw every frame
+*   --no-mipmaps        sample the full size texture everywhere
+*   --shade lit|texture|light|flat|depth|beats  how the torus is shaded, beats
+*                       changes it every few beats (F6 cycles at runtime)
+*   --order depth|mesh  draw the polies front to back or in mesh order
+*   --mesh SxP          slices and spans of the torus (F3/F4 halve/double them)
+*   --radii R,r         radius of the ring and of the tube
+*   --camera-distance Z how far the torus is from the camera, 250 by default
+*   --lod N             keep N tessellations and pick one by projected size,
+*                       by default 1 for a single torus and all there are for a scene
+*   --instances N       dance N tori on a grid instead of one
+*   --huge-pages        back the meshes and the frame buffers with huge pages (Linux)
+*   --lod-quad PIXELS   largest quad edge along the ring the LOD allows
+*   --stress            time transform, cull and fill at growing tessellations
+*   --stress-max QUADS  largest tessellation of the stress mode
+*   --pace uncapped|fixed|vsync  how the window frames are paced (F5 prints their times)
+*   --fps N             frame rate of the fixed pacing
+*   --music FILE        the track to play and dance to
+*   --start SECONDS     start that far into the song
+*   --beats fixed|detect  beats at BPM_MUSIC or detected in the music
+*   --audio-buffer N    samples per audio chunk, 1024 by default
+*   --av-offset MS      output latency beyond the audio buffer
+*   --av-log SECONDS    print the A/V offsets this often
+*   --export PATH       render the song and write its frames: a pattern like frame%05d.png,
+*                       a .y4m file, a raw BGRA file, or - for stdout
+*   --export-format png|y4m|raw  instead of going by the extension
+*   --export-fps N      frame rate of the export, 60 by default
+*   --export-threads N  frames encoded at once, 0 for one per CPU
+*/
+bool parseArgs(int argc, char* args[])
+{
+	for (int i = 1; i < argc; i++)
+	{
+		const char *arg = args[i];
+		const bool hasValue = i + 1 < argc;
+		if (!strcmp(arg, "--headless"))
+			headless = true;
+		else if (!strcmp(arg, "--size") && hasValue)
+		{
+			if (sscanf(args[++i], "%dx%d", &screenWidth, &screenHeight) != 2
+				|| screenWidth < 64 || screenHeight < 64
+				|| screenWidth > MAX_SCREEN_WIDTH || screenHeight > MAX_SCREEN_HEIGHT)
+			{
+				std::cout << "--size needs WIDTHxHEIGHT, from 64x64 up to " << MAX_SCREEN_WIDTH << "x" << MAX_SCREEN_HEIGHT << std::endl;
+				return false;
+			}
+		}
+		else if (!strcmp(arg, "--dynamic-res"))
+			dynamicResolution = true;
+		else if (!strcmp(arg, "--frame-budget") && hasValue)
+			frameBudget = (float)atof(args[++i]);
+		else if (!strcmp(arg, "--frames") && hasValue)
+		{
+			headlessFrames = atoi(args[++i]);
+			framesGiven = true;
+		}
+		else if (!strcmp(arg, "--start") && hasValue)
+			startTime = (float)std::max(0.0, atof(args[++i]));
+		else if (!strcmp(arg, "--seed") && hasValue)
+			randomSeed = (unsigned int)strtoul(args[++i], NULL, 0);
+		else if (!strcmp(arg, "--golden") && hasValue)
+			goldenInput = args[++i];
+		else if (!strcmp(arg, "--write-golden") && hasValue)
+			goldenOutput = args[++i];
+		else if (!strcmp(arg, "--verbose"))
+			verboseFrames = true;
+		else if (!strcmp(arg, "--record-quads") && hasValue)
+			recordPath = args[++i];
+		else if (!strcmp(arg, "--profile") && hasValue)
+		{
+#if defined(TORUS_PROFILE)
+			profilePath = args[++i];
+#else
+			std::cout << "--profile needs a build configured with TORUS_PROFILE" << std::endl;
+			return false;
+#endif
+		}
+		else if (!strcmp(arg, "--bench-transform"))
+			benchTransform = headless = true;
+		else if (!strcmp(arg, "--bench-math"))
+			benchMath = headless = true;
+		else if (!strcmp(arg, "--check-math"))
+			checkMath = true;
+		else if (!strcmp(arg, "--threads") && hasValue)
+			numThreads = atoi(args[++i]);
+		else if (!strcmp(arg, "--no-hiz"))
+			useHiZ = false;
+		else if (!strcmp(arg, "--reuse") && hasValue)
+		{
+			reuseTolerance = (float)atof(args[++i]);
+			reuseGiven = true;
+		}
+		else if (!strcmp(arg, "--no-reuse"))
+			reuseFrames = false;
+		else if (!strcmp(arg, "--no-mipmaps"))
+			useMipmaps = false;
+		else if (!strcmp(arg, "--mesh") && hasValue)
+		{
+			if (sscanf(args[++i], "%dx%d", &meshSlices, &meshSpans) != 2 || meshSlices < 3 || meshSpans < 3
+				|| (Sint64)meshSlices * meshSpans > MAX_QUADS)
+			{
+				std::cout << "--mesh needs SLICESxSPANS, at least 3x3 and at most " << MAX_QUADS << " quads" << std::endl;
+				return false;
+			}
+		}
+		else if (!strcmp(arg, "--radii") && hasValue)
+		{
+			if (sscanf(args[++i], "%f,%f", &extRadius, &intRadius) != 2 || intRadius <= 0 || extRadius <= intRadius)
+			{
+				std::cout << "--radii needs RING,TUBE with the ring larger than the tube" << std::endl;
+				return false;
+			}
+		}
+		else if (!strcmp(arg, "--camera-distance") && hasValue)
+			cameraDistance = (float)atof(args[++i]);
+		else if (!strcmp(arg, "--huge-pages"))
+			hugePages = true;
+		else if (!strcmp(arg, "--instances") && hasValue)
+			instanceCount = std::max(atoi(args[++i]), 1);
+		else if (!strcmp(arg, "--lod") && hasValue)
+			lodLevels = std::min(std::max(atoi(args[++i]), 1), MAX_LODS);
+		else if (!strcmp(arg, "--lod-quad") && hasValue)
+			lodQuadSize = (float)atof(args[++i]);
+		else if (!strcmp(arg, "--stress"))
+			stressMode = headless = true;
+		else if (!strcmp(arg, "--stress-max") && hasValue)
+			stressMaxQuads = std::min(atoi(args[++i]), MAX_QUADS);
+		else if (!strcmp(arg, "--order") && hasValue)
+		{
+			const char *order = args[++i];
+			if (strcmp(order, "depth") && strcmp(order, "mesh"))
+			{
+				std::cout << "Unknown poly order: " << order << std::endl;
+				return false;
+			}
+			depthSort = !strcmp(order, "depth");
+		}
+		else if (!strcmp(arg, "--pace") && hasValue)
+		{
+			const char *mode = args[++i];
+			if (!strcmp(mode, "uncapped"))
+				paceMode = PACE_UNCAPPED;
+			else if (!strcmp(mode, "fixed"))
+				paceMode = PACE_FIXED;
+			else if (!strcmp(mode, "vsync"))
+				paceMode = PACE_VSYNC;
+			else
+			{
+				std::cout << "Unknown pacing mode: " << mode << std::endl;
+				return false;
+			}
+		}
+		else if (!strcmp(arg, "--fps") && hasValue)
+			framesPerSecond = atoi(args[++i]);
+		else if (!strcmp(arg, "--export") && hasValue)
+		{
+			exportPath = args[++i];
+			headless = true;
+		}
+		else if (!strcmp(arg, "--export-format") && hasValue)
+		{
+			const char *format = args[++i];
+			if (!strcmp(format, "png"))
+				exportFormat = EXPORT_PNG;
+			else if (!strcmp(format, "y4m"))
+				exportFormat = EXPORT_Y4M;
+			else if (!strcmp(format, "raw"))
+				exportFormat = EXPORT_RAW;
+			else
+			{
+				std::cout << "Unknown export format: " << format << std::endl;
+				return false;
+			}
+		}
+		else if (!strcmp(arg, "--export-fps") && hasValue)
+			exportFps = atoi(args[++i]);
+		else if (!strcmp(arg, "--export-threads") && hasValue)
+			exportThreads = atoi(args[++i]);
+		else if (!strcmp(arg, "--audio-buffer") && hasValue)
+			audioBuffer = atoi(args[++i]);
+		else if (!strcmp(arg, "--av-offset") && hasValue)
+			avOffset = (float)atof(args[++i]);
+		else if (!strcmp(arg, "--av-log") && hasValue)
+			avLogInterval = (float)atof(args[++i]);
+		else if (!strcmp(arg, "--music") && hasValue)
+			musicFile = args[++i];
+		else if (!strcmp(arg, "--beats") && hasValue)
+		{
+			const char *source = args[++i];
+			if (!strcmp(source, "fixed"))
+				beatSource = BEATS_FIXED;
+			else if (!strcmp(source, "detect"))
+				beatSource = BEATS_DETECT;
+			else
+			{
+				std::cout << "Unknown beat source: " << source << std::endl;
+				return false;
+			}
+		}
+		else if (!strcmp(arg, "--shade") && hasValue)
+		{
+			static const char *modes[SHADE_MODES] = { "lit", "texture", "light", "flat", "depth" };
+			const char *mode = args[++i];
+			shadeOnBeats = !strcmp(mode, "beats");
+			shadeMode = -1;
+			for (int m = 0; m < SHADE_MODES; m++)
+				if (!strcmp(mode, modes[m]))
+					shadeMode = m;
+			if (shadeOnBeats)
+				shadeMode = SHADE_TEXTURE_LIGHT;
+			else if (shadeMode < 0)
+			{
+				std::cout << "Unknown shading mode: " << mode << std::endl;
+				return false;
+			}
+		}
+		else if (!strcmp(arg, "--hsr") && hasValue)
+		{
+			const char *mode = args[++i];
+			if (!strcmp(mode, "zbuffer"))
+				hsrMode = HSR_ZBUFFER;
+			else if (!strcmp(mode, "sbuffer"))
+				hsrMode = HSR_SBUFFER;
+			else
+			{
+				std::cout << "Unknown hidden surface removal mode: " << mode << std::endl;
+				return false;
+			}
+		}
+		else if (!strcmp(arg, "--raster") && hasValue)
+		{
+			const char *mode = args[++i];
+			if (!strcmp(mode, "scanline"))
+				rasterMode = RASTER_SCANLINE;
+			else if (!strcmp(mode, "blocks"))
+				rasterMode = RASTER_BLOCKS;
+			else
+			{
+				std::cout << "Unknown rasterizer: " << mode << std::endl;
+				return false;
+			}
+		}
+		else
+		{
+			std::cout << "Unknown or incomplete option: " << arg << std::endl;
+			return false;
+		}
+	}
+	if (headlessFrames <= 0)
+	{
+		std::cout << "--frames must be positive" << std::endl;
+		return false;
+	}
+	if (reuseTolerance < 0)
+	{
+		std::cout << "--reuse can't be negative" << std::endl;
+		return false;
+	}
+	// the checksums of the headless runs stay exact
+	if (headless && !reuseGiven)
+		reuseTolerance = 0;
+	if (lodQuadSize <= 0 || stressMaxQuads <= 0 || frameBudget <= 0 || framesPerSecond <= 0)
+	{
+		std::cout << "--lod-quad, --stress-max, --frame-budget and --fps must be positive" << std::endl;
+		return false;
+	}
+	if (audioBuffer < 64 || audioBuffer > 16384)
+	{
+		std::cout << "--audio-buffer must be from 64 to 16384 samples" << std::endl;
+		return false;
+	}
+	if (exportPath)
+	{
+		// by the extension, PNG patterns end in .png and y4m players want .y4m
+		const char *dot = strrchr(exportPath, '.');
+		if (exportFormat < 0)
+			exportFormat = dot && !strcmp(dot, ".png") ? EXPORT_PNG : dot && !strcmp(dot, ".y4m") ? EXPORT_Y4M : EXPORT_RAW;
+		if (exportFps <= 0)
+		{
+			std::cout << "--export-fps must be positive" << std::endl;
+			return false;
+		}
+		if (exportFormat == EXPORT_Y4M && (screenWidth % 2 || screenHeight % 2))
+		{
+			std::cout << "y4m export needs an even --size" << std::endl;
+			return false;
+		}
+		if (exportFormat == EXPORT_PNG && !strchr(exportPath, '%'))
+		{
+			std::cout << "PNG export needs a pattern for the frame number, like frame%05d.png" << std::endl;
+			return false;
+		}
+		// the frames go to stdout, everything else to stderr
+		if (!strcmp(exportPath, "-"))
+			std::cout.rdbuf(std::cerr.rdbuf());
+	}
+	// nothing plays without a window, the headless runs keep the fixed clock
+	if (headless)
+		beatSource = BEATS_FIXED;
+	return true;
+}
+
 bool initSDL() {
 
+	if (headless)
+	{
+		// no video or audio subsystem, just an ARGB8888 buffer in memory
+		if (SDL_Init(0) < 0)
+		{
+			std::cout << "SDL could not initialize! SDL_Error: " << SDL_GetError() << std::endl;
+			return false;
+		}
+		screenSurface = backbuffer = CreateBackbuffer(screenWidth, screenHeight);
+		if (screenSurface == NULL)
+		{
+			std::cout << "Off-screen buffer could not be created! SDL_Error: " << SDL_GetError() << std::endl;
+			return false;
+		}
+		return true;
+	}
+
 	//Initialize SDL
 	if (SDL_Init(SDL_INIT_VIDEO) < 0)
 	{
@@ -198,511 +998,2196 @@ bool initSDL() {
 		return false;
 	}
 	//Create window
-	window = SDL_CreateWindow("Dancing Torus", SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED, SCREEN_WIDTH, SCREEN_HEIGHT, SDL_WINDOW_SHOWN);
+	window = SDL_CreateWindow("Dancing Torus", SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED, screenWidth, screenHeight, SDL_WINDOW_SHOWN);
 
 	if (window == NULL)
 	{
 		std::cout << "Window could not be created! SDL_Error: %s\n" << SDL_GetError();
 		return false;
 	}
-	//Get window surface
-	screenSurface = SDL_GetWindowSurface(window);
+	backbuffer = CreateBackbuffer(screenWidth, screenHeight);
+	if (backbuffer == NULL)
+	{
+		std::cout << "Backbuffer could not be created! SDL_Error: " << SDL_GetError() << std::endl;
+		return false;
+	}
+	if (paceMode != PACE_VSYNC)
+	{
+		//Get window surface
+		screenSurface = SDL_GetWindowSurface(window);
+		return screenSurface != NULL;
+	}
+	presenter = SDL_CreateRenderer(window, -1, SDL_RENDERER_PRESENTVSYNC);
+	if (presenter)
+		presentTexture = SDL_CreateTexture(presenter, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING, screenWidth, screenHeight);
+	if (presentTexture)
+		screenSurface = backbuffer;
+	if (screenSurface == NULL)
+	{
+		std::cout << "Vsync presentation could not be set up! SDL_Error: " << SDL_GetError() << std::endl;
+		return false;
+	}
 	return true;
 }
 
-void update()
+/*
+* render a fixed number of frames with a synthetic time step, report the
+* frame times and check every frame against the golden checksums
+*/
+int runHeadless()
 {
-    updateMusic();
-	update3D();
-}
+	std::vector<Uint32> golden, checksums;
+	if (goldenInput && !LoadGoldenChecksums(goldenInput, golden))
+	{
+		std::cout << "Golden file can't be read: " << goldenInput << std::endl;
+		return 1;
+	}
 
-void render() {
+	FRAME_TIMINGS updateTimes, renderTimes, frameTimes;
+	updateTimes.reserve(headlessFrames);
+	renderTimes.reserve(headlessFrames);
+	frameTimes.reserve(headlessFrames);
+	checksums.reserve(headlessFrames);
+
+	int mismatches = 0;
+#if defined(TORUS_COUNT_ALLOCATIONS)
+	unsigned long long allocations = 0;
+	int allocatingFrames = 0;
+#endif
+	deltaTime = (int)msFrame;
+	for (int frame = 0; frame < headlessFrames; frame++)
+	{
+#if defined(TORUS_COUNT_ALLOCATIONS)
+		const unsigned long long allocated = AllocationCount();
+#endif
+		Uint64 start = SDL_GetPerformanceCounter();
+		update();
+		Uint64 updated = SDL_GetPerformanceCounter();
+		render(mainFrame);
+		Uint64 end = SDL_GetPerformanceCounter();
+#if defined(TORUS_COUNT_ALLOCATIONS)
+		if (AllocationCount() != allocated)
+		{
+			allocations += AllocationCount() - allocated;
+			allocatingFrames++;
+		}
+#endif
 
-	render3D();
-}
+		updateTimes.add(CounterToMs(start, updated));
+		renderTimes.add(CounterToMs(updated, end));
+		frameTimes.add(CounterToMs(start, end));
 
-void close() {
-	SDL_FreeSurface(texture);
-	free(zbuffer);
-	free(org.vertices);
-	free(org.normals);
-	free(cur.vertices);
-	free(cur.normals);
-	free(polies);
-	//Destroy window
-	SDL_DestroyWindow(window);
-	//Quit SDL subsystems
-	SDL_Quit();
-}
+		Uint32 checksum = SurfaceChecksum(screenSurface);
+		checksums.push_back(checksum);
+		bool mismatch = frame < (int)golden.size() && golden[frame] != checksum;
+		if (mismatch)
+			mismatches++;
 
-void waitTime() {
-	currentTime = SDL_GetTicks();
-	deltaTime = currentTime - lastTime;
-	if (deltaTime < (int)msFrame) {
-		SDL_Delay((int)msFrame - deltaTime);
+		if (verboseFrames || mismatch)
+		{
+			std::cout << "frame " << frame << std::fixed << std::setprecision(3)
+				<< "  update " << CounterToMs(start, updated) << " ms"
+				<< "  render " << CounterToMs(updated, end) << " ms"
+				<< "  checksum " << std::hex << std::setw(8) << std::setfill('0') << checksum << std::dec << std::setfill(' ');
+			if (mismatch)
+				std::cout << "  MISMATCH (expected " << std::hex << std::setw(8) << std::setfill('0') << golden[frame] << std::dec << std::setfill(' ') << ")";
+			std::cout << std::endl;
+		}
 	}
-	lastTime = currentTime;
 
+	updateTimes.print(std::cout, "update");
+	renderTimes.print(std::cout, "render");
+	frameTimes.print(std::cout, "frame ");
+	PrintOverdraw();
+#if defined(TORUS_COUNT_ALLOCATIONS)
+	// update() and render() must not touch the heap
+	std::cout << "allocations: " << allocations << " in " << allocatingFrames << " of " << headlessFrames << " frames" << std::endl;
+	if (allocations)
+		return 3;
+#endif
+
+	if (recordPath && !RecordQuads(recordPath))
+	{
+		std::cout << "Quads can't be written: " << recordPath << std::endl;
+		return 1;
+	}
+	if (goldenOutput && !SaveGoldenChecksums(goldenOutput, checksums))
+	{
+		std::cout << "Golden file can't be written: " << goldenOutput << std::endl;
+		return 1;
+	}
+	if (goldenInput)
+	{
+		if ((int)golden.size() < headlessFrames)
+			std::cout << "golden: only " << golden.size() << " of " << headlessFrames << " frames have a checksum" << std::endl;
+		std::cout << "golden: " << mismatches << " mismatching frames" << std::endl;
+		if (mismatches)
+			return 2;
+	}
+	return 0;
 }
 
-void init3D() {
-	// Load Texture
-	SDL_Surface *temp = IMG_Load("resources/texture_torus.png");
-	if (temp == NULL) {
-		std::cout << "Image can be loaded! " << IMG_GetError();
-		close();
-		exit(1);
-	}
-	texture = SDL_ConvertSurfaceFormat(temp, SDL_PIXELFORMAT_ARGB8888, 0);
+/*
+* the export draws a frame on every worker at once, each one in a frame
+* state of its own. the workers take the frames in order and hand them to
+* the exporter in order
+*/
+typedef struct {
+	frame_state **frames;
+	int count;
+	FRAME_EXPORTER *exporter;
+	std::mutex lock;
+	std::condition_variable submitted;
+	// the next frame to draw, and the next one the exporter takes
+	int next, nextSubmit;
+	// the tori as the frames in order leave them, for their levels of detail
+	std::vector<torus_instance> lod;
+} export_job;
 
-	// prepare the lighting
-	light = new unsigned char[256 * 256];
-	for (int j = 0; j<256; j++)
+/*
+* render the whole song, or --frames of it, with the time step of
+* exportFps and hand the frames to the exporter, whose threads encode and
+* write them. the pose of a frame is a function of its time, and each
+* worker draws a frame of its own in its own frame state: its z-buffer,
+* tiles, dirty boxes and surface. what a state reuses it took from the
+* last frame it drew, which is exact with the headless tolerance of 0, and
+* the levels of detail are picked in frame order, so the frames come out
+* as they do one after the other. a tolerance above 0 or a changing render
+* size would depend on the frames before, then the frames are drawn in
+* order, each on all the workers
+*/
+int runExport()
+{
+	int frames = headlessFrames;
+	if (!framesGiven)
 	{
-		for (int i = 0; i<256; i++)
+		const double length = SongLength();
+		if (length <= 0)
 		{
-			// calculate distance from the centre
-			int c = ((128 - i)*(128 - i) + (128 - j)*(128 - j)) / 35;
-			// check for overflow
-			if (c>255) c = 255;
-			// store lumel
-			light[(j << 8) + i] = 255 - c;
+			std::cout << "The length of " << musicFile << " is unknown, give the number of --frames" << std::endl;
+			return 1;
 		}
+		frames = (int)(std::max(0.0, length - startTime) * exportFps + 0.5);
 	}
-	// prepare 3D data
-	zbuffer = (unsigned short*) malloc(SCREEN_WIDTH * SCREEN_HEIGHT * sizeof(unsigned short));
-	init_object();
 
+	FRAME_EXPORTER exporter;
+	if (!exporter.start(exportFormat, exportPath, screenWidth, screenHeight, exportFps, exportThreads))
+		return 1;
+
+	Uint64 start = SDL_GetPerformanceCounter();
+	if (workers.size() > 1 && reuseTolerance == 0 && !dynamicResolution)
+	{
+		// the fixed beats are added up front, the workers only read them
+		timeline.extendTo(ExportTime(frames));
+		export_job job;
+		job.count = frames;
+		job.exporter = &exporter;
+		job.next = job.nextSubmit = 0;
+		job.lod = mainFrame.instances;
+		std::vector<frame_state *> states(workers.size());
+		states[0] = &mainFrame;
+		for (size_t i = 1; i < states.size(); i++)
+			states[i] = CreateFrame();
+		for (size_t i = 0; i < states.size(); i++)
+		{
+			states[i]->alone = true;
+			states[i]->levels.assign(mainFrame.instances.size(), 0);
+		}
+		job.frames = &states[0];
+		workers.run(ExportFrames, &job);
+		mainFrame.alone = false;
+		mainFrame.levels.clear();
+		for (size_t i = 1; i < states.size(); i++)
+			FreeFrame(states[i]);
+	}
+	else
+		for (int frame = 0; frame < frames; frame++)
+		{
+			deltaTime = frame ? ExportTime(frame) - ExportTime(frame - 1) : 0;
+			update();
+			render(mainFrame);
+			exporter.submit(screenSurface);
+		}
+	const bool ok = exporter.finish();
+	const double seconds = CounterToMs(start, SDL_GetPerformanceCounter()) / 1000;
+	std::cout << std::fixed << std::setprecision(1)
+		<< "export: " << frames << " frames in " << seconds << " s, " << frames / seconds << " FPS, "
+		<< frames / (seconds * exportFps) << "x real time" << std::endl;
+	return ok ? 0 : 1;
 }
 
-void initMusic()
+// frame n shows the music at n / exportFps, to the millisecond
+int ExportTime(int frame)
 {
-    Mix_OpenAudio(44100, MIX_DEFAULT_FORMAT, 2, 4096);
-    Mix_Init(MIX_INIT_OGG);
-    mySong =  Mix_LoadMUS("resources/Blastculture-Gravitation.ogg");
-    if (!mySong)
-    {
-        std::cout << "Error loading Music: " << Mix_GetError() << std::endl;
-        close();
-        exit(1);
-    }
-    Mix_PlayMusic(mySong,0);
-    MusicCurrentTime = 0;
-    MusicCurrentTimeBeat = 0;
-    MusicCurrentBeat = 0;
-    MusicPreviousBeat = -1;
-
-    bulk = BASE_BULK_MODIFIER;
-    uniformScale = BASE_SCALE;
+	return (int)(startTime * 1000) + (int)((Sint64)frame * 1000 / exportFps);
 }
 
-void updateMusic()
+// worker job: draw the next frame of the export until there are none left
+static void ExportFrames(int worker, void *data)
 {
-    MusicCurrentTime += deltaTime;
-    MusicCurrentTimeBeat += deltaTime;
-    MusicPreviousBeat = MusicCurrentBeat;
-    if (MusicCurrentTimeBeat >= MSEG_BPM)
-    {
-        MusicCurrentTimeBeat = 0;
-        MusicCurrentBeat ++;
-    }
-    if (!Mix_PlayingMusic())
-    {
-        close();
-        exit(0);
-    }
+	export_job &job = *(export_job *)data;
+	frame_state &fs = *job.frames[worker];
+	std::unique_lock<std::mutex> guard(job.lock);
+	while (job.next < job.count)
+	{
+		const int frame = job.next++;
+		fs.musicTime = ExportTime(frame);
+		fs.musicBeat = (int)((Sint64)fs.musicTime * BPM_MUSIC / 60000);
+		// the hysteresis of the levels of detail follows the frames in
+		// order, as it does when they are drawn one after the other
+		for (size_t i = 0; i < job.lod.size(); i++)
+		{
+			torus_instance &t = job.lod[i];
+			PoseInstance(t, fs.musicTime, t.rot, t.uniformScale, t.bulk);
+			SelectLod(t);
+			fs.levels[i] = t.level;
+		}
+		guard.unlock();
+		update3D(fs);
+		render(fs);
+		guard.lock();
+		job.submitted.wait(guard, [&] { return job.nextSubmit == frame; });
+		// the exporter copies the frame, the surface is free again after.
+		// the next frame waits for nextSubmit, so the order holds
+		guard.unlock();
+		job.exporter->submit(fs.renderSurface);
+		guard.lock();
+		job.nextSubmit++;
+		job.submitted.notify_all();
+	}
 }
 
-void update3D()
+/*
+* a frame state of its own for the export to draw next to mainFrame: the
+* same tori and render area, and nothing drawn yet
+*/
+frame_state *CreateFrame()
 {
-    memset(zbuffer, 255, SCREEN_WIDTH * SCREEN_HEIGHT * sizeof(unsigned short));
-
-    if (MusicCurrentTime <= MSEG_BPM * 20)
-    {
-        uniformScale = 1;
-
-        if (MusicPreviousBeat != MusicCurrentBeat)
-        {
-            bulk = BASE_BULK_MODIFIER;
-            bulkChangeSpeed = BULK_CHANGE_SPEED;
-        }
-        else
-        {
-            bulk += bulkChangeSpeed * deltaTime;
-            bulkChangeSpeed *= BULK_SPEED_DECAY;
-        }
-
-        angleX = M_PI_2;
-        angleY = 0;
-        if (MusicCurrentTime <= MSEG_BPM * 12)
-            angleZ = 0;
-        else
-            angleZ += CONSTANT_ANGULAR_VELOCITY * deltaTime;
-    }
-    else
-    {
-        bulk = 0;
-
-        if (MusicPreviousBeat != MusicCurrentBeat)
-        {
-            angularVelocity[0] = rand() % 10;
-            angularVelocity[1] = rand() % 10;
-            angularVelocity[2] = rand() % 10;
-            angularVelocity.setMagnitude(BASE_ANGULAR_VELOCITY);
-
-            uniformScale = BASE_SCALE;
-            scaleChangeSpeed = SCALE_CHANGE_SPEED;
-        }
-        else
-        {
-            if (MusicCurrentBeat % 2 == 0)
-                uniformScale += scaleChangeSpeed * deltaTime;
-            else
-                uniformScale -= scaleChangeSpeed * deltaTime;
-            scaleChangeSpeed *= SCALE_CHANGE_DECAY;
-        }
-
-        angularVelocity *= ANGULAR_VELOCITY_DECAY;
-
-        angleX += angularVelocity[0] * deltaTime;
-        angleY += angularVelocity[1] * deltaTime;
-        angleZ += angularVelocity[2] * deltaTime;
-    }
-
-    objpos = VECTOR(0, 0, 250);
-    objrot = rotX(angleX) * rotY(angleY) * rotZ(angleZ);
-    objScale = scale(uniformScale);
-
-    TransformPts();
+	frame_state *fs = new frame_state();
+	fs->shade = mainFrame.shade;
+	fs->instances = mainFrame.instances;
+	AllocRaster(*fs);
+	SplitBands(*fs);
+	AllocPolies(*fs, 1);
+	fs->renderSurface = CreateBackbuffer(screenWidth, screenHeight);
+	fs->redrawFrame = true;
+	fs->hizFrame = 1;
+	fs->lastBox.x2 = renderWidth;
+	fs->lastBox.y2 = renderHeight;
+	return fs;
 }
 
-void render3D() {
-	// clear the background
-	SDL_FillRect(screenSurface, NULL, 0);
-	// and draw the polygons
-	DrawPolies();
+void FreeFrame(frame_state *fs)
+{
+	FreeBackbuffer(fs->renderSurface);
+	delete[] fs->bands;
+	delete fs;
 }
 
-/*
-* clears all entries in the edge table
+// the length of the song in seconds, 0 when SDL_mixer can't tell
+double SongLength()
+{
+#if SDL_MIXER_VERSION_ATLEAST(2, 6, 0)
+	// decoding needs an open device, but not one that plays
+	SDL_setenv("SDL_AUDIODRIVER", "dummy", 1);
+	if (SDL_InitSubSystem(SDL_INIT_AUDIO) < 0)
+		return 0;
+	double length = 0;
+	if (Mix_OpenAudio(44100, MIX_DEFAULT_FORMAT, 2, audioBuffer) == 0)
+	{
+		Mix_Music *music = Mix_LoadMUS(musicFile);
+		if (music)
+		{
+			length = Mix_MusicDuration(music);
+			Mix_FreeMusic(music);
+		}
+		Mix_CloseAudio();
+	}
+	SDL_QuitSubSystem(SDL_INIT_AUDIO);
+	return length;
+#else
+	return 0;
+#endif
+}
+
+/*
+* render the start of the choreography at tessellations from 32x16 up to
+* stressMaxQuads, doubling slices and spans each step, and print the mean
+* time per frame of each stage
+*/
+int runStress()
+{
+	deltaTime = (int)msFrame;
+	lodLevels = 1;
+	// every frame does the whole work
+	reuseFrames = false;
+	std::cout << "   quads  visible  transform ms  cull ms  fill ms  frame ms  ns/quad" << std::endl;
+	for (meshSlices = 32, meshSpans = 16; (Sint64)meshSlices * meshSpans <= stressMaxQuads; meshSlices *= 2, meshSpans *= 2)
+	{
+		initMeshes();
+		// same choreography for every tessellation
+		initMusic();
+		mainFrame.stageTicks.transform = mainFrame.stageTicks.cull = mainFrame.stageTicks.fill = 0;
+
+		Uint64 visiblePolies = 0;
+		Uint64 start = SDL_GetPerformanceCounter();
+		for (int frame = 0; frame < STRESS_FRAMES; frame++)
+		{
+			update();
+			render(mainFrame);
+			visiblePolies += mainFrame.num_visible;
+		}
+		const double frameMs = CounterToMs(start, SDL_GetPerformanceCounter()) / STRESS_FRAMES;
+		std::cout << std::fixed << std::setprecision(3)
+			<< std::setw(8) << meshes[0].num_polies * mainFrame.instances.size() << " " << std::setw(8) << visiblePolies / STRESS_FRAMES
+			<< std::setw(14) << CounterToMs(0, mainFrame.stageTicks.transform) / STRESS_FRAMES
+			<< std::setw(9) << CounterToMs(0, mainFrame.stageTicks.cull) / STRESS_FRAMES
+			<< std::setw(9) << CounterToMs(0, mainFrame.stageTicks.fill) / STRESS_FRAMES
+			<< std::setw(10) << frameMs
+			<< std::setw(9) << std::setprecision(1) << frameMs * 1e6 / (meshes[0].num_polies * mainFrame.instances.size()) << std::endl;
+	}
+	PrintOverdraw();
+	return 0;
+}
+
+/*
+* run the vertex transform many times at a fixed pose, with the streams
+* kernel and with the original path on arrays of VECTOR
+*/
+void runTransformBenchmark()
+{
+	const int iterations = 20000;
+	const vertex_streams &org = meshes[0].org;
+	const int num_vertices = meshes[0].num_vertices;
+	VECTOR *vertices = new VECTOR[num_vertices], *normals = new VECTOR[num_vertices],
+		*outVertices = new VECTOR[num_vertices], *outNormals = new VECTOR[num_vertices];
+	for (int i = 0; i < num_vertices; i++)
+	{
+		vertices[i] = VECTOR(org.x[i], org.y[i], org.z[i]);
+		normals[i] = VECTOR(org.nx[i], org.ny[i], org.nz[i]);
+	}
+	const VECTOR objpos(0, 0, 250);
+	const MATRIX objrot = rotX(0.3f) * rotY(0.7f) * rotZ(1.1f);
+	const MATRIX objScale = scale(1.2f);
+	const float bulk = 3;
+
+	Uint64 start = SDL_GetPerformanceCounter();
+	for (int n = 0; n < iterations; n++)
+		TransformVectors(vertices, normals, outVertices, outNormals, num_vertices,
+			objScale, objrot, objpos, bulk, renderWidth, renderHeight);
+	double reference = CounterToMs(start, SDL_GetPerformanceCounter());
+
+	// the same work as TransformInstance without the pose
+	vertex_streams cur;
+	AllocStreams(cur, num_vertices);
+	start = SDL_GetPerformanceCounter();
+	for (int n = 0; n < iterations; n++)
+	{
+		const transform_setup setup = SetupTransform(AFFINE(Multiply(objScale, objrot), objpos), objrot, bulk, renderWidth, renderHeight);
+		TransformStreams(org, cur, setup, 0, org.padded);
+	}
+	double streams = CounterToMs(start, SDL_GetPerformanceCounter());
+
+	float error = 0;
+	for (int i = 0; i < num_vertices; i++)
+	{
+		error = std::max(error, std::fabs(outVertices[i][0] - cur.x[i]));
+		error = std::max(error, std::fabs(outVertices[i][1] - cur.y[i]));
+		error = std::max(error, std::fabs(outNormals[i][0] - cur.nx[i]));
+	}
+	const double perVertex = 1e6 / ((double)iterations * num_vertices);
+	std::cout << std::fixed << std::setprecision(3)
+		<< "transform: " << num_vertices << " vertices x " << iterations << std::endl
+		<< "  reference " << reference * perVertex << " ns/vertex" << std::endl
+		<< "  streams   " << streams * perVertex << " ns/vertex ("
+		<< std::setprecision(2) << reference / streams << "x)" << std::endl
+		<< "  max difference " << std::setprecision(6) << error << std::endl;
+
+	FreeStreams(cur);
+	delete[] vertices;
+	delete[] normals;
+	delete[] outVertices;
+	delete[] outNormals;
+}
+
+// the largest component difference of two vectors, relative to their size
+static float RelativeDifference(const VECTOR &a, const VECTOR &b)
+{
+	float d = 0, size = 1;
+	for (int i = 0; i < 3; i++)
+	{
+		d = std::max(d, std::fabs(a[i] - b[i]));
+		size = std::max(size, std::fabs(a[i]));
+	}
+	return d / size;
+}
+
+static float RelativeDifference(const MATRIX &a, const MATRIX &b)
+{
+	float d = 0;
+	for (int i = 0; i < 3; i++)
+		d = std::max(d, RelativeDifference(a[i], b[i]));
+	return d;
+}
+
+/*
+* compare Multiply, Transform and normalize with the constexpr operators
+* on count random rotations, scales, translations and vectors, the
+* largest relative difference of any component
+*/
+float MathDifference(const int count, const unsigned int seed)
+{
+	RANDOM random(seed);
+	// in [-range, range)
+	auto value = [&](const float range) { return ((float)(random.next() >> 8) / (1 << 23) - 1) * range; };
+	float difference = 0;
+	for (int n = 0; n < count; n++)
+	{
+		const MATRIX r1 = rotX(value(3.2f)) * rotY(value(3.2f)) * rotZ(value(3.2f)),
+			r2 = rotZ(value(3.2f)) * rotX(value(3.2f)),
+			m1 = scale(value(4)) * r1,
+			m2 = scale(value(4), value(4), value(4)) * r2;
+		const AFFINE a1(m1, VECTOR(value(500), value(500), value(500))),
+			a2(m2, VECTOR(value(500), value(500), value(500)));
+		const VECTOR v(value(200), value(200), value(200));
+
+		difference = std::max(difference, RelativeDifference(m1 * m2, Multiply(m1, m2)));
+		difference = std::max(difference, RelativeDifference(m1 * v, Transform(m1, v)));
+		difference = std::max(difference, RelativeDifference(a1 * v, Transform(a1, v)));
+		const AFFINE product = a1 * a2, simd = Multiply(a1, a2);
+		difference = std::max(difference, RelativeDifference(product.linear, simd.linear));
+		difference = std::max(difference, RelativeDifference(product.translation, simd.translation));
+		if (v.dot(v) > 0)
+		{
+			VECTOR member = v;
+			member.normalize();
+			difference = std::max(difference, RelativeDifference(member, normalize(v)));
+		}
+	}
+	return difference;
+}
+
+/*
+* time the per frame rotation chain and the per vertex matrix and vector
+* operations, written with the constexpr operators and with the SIMD
+* functions. both do the same arithmetic, so the results must match, false
+* when they don't
+*/
+bool runMathBenchmark()
+{
+	const int iterations = 200000;
+	const int count = 1024;
+	VECTOR *in = new VECTOR[count], *outScalar = new VECTOR[count], *outSimd = new VECTOR[count];
+	const vertex_streams &org = meshes[0].org;
+	const int num_vertices = meshes[0].num_vertices;
+	for (int i = 0; i < count; i++)
+		in[i] = VECTOR(org.x[i % num_vertices], org.y[i % num_vertices], org.z[i % num_vertices]);
+	float difference = 0;
+
+	// rotX * rotY * rotZ, once per frame
+	// (sum a row of each product so none of them can be optimised away)
+	VECTOR chainScalar, chainSimd;
+	Uint64 start = SDL_GetPerformanceCounter();
+	for (int n = 0; n < iterations; n++)
+		chainScalar = chainScalar + (rotX(n * 0.001f) * rotY(n * 0.002f) * rotZ(n * 0.003f))[n % 3];
+	double chainOperators = CounterToMs(start, SDL_GetPerformanceCounter());
+	start = SDL_GetPerformanceCounter();
+	for (int n = 0; n < iterations; n++)
+		chainSimd = chainSimd + Multiply(Multiply(rotX(n * 0.001f), rotY(n * 0.002f)), rotZ(n * 0.003f))[n % 3];
+	double chainMultiply = CounterToMs(start, SDL_GetPerformanceCounter());
+	difference = std::fabs((chainScalar - chainSimd).dot(chainScalar - chainSimd));
+
+	// matrix * vector, once per vertex
+	const MATRIX m = rotX(0.3f) * rotY(0.7f) * rotZ(1.1f);
+	const int passes = iterations / 100;
+	start = SDL_GetPerformanceCounter();
+	for (int n = 0; n < passes; n++)
+		for (int i = 0; i < count; i++)
+			outScalar[i] = m * in[i];
+	double transformOperator = CounterToMs(start, SDL_GetPerformanceCounter());
+	start = SDL_GetPerformanceCounter();
+	for (int n = 0; n < passes; n++)
+		for (int i = 0; i < count; i++)
+			outSimd[i] = Transform(m, in[i]);
+	double transformSimd = CounterToMs(start, SDL_GetPerformanceCounter());
+	for (int i = 0; i < count; i++)
+		difference = std::max(difference, std::fabs((outScalar[i] - outSimd[i]).dot(outScalar[i] - outSimd[i])));
+
+	// normalize, once per vertex at load time
+	start = SDL_GetPerformanceCounter();
+	for (int n = 0; n < passes; n++)
+		for (int i = 0; i < count; i++)
+		{
+			outScalar[i] = in[i];
+			outScalar[i].normalize();
+		}
+	double normalizeScalar = CounterToMs(start, SDL_GetPerformanceCounter());
+	start = SDL_GetPerformanceCounter();
+	for (int n = 0; n < passes; n++)
+		for (int i = 0; i < count; i++)
+			outSimd[i] = normalize(in[i]);
+	double normalizeSimd = CounterToMs(start, SDL_GetPerformanceCounter());
+	for (int i = 0; i < count; i++)
+		difference = std::max(difference, std::fabs((outScalar[i] - outSimd[i]).dot(outScalar[i] - outSimd[i])));
+
+	const double perChain = 1e6 / iterations, perVertex = 1e6 / ((double)passes * count);
+	std::cout << std::fixed << std::setprecision(3)
+		<< "math: " << iterations << " rotation chains, " << count << " vectors x " << passes << std::endl
+		<< "  rotation chain  operators " << chainOperators * perChain << " ns, Multiply "
+		<< chainMultiply * perChain << " ns" << std::endl
+		<< "  matrix * vector operator  " << transformOperator * perVertex << " ns, Transform "
+		<< transformSimd * perVertex << " ns" << std::endl
+		<< "  normalize       member    " << normalizeScalar * perVertex << " ns, normalize "
+		<< normalizeSimd * perVertex << " ns" << std::endl
+		<< "  max difference " << std::setprecision(6) << difference << std::endl;
+
+	delete[] in;
+	delete[] outScalar;
+	delete[] outSimd;
+
+	const float random = MathDifference(MATH_CHECK_COUNT, randomSeed);
+	std::cout << "  random inputs   max relative difference " << random << std::endl;
+	if (difference > MATH_TOLERANCE || random > MATH_TOLERANCE)
+	{
+		std::cout << "  the SIMD math differs from the operators by more than " << MATH_TOLERANCE << std::endl;
+		return false;
+	}
+	return true;
+}
+
+void update()
+{
+	PROFILE_FRAME();
+    updateMusic();
+	mainFrame.musicTime = MusicCurrentTime;
+	mainFrame.musicBeat = MusicCurrentBeat;
+	update3D(mainFrame);
+}
+
+void render(frame_state &fs) {
+
+	if (fs.frameReused)
+	{
+		// the backbuffer and the window still hold it
+		fs.presentBox.x1 = fs.presentBox.y1 = fs.presentBox.x2 = fs.presentBox.y2 = 0;
+		fs.reusedFrames++;
+		return;
+	}
+	fs.redrawFrame = false;
+	fs.drawnShadeMode = fs.shadeMode;
+	if (fs.partialFrame)
+		fs.partialFrames++;
+	if (!dynamicResolution)
+	{
+		render3D(fs);
+		return;
+	}
+	Uint64 start = SDL_GetPerformanceCounter();
+	render3D(fs);
+	double ms = CounterToMs(start, SDL_GetPerformanceCounter());
+	// scale what was drawn up to the window, then size the next frame
+	PROFILE_ZONE("scale");
+	SDL_Rect drawn = { 0, 0, renderWidth, renderHeight };
+	SDL_BlitScaled(fs.renderSurface, &drawn, backbuffer, NULL);
+	updateResolution(ms);
+}
+
+void close() {
+	SDL_FreeSurface(texture);
+	workers.stop();
+	delete[] mainFrame.bands;
+	// the light map, the z-buffer, the tiles, the edge tables and the meshes
+	arena.release();
+	if (mainFrame.renderSurface != backbuffer)
+		FreeBackbuffer(mainFrame.renderSurface);
+	if (mySong)
+	{
+		// stop the analysis callback before the audio goes away
+		Mix_SetPostMix(NULL, NULL);
+		Mix_FreeMusic(mySong);
+		Mix_CloseAudio();
+	}
+	FreeBackbuffer(backbuffer);
+	if (presentTexture)
+		SDL_DestroyTexture(presentTexture);
+	if (presenter)
+		SDL_DestroyRenderer(presenter);
+	//Destroy window
+	SDL_DestroyWindow(window);
+	//Quit SDL subsystems
+	SDL_Quit();
+}
+
+void present() {
+	PROFILE_ZONE("present");
+	const SDL_Rect dirty = { mainFrame.presentBox.x1, mainFrame.presentBox.y1, mainFrame.presentBox.x2 - mainFrame.presentBox.x1, mainFrame.presentBox.y2 - mainFrame.presentBox.y1 };
+	const Uint8 *from = (const Uint8 *)backbuffer->pixels + dirty.y * backbuffer->pitch + dirty.x * 4;
+	if (presenter)
+	{
+		// the streaming texture keeps what is outside the box
+		if (dirty.w > 0 && dirty.h > 0)
+			SDL_UpdateTexture(presentTexture, &dirty, from, backbuffer->pitch);
+		SDL_RenderCopy(presenter, presentTexture, NULL, NULL);
+		SDL_RenderPresent(presenter);
+		return;
+	}
+	if (dirty.w <= 0 || dirty.h <= 0)
+		return;
+	// the window takes the pixels as they are if it is 32 bit RGB (the top
+	// byte doesn't matter), anything else is converted
+	const Uint32 format = screenSurface->format->format;
+	Uint8 *to = (Uint8 *)screenSurface->pixels + dirty.y * screenSurface->pitch + dirty.x * screenSurface->format->BytesPerPixel;
+	if (format == SDL_PIXELFORMAT_ARGB8888 || format == SDL_PIXELFORMAT_RGB888)
+		for (int y = 0; y < dirty.h; y++)
+			memcpy(to + y * screenSurface->pitch, from + y * backbuffer->pitch, dirty.w * 4);
+	else
+		SDL_ConvertPixels(dirty.w, dirty.h, SDL_PIXELFORMAT_ARGB8888, from, backbuffer->pitch, format, to, screenSurface->pitch);
+	SDL_UpdateWindowSurfaceRects(window, &dirty, 1);
+}
+
+/*
+* a cleared ARGB8888 surface over memory we allocate, aligned like the
+* vertex streams, with rows padded to whole cache lines
+*/
+SDL_Surface *CreateBackbuffer(int width, int height)
+{
+	const int pitch = (width * 4 + STREAM_ALIGN - 1) / STREAM_ALIGN * STREAM_ALIGN;
+	void *pixels = AlignedAlloc((size_t)pitch * height);
+	if (!pixels)
+		return NULL;
+	memset(pixels, 0, (size_t)pitch * height);
+	SDL_Surface *surface = SDL_CreateRGBSurfaceWithFormatFrom(pixels, width, height, 32, pitch, SDL_PIXELFORMAT_ARGB8888);
+	if (!surface)
+		AlignedFree(pixels);
+	return surface;
+}
+
+void FreeBackbuffer(SDL_Surface *surface)
+{
+	if (!surface)
+		return;
+	// the surface doesn't own its pixels
+	void *pixels = surface->pixels;
+	SDL_FreeSurface(surface);
+	AlignedFree(pixels);
+}
+
+void waitTime() {
+	// deltaTime is the time from this frame's start to the next one's, in
+	// whole milliseconds; the fractions carry over so none of it is lost
+	frameClock += framePacer.wait();
+	const Uint64 ms = frameClock * 1000 / SDL_GetPerformanceFrequency();
+	deltaTime = (int)(ms - frameClockMs);
+	frameClockMs = ms;
+}
+
+void init3D() {
+	// Load Texture
+	SDL_Surface *temp = IMG_Load("resources/texture_torus.png");
+	if (temp == NULL) {
+		std::cout << "Image can be loaded! " << IMG_GetError();
+		close();
+		exit(1);
+	}
+	texture = SDL_ConvertSurfaceFormat(temp, SDL_PIXELFORMAT_ARGB8888, 0);
+	SDL_FreeSurface(temp);
+
+	// repack the texture so the span kernel doesn't need the surface pitch
+	// or SDL_GetRGB, in tiles and with its mip levels
+	texels.load(texture);
+	texels.setMipmapped(useMipmaps);
+
+	arena.setHugePages(hugePages);
+	// prepare the lighting, padded for the vector gathers
+	light = arena.alloc<unsigned char>(256 * 256 + 3);
+	for (int j = 0; j<256; j++)
+	{
+		for (int i = 0; i<256; i++)
+		{
+			// calculate distance from the centre
+			int c = ((128 - i)*(128 - i) + (128 - j)*(128 - j)) / 35;
+			// check for overflow
+			if (c>255) c = 255;
+			// store lumel
+			light[(j << 8) + i] = 255 - c;
+		}
+	}
+	mainFrame.shade.light = light;
+	mainFrame.shade.colour = 0xFF000000 | texels.average();
+	// prepare 3D data
+	initRaster();
+	meshMark = arena.mark();
+	initInstances();
+	initMeshes();
+	std::cout << "Arena: " << arena.used() / 1024 << " KB in " << arena.reserved() / 1024 << " KB"
+		<< (hugePages ? " asked for on huge pages" : "") << std::endl;
+
+}
+
+void initMusic()
+{
+    MusicCurrentTime = (int)(startTime * 1000);
+    MusicCurrentTimeBeat = 0;
+    MusicCurrentBeat = beatSource == BEATS_FIXED ? (int)((Sint64)MusicCurrentTime * BPM_MUSIC / 60000) : 0;
+    MusicPreviousBeat = MusicCurrentBeat;
+    frameMusicTime = MusicCurrentTime;
+    eventPending = false;
+    timeline.start(randomSeed, beatSource == BEATS_FIXED ? 60000.0 / BPM_MUSIC : 0);
+
+    // the beat clock runs on deltaTime alone, so nothing to play
+    if (headless)
+        return;
+
+    Mix_OpenAudio(44100, MIX_DEFAULT_FORMAT, 2, audioBuffer);
+    Mix_Init(MIX_INIT_OGG);
+    mySong =  Mix_LoadMUS(musicFile);
+    if (!mySong)
+    {
+        std::cout << "Error loading Music: " << Mix_GetError() << std::endl;
+        close();
+        exit(1);
+    }
+
+    Mix_QuerySpec(&musicFrequency, &musicFormat, &musicChannels);
+    musicFrameBytes = musicChannels * SDL_AUDIO_BITSIZE(musicFormat) / 8;
+    if (beatSource == BEATS_DETECT && musicFormat != AUDIO_S16SYS && musicFormat != AUDIO_F32SYS)
+    {
+        std::cout << "Beat detection needs 16 bit or float audio, using " << BPM_MUSIC << " BPM" << std::endl;
+        beatSource = BEATS_FIXED;
+    }
+    beatDetector.init(musicFrequency);
+    audioClock.start(musicFrequency);
+    Mix_SetPostMix(analyseMusic, NULL);
+    Mix_PlayMusic(mySong,0);
+    if (startTime > 0 && Mix_SetMusicPosition(startTime) < 0)
+    {
+        std::cout << "Can't seek the music: " << Mix_GetError() << std::endl;
+        startTime = 0;
+        MusicCurrentTime = 0;
+        frameMusicTime = 0;
+        MusicCurrentBeat = MusicPreviousBeat = 0;
+    }
+    // the music starts with the next chunk the mixer is asked for, as if
+    // it had played from the beginning when it was started further in
+    musicStart = audioClock.mixedSamples() - (Sint64)(startTime * musicFrequency);
+    avLogNext = MusicCurrentTime + (int)(avLogInterval * 1000);
+}
+
+/*
+* SDL_mixer's post mix callback, on the audio thread: the mixed stream is
+* analysed right before it plays, and the audio clock learns how far the
+* mixer got. no locks and no allocations here, the results go to the
+* render thread through the detector's ring and the clock
+*/
+void analyseMusic(void *, Uint8 *stream, int len)
+{
+    const int frames = len / musicFrameBytes;
+    if (beatSource == BEATS_DETECT)
+    {
+        if (musicFormat == AUDIO_S16SYS)
+            beatDetector.feed((const Sint16 *)stream, frames, musicChannels);
+        else
+            beatDetector.feed((const float *)stream, frames, musicChannels);
+    }
+    audioClock.advance(frames);
+}
+
+void updateMusic()
+{
+    PROFILE_ZONE("updateMusic");
+    const int previousTime = MusicCurrentTime;
+    frameMusicTime += deltaTime;
+    if (audioClock.running())
+    {
+        // the time of the sample heard now, with the latency after the
+        // mixer taken off; it never goes back if a callback comes late
+        audioPosition = audioClock.playing(SDL_GetPerformanceCounter()) - avOffset * musicFrequency / 1000;
+        MusicCurrentTime = std::max(MusicCurrentTime, (int)((audioPosition - musicStart) * 1000 / musicFrequency));
+    }
+    else
+        MusicCurrentTime += deltaTime;
+    MusicPreviousBeat = MusicCurrentBeat;
+    if (beatSource == BEATS_DETECT)
+    {
+        MusicCurrentTimeBeat += MusicCurrentTime - previousTime;
+        // what the audio thread found, each event once the middle of its
+        // frame is being heard
+        for (;;)
+        {
+            if (!eventPending && !beatDetector.events.pop(audioEvent))
+                break;
+            eventPending = true;
+            if (audioEvent.sample - ANALYSIS_SIZE / 2 > audioPosition)
+                break;
+            eventPending = false;
+            ApplyAudioEvent(audioEvent);
+        }
+        // the audio thread drops what doesn't fit in the ring
+        const unsigned int dropped = beatDetector.dropped.exchange(0);
+        if (dropped && verboseFrames)
+            std::cout << "Audio: " << dropped << " analysis events dropped, the ring was full\n";
+    }
+    else
+    {
+        // counted from the time rather than stepped, so they can't drift
+        timeline.extendTo(MusicCurrentTime);
+        MusicCurrentBeat = (int)((Sint64)MusicCurrentTime * BPM_MUSIC / 60000);
+        MusicCurrentTimeBeat = MusicCurrentTime - (int)((Sint64)MusicCurrentBeat * 60000 / BPM_MUSIC);
+        if (MusicCurrentBeat != MusicPreviousBeat)
+            BeatShown(MusicCurrentTimeBeat);
+    }
+    if (headless)
+        return;
+    if (avLogInterval > 0 && MusicCurrentTime >= avLogNext)
+    {
+        LogAudioSync();
+        avLogNext += (int)(avLogInterval * 1000);
+    }
+    if (!Mix_PlayingMusic())
+    {
+        close();
+        exit(0);
+    }
+}
+
+void ApplyAudioEvent(const audio_event &e)
+{
+    memcpy(musicBands, e.bands, sizeof(musicBands));
+    musicBass = std::max(musicBass * 0.97f, e.bands[0]);
+    if (e.bpm > 0 && std::fabs(e.bpm - musicTempo) >= 1)
+    {
+        musicTempo = e.bpm;
+        if (verboseFrames)
+            std::cout << "Tempo: " << (int)(musicTempo + 0.5f) << " BPM\n";
+    }
+    if (e.beat)
+    {
+        MusicCurrentTimeBeat = 0;
+        MusicCurrentBeat ++;
+        // the timeline takes the beat at the middle of its frame
+        // the bass sets how hard it tumbles, the mids and highs how much
+        // it pulses, and the tempo how fast the moves die down
+        float pulse = 0.5f;
+        for (int i = 1; i < ANALYSIS_BANDS; i++)
+            pulse += musicBands[i] / (ANALYSIS_BANDS - 1);
+        const float pace = musicTempo > 0 ? musicTempo / BPM_MUSIC : 1;
+        timeline.addBeat((e.sample - ANALYSIS_SIZE / 2 - musicStart) * 1000.0 / musicFrequency, 0.5f + musicBass, pulse, pace);
+        BeatShown((audioPosition - (e.sample - ANALYSIS_SIZE / 2)) * 1000 / musicFrequency);
+    }
+}
+
+// a beat reached the screen lag ms after its sample was heard
+void BeatShown(double lag)
+{
+    beatLagSum += lag;
+    beatLagMax = std::max(beatLagMax, lag);
+    beatLagCount++;
+}
+
+/*
+* how far the frames are from the audio: the latency taken off the output
+* position, how far adding up deltaTime would have drifted from it, and
+* how late the beats of the last interval made it to the screen
+*/
+void LogAudioSync()
+{
+    const double chunkMs = audioClock.chunkSamples() * 1000.0 / musicFrequency;
+    std::cout << std::fixed << std::setprecision(1)
+        << "A/V " << MusicCurrentTime / 1000.0 << " s: latency " << chunkMs << " ms buffer + " << avOffset << " ms offset"
+        << ", frame clock " << std::showpos << (double)(frameMusicTime - MusicCurrentTime) << std::noshowpos << " ms"
+        << ", " << beatLagCount << " beats shown " << (beatLagCount ? beatLagSum / beatLagCount : 0.0)
+        << " ms late (max " << beatLagMax << ")" << std::endl;
+    beatLagSum = beatLagMax = 0;
+    beatLagCount = 0;
+}
+
+void update3D(frame_state &fs)
+{
+    PROFILE_ZONE("update3D");
+    // pose and project every torus
+    Uint64 start = SDL_GetPerformanceCounter();
+    if (fs.instances.size() > 1)
+    {
+        fs.nextInstance = 0;
+        RunJob(fs, TransformInstances);
+    }
+    else
+        TransformInstance(fs, fs.instances[0]);
+    fs.stageTicks.transform += SDL_GetPerformanceCounter() - start;
+
+    // a new look every SHADE_BEATS beats once the intro is over
+    fs.shadeMode = !shadeOnBeats ? shadeMode : fs.musicBeat < INTRO_BEATS ? SHADE_TEXTURE_LIGHT :
+        (fs.musicBeat - INTRO_BEATS) / SHADE_BEATS % SHADE_MODES;
+
+    // nothing moved and it looks the same, show the last frame again
+    fs.frameReused = reuseFrames && !fs.redrawFrame && fs.shadeMode == fs.drawnShadeMode;
+    for (size_t i = 0; i < fs.instances.size() && fs.frameReused; i++)
+        fs.frameReused = !fs.instances[i].moved;
+    if (fs.frameReused)
+        return;
+    // some moved, the others keep their pixels unless the frame is scaled
+    fs.partialFrame = false;
+    if (reuseFrames && !fs.redrawFrame && fs.shadeMode == fs.drawnShadeMode && !dynamicResolution)
+        for (size_t i = 0; i < fs.instances.size() && !fs.partialFrame; i++)
+            fs.partialFrame = !fs.instances[i].moved;
+
+    // the span buffer doesn't use the z-buffer, and with the hierarchical z
+    // moving on to the next frame marks every tile as cleared. the plain
+    // z-buffer is cleared band by band, where the frame is drawn
+    if (useHiZ)
+        fs.hizFrame++;
+    fs.drawSpanZ = SpanFunction(fs.shadeMode, true);
+    fs.drawSpanVisible = SpanFunction(fs.shadeMode, false);
+    // the depth shading goes from white at the front of the nearest torus
+    // to black at the back of the farthest, in the 12.4 depths of the edge
+    // table
+    float nearest = 0, farthest = 0;
+    for (size_t i = 0; i < fs.instances.size(); i++)
+    {
+        const torus_instance &t = fs.instances[i];
+        const float reach = (extRadius + intRadius + t.bulk) * t.uniformScale;
+        if (i == 0 || t.position[2] - reach < nearest)
+            nearest = t.position[2] - reach;
+        if (i == 0 || t.position[2] + reach > farthest)
+            farthest = t.position[2] + reach;
+    }
+    const int depthNear = fs.shade.depthNear, depthShift = fs.shade.depthShift;
+    fs.shade.depthNear = (int)(nearest * 16);
+    fs.shade.depthShift = 0;
+    while (((int)((farthest - nearest) * 16) >> fs.shade.depthShift) > 255)
+        fs.shade.depthShift++;
+    // the tori that didn't move would be shaded darker or lighter now
+    if (fs.shadeMode == SHADE_DEPTH && (fs.shade.depthNear != depthNear || fs.shade.depthShift != depthShift))
+        fs.partialFrame = false;
+}
+
+void render3D(frame_state &fs) {
+	// clear the background and draw the polygons, band by band
+	DrawPolies(fs);
+}
+
+/*
+* run a job of a frame on every worker, or on this thread alone when the
+* workers draw other frames
+*/
+void RunJob(frame_state &fs, void (*job)(int worker, void *data))
+{
+	if (fs.alone)
+		job(0, &fs);
+	else
+		workers.run(job, &fs);
+}
+
+/*
+* start the rasterizer threads and set up the bands for the screen
+*/
+void initRaster()
+{
+	workers.start(numThreads);
+	num_bands = workers.size() > 1 ? workers.size() * BANDS_PER_THREAD : 1;
+	if (num_bands > screenHeight / BAND_MIN_HEIGHT)
+		num_bands = screenHeight / BAND_MIN_HEIGHT;
+	AllocRaster(mainFrame);
+	// with dynamic resolution draw off-screen and scale into the backbuffer
+	mainFrame.renderSurface = backbuffer;
+	if (dynamicResolution)
+		mainFrame.renderSurface = CreateBackbuffer(screenWidth, screenHeight);
+	setRenderSize(screenWidth, screenHeight);
+	std::cout << "Rasterizer: " << workers.size() << " threads, " << num_bands << " bands, "
+		<< screenWidth << "x" << screenHeight << (dynamicResolution ? " with dynamic resolution" : "") << std::endl;
+}
+
+/*
+* the z-buffer, its tiles and the bands of a frame, for the screen size
+*/
+void AllocRaster(frame_state &fs)
+{
+	fs.zbuffer = arena.alloc<unsigned short>(screenWidth * screenHeight);
+	fs.hiz = arena.alloc<hiz_tile>(((screenWidth + TILE_SIZE - 1) / TILE_SIZE) * ((screenHeight + TILE_SIZE - 1) / TILE_SIZE));
+	fs.bands = new raster_band[num_bands]();
+	// room for the tallest band at any render size up to the screen's: the
+	// bands split whole BAND_MIN_HEIGHT rows, the last one takes the rest
+	const int rows = ((screenHeight / BAND_MIN_HEIGHT + num_bands - 1) / num_bands + 1) * BAND_MIN_HEIGHT;
+	for (int i = 0; i < num_bands; i++)
+	{
+		fs.bands[i].rows = rows;
+		fs.bands[i].edge_table = (edge_data (*)[2])arena.alloc(rows * sizeof(edge_data[2]));
+		fs.bands[i].sbuffer.init(screenWidth, rows);
+	}
+}
+
+/*
+* split the render area in bands, the z-buffer and the tiles use
+* width as their pitch. this runs between frames, so the old contents
+* don't matter: tiles from older frames count as cleared anyway
+*/
+void setRenderSize(int width, int height)
+{
+	renderWidth = width;
+	renderHeight = height;
+	hizWidth = (width + TILE_SIZE - 1) / TILE_SIZE;
+	hizHeight = (height + TILE_SIZE - 1) / TILE_SIZE;
+	// older stamps in the tiles may now belong to other tiles, start over
+	mainFrame.hizFrame++;
+	// and the tori are projected on another screen
+	mainFrame.redrawFrame = true;
+	// nothing is known about what is there now
+	mainFrame.lastBox.x1 = mainFrame.lastBox.y1 = 0;
+	mainFrame.lastBox.x2 = width;
+	mainFrame.lastBox.y2 = height;
+	SplitBands(mainFrame);
+}
+
+// split the render area between the bands of a frame
+void SplitBands(frame_state &fs)
+{
+	for (int i = 0; i < num_bands; i++)
+	{
+		raster_band &band = fs.bands[i];
+		// keep the boundaries on multiples of BAND_MIN_HEIGHT
+		band.y0 = (renderHeight / BAND_MIN_HEIGHT) * i / num_bands * BAND_MIN_HEIGHT;
+		band.y1 = (renderHeight / BAND_MIN_HEIGHT) * (i + 1) / num_bands * BAND_MIN_HEIGHT;
+		if (i == num_bands - 1)
+			band.y1 = renderHeight;
+		band.sbuffer.init(renderWidth, band.y1 - band.y0);
+	}
+}
+
+/*
+* pick the render size for the next frame from the smoothed render time.
+* the cost is about proportional to the pixels, so the scale goes with the
+* square root of the time we have over the time we took, a few percent
+* at a time so a single slow frame doesn't make it jump
+*/
+void updateResolution(double ms)
+{
+	renderTime = renderTime > 0 ? renderTime * 0.9f + (float)ms * 0.1f : (float)ms;
+	float wanted = resolutionScale * std::sqrt(frameBudget / renderTime);
+	wanted = std::min(std::max(wanted, resolutionScale * 0.95f), resolutionScale * 1.02f);
+	resolutionScale = std::min(std::max(wanted, MIN_RESOLUTION_SCALE), 1.0f);
+	// whole tiles across, whole bands down
+	int width = ((int)(screenWidth * resolutionScale) + TILE_SIZE - 1) / TILE_SIZE * TILE_SIZE,
+		height = ((int)(screenHeight * resolutionScale) + BAND_MIN_HEIGHT - 1) / BAND_MIN_HEIGHT * BAND_MIN_HEIGHT;
+	width = std::min(width, screenWidth);
+	height = std::min(std::max(height, num_bands * BAND_MIN_HEIGHT), screenHeight);
+	if (width != renderWidth || height != renderHeight)
+		setRenderSize(width, height);
+}
+
+/*
+* clears the entries of the edge table of a band in the rows of a poly,
+* the only ones its edges can reach. with thousands of small polies
+* clearing the whole band for each one was most of the work
+*/
+void InitEdgeTable(raster_band &band, const visible_poly &vp)
+{
+	const int first = std::max(vp.minY, band.y0), last = std::min(vp.maxY + 1, band.y1);
+	for (int i = first - band.y0; i < last - band.y0; i++)
+	{
+		band.edge_table[i][0].x = -1;
+		band.edge_table[i][1].x = -1;
+	}
+	band.poly_minY = renderHeight;
+	band.poly_maxY = -1;
+}
+
+/*
+* keep the part of a span inside the box drawn this frame, false if there
+* is none. the pixels left come out as they would from the whole span
+*/
+bool ClipSpan(const frame_state &fs, int &x1, int &x2, span_data &span)
+{
+	if (x1 < fs.drawBox.x1)
+	{
+		SkipSpan(span, fs.drawBox.x1 - x1);
+		x1 = fs.drawBox.x1;
+	}
+	if (x2 > fs.drawBox.x2)
+		x2 = fs.drawBox.x2;
+	return x2 > x1;
+}
+
+/*
+* draw a horizontal double textured span, or hand it to the span buffer
+*/
+void DrawSpan(frame_state &fs, raster_band &band, int y, edge_data *p1, edge_data *p2)
+{
+	int x1, x2;
+	span_data span;
+	if (!SetupSpan(p1, p2, renderWidth, x1, x2, span) || !ClipSpan(fs, x1, x2, span))
+		return;
+	PROFILE_COUNT(PROFILE_SPANS, 1);
+	band.spanPixels += x2 - x1;
+	if (hsrMode == HSR_SBUFFER)
+	{
+		band.sbuffer.insert(y - band.y0, x1, x2, span);
+		return;
+	}
+	// the window surface is 32 bit, as is our off-screen buffer
+	Uint32 *dst = (Uint32 *)((Uint8 *)fs.renderSurface->pixels + y * fs.renderSurface->pitch);
+	unsigned short *zb = fs.zbuffer + y * renderWidth;
+	if (!useHiZ)
+	{
+		fs.drawSpanZ(dst + x1, zb + x1, x2 - x1, texels.select(span.dtx, span.dty), fs.shade, span);
+		band.testedPixels += x2 - x1;
+		return;
+	}
+	// the tiles under the poly were cleared and bounded by MarkPolyTiles,
+	// skip the span if it is behind the farthest depth of all its tiles.
+	// the stored bounds are never too low, writes only bring depths nearer.
+	// short spans are left to the kernel, which skips hidden groups itself
+	if (x2 - x1 < 2 * TILE_SIZE)
+	{
+		fs.drawSpanZ(dst + x1, zb + x1, x2 - x1, texels.select(span.dtx, span.dty), fs.shade, span);
+		band.testedPixels += x2 - x1;
+		return;
+	}
+	const int ty = y / TILE_SIZE;
+	int za = span.z, zb2 = StepFixed(span.z, span.dz, x2 - 1 - x1),
+		zmin = za < zb2 ? za : zb2;
+	for (int tx = x1 / TILE_SIZE; tx <= (x2 - 1) / TILE_SIZE; tx++)
+	{
+		if (!Behind(fs, tx, ty, zmin, false))
+		{
+			fs.drawSpanZ(dst + x1, zb + x1, x2 - x1, texels.select(span.dtx, span.dty), fs.shade, span);
+			band.testedPixels += x2 - x1;
+			return;
+		}
+	}
+}
+
+/*
+* make sure a tile of the z-buffer holds valid depths for this frame,
+* clearing it on the first write
+*/
+hiz_tile &TouchTile(frame_state &fs, int tx, int ty)
+{
+	hiz_tile &tile = fs.hiz[ty * hizWidth + tx];
+	if (tile.frame != fs.hizFrame)
+	{
+		int x0 = tx * TILE_SIZE, y0 = ty * TILE_SIZE,
+			w = renderWidth - x0 < TILE_SIZE ? renderWidth - x0 : TILE_SIZE,
+			h = renderHeight - y0 < TILE_SIZE ? renderHeight - y0 : TILE_SIZE;
+		for (int y = y0; y < y0 + h; y++)
+			memset(fs.zbuffer + y * renderWidth + x0, 255, w * sizeof(unsigned short));
+		tile.frame = fs.hizFrame;
+		tile.minZ = tile.maxZ = 0xFFFF;
+		tile.dirty = false;
+	}
+	return tile;
+}
+
+/*
+* farthest depth held by a tile, recomputed only when it was written to
+* since the last time
 */
-void InitEdgeTable()
+int TileMaxZ(frame_state &fs, int tx, int ty)
 {
-	for (int i = 0; i<SCREEN_HEIGHT; i++)
+	hiz_tile &tile = fs.hiz[ty * hizWidth + tx];
+	if (tile.frame != fs.hizFrame)
+		return 0xFFFF;
+	if (tile.dirty)
 	{
-		edge_table[i][0].x = -1;
-		edge_table[i][1].x = -1;
+		int x0 = tx * TILE_SIZE, y0 = ty * TILE_SIZE,
+			w = renderWidth - x0 < TILE_SIZE ? renderWidth - x0 : TILE_SIZE,
+			h = renderHeight - y0 < TILE_SIZE ? renderHeight - y0 : TILE_SIZE;
+		tile.maxZ = MaxDepth(fs.zbuffer + y0 * renderWidth + x0, renderWidth, w, h);
+		tile.dirty = false;
 	}
-	poly_minY = SCREEN_HEIGHT;
-	poly_maxY = -1;
+	return tile.maxZ;
 }
 
 /*
-* scan along one edge of the poly, i.e. interpolate all values and store
-* in the edge table
+* true when depth z is behind everything a tile holds. the cheap tests go
+* first, the tile is only rescanned when allowed and its stale bound
+* can't decide
 */
-void ScanEdge(VECTOR p1, int tx1, int ty1, int px1, int py1,
-	VECTOR p2, int tx2, int ty2, int px2, int py2)
+bool Behind(frame_state &fs, int tx, int ty, int z, bool rescan)
 {
-	// we can't handle this case, so we recall the proc with reversed params
-	// saves having to swap all the vars, but it's not good practice
-	if (p2[1]<p1[1]) {
-		ScanEdge(p2, tx2, ty2, px2, py2, p1, tx1, ty1, px1, py1);
+	const hiz_tile &tile = fs.hiz[ty * hizWidth + tx];
+	if (tile.frame != fs.hizFrame || z < tile.minZ)
+		return false;
+	if (z >= tile.maxZ)
+		return true;
+	return rescan && tile.dirty && z >= TileMaxZ(fs, tx, ty);
+}
+
+/*
+* tile range of the poly inside a band and the box drawn, false if it is
+* outside. one pixel of margin, edge interpolation may round past the
+* vertices
+*/
+bool PolyTiles(const frame_state &fs, raster_band &band, const visible_poly &vp, int &tx0, int &ty0, int &tx1, int &ty1)
+{
+	int y0 = std::max(std::max(vp.minY, band.y0), fs.drawBox.y1),
+		y1 = std::min(std::min(vp.maxY, band.y1 - 1), fs.drawBox.y2 - 1),
+		x0 = std::max(vp.minX - 1, fs.drawBox.x1),
+		x1 = std::min(vp.maxX + 1, fs.drawBox.x2 - 1);
+	if (x0 > x1 || y0 > y1)
+		return false;
+	tx0 = x0 / TILE_SIZE;
+	ty0 = y0 / TILE_SIZE;
+	tx1 = x1 / TILE_SIZE;
+	ty1 = y1 / TILE_SIZE;
+	return true;
+}
+
+/*
+* get the tiles a poly is about to be drawn on ready: clear the ones not
+* written yet this frame and lower their nearest depth
+*/
+void MarkPolyTiles(frame_state &fs, raster_band &band, const visible_poly &vp)
+{
+	int tx0, ty0, tx1, ty1;
+	if (!PolyTiles(fs, band, vp, tx0, ty0, tx1, ty1))
 		return;
-	}
-	// convert to fixed point
-	int x1 = (int)(p1[0] * 65536),
-		y1 = (int)(p1[1]),
-		z1 = (int)(p1[2] * 16),
-		x2 = (int)(p2[0] * 65536),
-		y2 = (int)(p2[1]),
-		z2 = (int)(p2[2] * 16);
-	// update the min and max of the current polygon
-	if (y1<poly_minY) poly_minY = y1;
-	if (y2>poly_maxY) poly_maxY = y2;
-	// compute deltas for interpolation
-	int dy = y2 - y1;
-	if (dy == 0) return;
-	int dx = (x2 - x1) / dy,                // assume 16.16 fixed point
-		dtx = (tx2 - tx1) / dy,
-		dty = (ty2 - ty1) / dy,
-		dpx = (px2 - px1) / dy,
-		dpy = (py2 - py1) / dy,
-		dz = (z2 - z1) / dy;              // probably 12.4, but doesn't matter
-										  // interpolate along the edge
-	for (int y = y1; y<y2; y++)
-	{
-		// don't go out of the screen
-		if (y>(SCREEN_HEIGHT - 1)) return;
-		// only store if inside the screen, we should really clip
-		if (y >= 0)
-		{
-			// is first slot free?
-			if (edge_table[y][0].x == -1)
-			{ // if so, use that
-				edge_table[y][0].x = x1;
-				edge_table[y][0].tx = tx1;
-				edge_table[y][0].ty = ty1;
-				edge_table[y][0].px = px1;
-				edge_table[y][0].py = py1;
-				edge_table[y][0].z = z1;
-			}
-			else { // otherwise use the other
-				edge_table[y][1].x = x1;
-				edge_table[y][1].tx = tx1;
-				edge_table[y][1].ty = ty1;
-				edge_table[y][1].px = px1;
-				edge_table[y][1].py = py1;
-				edge_table[y][1].z = z1;
+	unsigned short z = vp.minZ < 0 ? 0 : vp.minZ > 0xFFFF ? 0xFFFF : (unsigned short)vp.minZ;
+	for (int ty = ty0; ty <= ty1; ty++)
+		for (int tx = tx0; tx <= tx1; tx++)
+		{
+			hiz_tile &tile = TouchTile(fs, tx, ty);
+			if (z < tile.minZ)
+				tile.minZ = z;
+			tile.dirty = true;
+		}
+}
+
+/*
+* true when the nearest vertex of the poly is behind the farthest depth
+* of every tile it covers in the band
+*/
+bool PolyHidden(frame_state &fs, raster_band &band, const visible_poly &vp)
+{
+	int tx0, ty0, tx1, ty1;
+	if (!PolyTiles(fs, band, vp, tx0, ty0, tx1, ty1))
+		return false;
+	for (int ty = ty0; ty <= ty1; ty++)
+		for (int tx = tx0; tx <= tx1; tx++)
+			if (!Behind(fs, tx, ty, vp.minZ, true))
+				return false;
+	return true;
+}
+
+/*
+* shade the resolved span buffer of a band, each pixel exactly once
+*/
+void ShadeBand(frame_state &fs, raster_band &band)
+{
+	PROFILE_ZONE("ShadeBand");
+	// no spans outside the box, and the background there is still clear
+	for (int y = std::max(band.y0, fs.clearBox.y1); y < std::min(band.y1, fs.clearBox.y2); y++)
+	{
+		Uint32 *row = (Uint32 *)((Uint8 *)fs.renderSurface->pixels + y * fs.renderSurface->pitch);
+		const std::vector<sbuffer_segment> &segs = band.sbuffer.segments(y - band.y0);
+		for (size_t i = 0; i < segs.size(); i++)
+		{
+			const sbuffer_segment &seg = segs[i];
+			if (seg.span < 0)
+			{
+				// background
+				const int x1 = std::max(seg.x1, fs.clearBox.x1), x2 = std::min(seg.x2, fs.clearBox.x2);
+				if (x2 > x1)
+					memset(row + x1, 0, (x2 - x1) * sizeof(Uint32));
+				continue;
 			}
+			const sbuffer_span &p = band.sbuffer.spans[seg.span];
+			span_data span = p.s;
+			SkipSpan(span, seg.x1 - p.x1);
+			fs.drawSpanVisible(row + seg.x1, fs.zbuffer + y * renderWidth + seg.x1, seg.x2 - seg.x1, texels.select(span.dtx, span.dty), fs.shade, span);
+			band.shadedPixels += seg.x2 - seg.x1;
 		}
-		// interpolate our values
-		x1 += dx;
-		px1 += dpx;
-		py1 += dpy;
-		tx1 += dtx;
-		ty1 += dty;
-		z1 += dz;
 	}
 }
 
 /*
-* draw a horizontal double textured span
+* put the 4 edges of a quad in the edge table of a band
 */
-void DrawSpan(int y, edge_data *p1, edge_data *p2)
+void ScanQuad(const frame_state &fs, raster_band &band, const visible_poly &vp)
 {
-	// quick check, if facing back then draw span in the other direction,
-	// avoids having to swap all the vars... not a very elegant
-	if (p1->x > p2->x)
+	quad_corner c[4];
+	QuadCorners(fs, vp, c);
+	// process all our edges
+	for (int i = 0; i<4; i++)
 	{
-		DrawSpan(y, p2, p1);
-		return;
-	};
-	// load starting points
-	int z1 = p1->z,
-		px1 = p1->px,
-		py1 = p1->py,
-		tx1 = p1->tx,
-		ty1 = p1->ty,
-		x1 = p1->x >> 16,
-		x2 = p2->x >> 16;
-	// check if it's inside the screen
-	if ((x1>(SCREEN_WIDTH - 1)) || (x2<0)) return;
-	// compute deltas for interpolation
-	int dx = x2 - x1;
-	if (dx == 0) return;
-	int dtx = (p2->tx - p1->tx) / dx,  // assume 16.16 fixed point
-		dty = (p2->ty - p1->ty) / dx,
-		dpx = (p2->px - p1->px) / dx,
-		dpy = (p2->py - p1->py) / dx,
-		dz = (p2->z - p1->z) / dx;
-
-	// setup the offsets in the buffers
-	Uint8 *dst;
-	Uint8 *initbuffer = (Uint8 *)screenSurface->pixels;
-	int bpp = screenSurface->format->BytesPerPixel;
-	Uint8 *imagebuffer = (Uint8 *)texture->pixels;
-	int bppImage = texture->format->BytesPerPixel;
-
-	// get destination offset in buffer
-	long offs = y * SCREEN_WIDTH + x1;
-	// loop for all pixels concerned
-	for (int i = x1; i<x2; i++)
-	{
-		if (i>(SCREEN_WIDTH - 1)) return;
-		// check z buffer
-		if (i >= 0) if (z1<zbuffer[offs])
-		{
-			// if visible load the texel from the translated texture
-			Uint8 *p = (Uint8 *)imagebuffer + ((ty1 >> 16) & 0xff) * texture->pitch + ((tx1 >> 16) & 0xFF) * bppImage;
-			SDL_Color ColorTexture;
-			SDL_GetRGB(*(Uint32*)(p), texture->format, &ColorTexture.r, &ColorTexture.g, &ColorTexture.b);
-			// and the texel from the light map
-			unsigned char LightFactor = light[((py1 >> 8) & 0xff00) + ((px1 >> 16) & 0xff)];
-			// mix them together, and store
-			int ColorR = (ColorTexture.r + LightFactor);
-			if (ColorR > 255) 
-				ColorR = 255;
-			int ColorG = (ColorTexture.g + LightFactor);
-			if (ColorG > 255) 
-				ColorG = 255;
-			int ColorB = (ColorTexture.b + LightFactor);
-			if (ColorB > 255) 
-				ColorB = 255;
-			Uint32 resultColor = 0xFF000000 | (ColorR << 16) | (ColorG << 8) | ColorB;
-			dst = initbuffer + y *screenSurface->pitch + i * bpp;
-			*(Uint32 *)dst = resultColor;
-			// and update the zbuffer
-			zbuffer[offs] = z1;
-		}
-		// interpolate our values
-		px1 += dpx;
-		py1 += dpy;
-		tx1 += dtx;
-		ty1 += dty;
-		z1 += dz;
-		// and find next pixel
-		offs++;
-	}
-}
-
-/*
-* cull and draw the visible polies
-*/
-void DrawPolies()
+		const quad_corner &a = c[i], &b = c[(i + 1) & 3];
+		ScanEdge(band,
+			// the vertex in screen space, the static texture coordinates
+			// and the dynamic ones computed with the normals
+			VECTOR(a.x, a.y, a.z), a.tx, a.ty, a.px, a.py,
+			// the same for the second vertex
+			VECTOR(b.x, b.y, b.z), b.tx, b.ty, b.px, b.py
+		);
+	}
+}
+
+/*
+* the same for a quad that was clipped, with the vertices of the polygon
+* left by the clipping
+*/
+void ScanClipped(raster_band &band, const clip_polygon &p)
 {
-	int i;
-	for (int n = 0; n<num_polies; n++)
+	for (int i = 0; i < p.count; i++)
+	{
+		const clip_vertex &a = p.v[i], &b = p.v[(i + 1) % p.count];
+		ScanEdge(band,
+			VECTOR(a.x, a.y, a.z), (int)a.tx, (int)a.ty, (int)a.px, (int)a.py,
+			VECTOR(b.x, b.y, b.z), (int)b.tx, (int)b.ty, (int)b.px, (int)b.py);
+	}
+}
+
+/*
+* the corners of a visible quad with the values ScanEdge takes
+*/
+void QuadCorners(const frame_state &fs, const visible_poly &vp, quad_corner c[4])
+{
+	const torus_instance &t = fs.instances[vp.instance];
+	const torus_mesh *mesh = &meshes[t.level];
+	int vertex[4];
+	for (int i = 0; i < 4; i++)
+		vertex[i] = QuadVertex(mesh->quads, vp.n, i);
+	QuadCorners(t.cur, vertex, vp.n, mesh->spans, mesh->sliceRefs, mesh->spanRefs, c);
+}
+
+/*
+* the edges of a visible poly for the block rasterizer, false if it has to
+* go through the edge table
+*/
+bool SetupBlockPoly(const frame_state &fs, const visible_poly &vp, block_poly &p)
+{
+	quad_corner c[CLIP_MAX_VERTICES];
+	if (vp.clip == -1)
+	{
+		QuadCorners(fs, vp, c);
+		return SetupPoly(p, c, 4);
+	}
+	clip_polygon scratch;
+	const clip_polygon &poly = ClippedPolygon(fs, vp, scratch);
+	for (int i = 0; i < poly.count; i++)
 	{
-		// rotate the centre and normal of the poly to check if it is actually visible.
-		VECTOR ncent = objrot * polies[n].centre,
-			nnorm = objrot * polies[n].normal;
+		const clip_vertex &v = poly.v[i];
+		c[i].x = v.x;
+		c[i].y = v.y;
+		c[i].z = v.z;
+		c[i].tx = (int)v.tx;
+		c[i].ty = (int)v.ty;
+		c[i].px = (int)v.px;
+		c[i].py = (int)v.py;
+	}
+	return SetupPoly(p, c, poly.count);
+}
 
-		// calculate the dot product, and check it's sign
-		if ((ncent[0] + objpos[0])*nnorm[0]
-			+ (ncent[1] + objpos[1])*nnorm[1]
-			+ (ncent[2] + objpos[2])*nnorm[2]<0)
+/*
+* draw a poly in the 8x8 blocks of a band, the tiles of the hierarchical
+* z. the spans of the 8 rows of a block row are set up once, then each
+* block is tested against them: blocks outside the poly or behind the
+* farthest depth of their tile are skipped, and the covered pixels of the
+* others are drawn. the runs of consecutive blocks in a row are drawn
+* together, so a row of blocks costs a span per row like the scanlines
+*/
+void DrawBlocks(frame_state &fs, raster_band &band, block_poly &p)
+{
+	const int y0 = std::max(std::max(p.y0, band.y0), fs.drawBox.y1), y1 = std::min(std::min(p.y1, band.y1), fs.drawBox.y2);
+	int x1[BLOCK_SIZE], x2[BLOCK_SIZE], start[BLOCK_SIZE], mask[BLOCK_SIZE];
+	span_data span[BLOCK_SIZE];
+	for (int by = y0 / BLOCK_SIZE * BLOCK_SIZE; by < y1; by += BLOCK_SIZE)
+	{
+		// the span of every row, empty outside the poly and the band
+		int left = renderWidth, right = 0;
+		for (int r = 0; r < BLOCK_SIZE; r++)
+		{
+			const int y = by + r;
+			edge_data a, b;
+			x1[r] = x2[r] = 0;
+			start[r] = -1;
+			if (y < y0 || y >= y1)
+				continue;
+			PolyRow(p, y, a, b);
+			if (!SetupSpan(&a, &b, renderWidth, x1[r], x2[r], span[r]) || !ClipSpan(fs, x1[r], x2[r], span[r]))
+			{
+				x1[r] = x2[r] = 0;
+				continue;
+			}
+			PROFILE_COUNT(PROFILE_SPANS, 1);
+			band.spanPixels += x2[r] - x1[r];
+			left = std::min(left, x1[r]);
+			right = std::max(right, x2[r]);
+		}
+		for (int bx = left / BLOCK_SIZE * BLOCK_SIZE; bx < right; bx += BLOCK_SIZE)
 		{
-			// the polygon is visible, so setup the edge table
-			InitEdgeTable();
-			// process all our edges
-			for (i = 0; i<4; i++)
+			const int coverage = BlockCoverage(bx, x1, x2, mask);
+			if (!coverage)
+				continue;
+			bool hidden = false;
+			if (useHiZ)
 			{
-				ScanEdge(
-					// the vertex in screen space
-					cur.vertices[polies[n].p[i]],
-					// the static texture coordinates
-					polies[n].tx[i], polies[n].ty[i],
-					// the dynamic text coords computed with the normals
-					(int)(65536 * (128 + 127 * cur.normals[polies[n].p[i]][0])),
-					(int)(65536 * (128 + 127 * cur.normals[polies[n].p[i]][1])),
-					// second vertex in screen space
-					cur.vertices[polies[n].p[(i + 1) & 3]],
-					// static text coords
-					polies[n].tx[(i + 1) & 3], polies[n].ty[(i + 1) & 3],
-					// dynamic texture coords
-					(int)(65536 * (128 + 127 * cur.normals[polies[n].p[(i + 1) & 3]][0])),
-					(int)(65536 * (128 + 127 * cur.normals[polies[n].p[(i + 1) & 3]][1]))
-				);
+				// the nearest depth of the covered pixels, z is linear along a row
+				int zmin = 0x7FFFFFFF;
+				for (int r = 0; r < BLOCK_SIZE; r++)
+					if (mask[r])
+					{
+						const int a = std::max(x1[r], bx) - x1[r], b = std::min(x2[r], bx + BLOCK_SIZE) - 1 - x1[r],
+							za = StepFixed(span[r].z, span[r].dz, a), zb2 = StepFixed(span[r].z, span[r].dz, b);
+						zmin = std::min(zmin, std::min(za, zb2));
+					}
+				hidden = Behind(fs, bx / TILE_SIZE, by / TILE_SIZE, zmin, false);
 			}
-			// quick clipping
-			if (poly_minY<0) poly_minY = 0;
-			if (poly_maxY>SCREEN_HEIGHT) poly_maxY = SCREEN_HEIGHT;
-			// do we have to draw anything?
-			if ((poly_minY<poly_maxY) && (poly_maxY>0) && (poly_minY<SCREEN_HEIGHT))
+			for (int r = 0; r < BLOCK_SIZE; r++)
 			{
-				// if so just draw relevant lines
-				for (i = poly_minY; i<poly_maxY; i++)
+				if (!mask[r])
+					continue;
+				if (!hidden && start[r] < 0)
+					start[r] = coverage == 2 ? bx : std::max(x1[r], bx);
+				else if (hidden && start[r] >= 0)
 				{
-					DrawSpan(i, &edge_table[i][0], &edge_table[i][1]);
+					DrawRun(fs, band, by + r, start[r], bx, x1[r], span[r]);
+					start[r] = -1;
 				}
 			}
 		}
+		for (int r = 0; r < BLOCK_SIZE; r++)
+			if (start[r] >= 0)
+				DrawRun(fs, band, by + r, start[r], x2[r], x1[r], span[r]);
+	}
+}
+
+// draw pixels [a, b) of row y, of a span that starts at x1
+void DrawRun(frame_state &fs, raster_band &band, int y, int a, int b, int x1, span_data span)
+{
+	Uint32 *dst = (Uint32 *)((Uint8 *)fs.renderSurface->pixels + y * fs.renderSurface->pitch);
+	unsigned short *zb = fs.zbuffer + y * renderWidth;
+	SkipSpan(span, a - x1);
+	fs.drawSpanZ(dst + a, zb + a, b - a, texels.select(span.dtx, span.dty), fs.shade, span);
+	band.testedPixels += b - a;
+}
+
+/*
+* the visible quads of the frame as ScanQuad hands them to ScanEdge, in
+* drawing order. the clipped ones are left out
+*/
+bool RecordQuads(const char *path)
+{
+	const frame_state &fs = mainFrame;
+	std::vector<screen_quad> quads;
+	for (int v = 0; v < fs.num_visible; v++)
+	{
+		if (fs.visible[v].clip != -1)
+			continue;
+		screen_quad q;
+		QuadCorners(fs, fs.visible[v], q.c);
+		quads.push_back(q);
+	}
+	if (!SaveQuads(path, renderWidth, renderHeight, quads))
+		return false;
+	std::cout << "Recorded " << quads.size() << " quads to " << path << std::endl;
+	return true;
+}
+
+/*
+* clear one band and draw the part of every visible poly that falls in it
+*/
+void DrawBand(frame_state &fs, raster_band &band)
+{
+	PROFILE_ZONE("DrawBand");
+	band.spanPixels = band.testedPixels = band.shadedPixels = 0;
+	band.hiddenPolies = 0;
+	// clear the background where the torus is or was, the span buffer
+	// fills it in when shading
+	if (hsrMode == HSR_SBUFFER)
+		band.sbuffer.clear();
+	else if (fs.clearBox.x2 > fs.clearBox.x1)
+		for (int y = std::max(band.y0, fs.clearBox.y1); y < std::min(band.y1, fs.clearBox.y2); y++)
+			memset((Uint32 *)((Uint8 *)fs.renderSurface->pixels + y * fs.renderSurface->pitch) + fs.clearBox.x1, 0,
+				(fs.clearBox.x2 - fs.clearBox.x1) * sizeof(Uint32));
+	// the plain z-buffer where it is drawn, outside it nothing reads it
+	const int y0 = std::max(band.y0, fs.drawBox.y1), y1 = std::min(band.y1, fs.drawBox.y2);
+	if (hsrMode == HSR_ZBUFFER && !useHiZ)
+		for (int y = y0; y < y1; y++)
+			memset(fs.zbuffer + y * renderWidth + fs.drawBox.x1, 255, (fs.drawBox.x2 - fs.drawBox.x1) * sizeof(unsigned short));
+
+	int i;
+	for (int v = 0; v<fs.num_visible; v++)
+	{
+		const visible_poly &vp = fs.visible[v];
+		// skip the polies that don't touch this band at all, or the box drawn
+		if (vp.maxY < y0 || vp.minY >= y1 || vp.maxX + 1 < fs.drawBox.x1 || vp.minX - 1 >= fs.drawBox.x2)
+			continue;
+		// or that are behind everything drawn so far
+		if (useHiZ && hsrMode == HSR_ZBUFFER)
+		{
+			if (PolyHidden(fs, band, vp))
+			{
+				band.hiddenPolies++;
+				continue;
+			}
+			MarkPolyTiles(fs, band, vp);
+		}
+		// in blocks, unless the poly is bent on screen
+		if (rasterMode == RASTER_BLOCKS && hsrMode == HSR_ZBUFFER)
+		{
+			block_poly poly;
+			bool convex;
+			{
+				PROFILE_TIME(PROFILE_SCAN_MS);
+				convex = SetupBlockPoly(fs, vp, poly);
+			}
+			if (convex)
+			{
+				PROFILE_TIME(PROFILE_FILL_MS);
+				DrawBlocks(fs, band, poly);
+				continue;
+			}
+		}
+		// setup the edge table
+		{
+			PROFILE_TIME(PROFILE_SCAN_MS);
+			InitEdgeTable(band, vp);
+			if (vp.clip != -1)
+			{
+				clip_polygon scratch;
+				ScanClipped(band, ClippedPolygon(fs, vp, scratch));
+			}
+			else
+				ScanQuad(fs, band, vp);
+		}
+		// quick clipping
+		if (band.poly_minY<y0) band.poly_minY = y0;
+		if (band.poly_maxY>y1) band.poly_maxY = y1;
+		// if so just draw relevant lines
+		PROFILE_TIME(PROFILE_FILL_MS);
+		for (i = band.poly_minY; i<band.poly_maxY; i++)
+		{
+			DrawSpan(fs, band, i, &band.edge_table[i - band.y0][0], &band.edge_table[i - band.y0][1]);
+		}
+	}
+	if (hsrMode == HSR_SBUFFER)
+		ShadeBand(fs, band);
+}
+
+// worker job: keep taking bands until there are none left
+static void DrawBands(int, void *data)
+{
+	frame_state &fs = *(frame_state *)data;
+	int b;
+	while ((b = fs.nextBand++) < num_bands)
+		DrawBand(fs, fs.bands[b]);
+}
+
+// sort order of the visible polies, ties stay in mesh order
+static bool NearerPoly(const visible_poly &a, const visible_poly &b)
+{
+	if (a.depth != b.depth)
+		return a.depth < b.depth;
+	if (a.instance != b.instance)
+		return a.instance < b.instance;
+	return a.n < b.n;
+}
+
+/*
+* clip a quad against the near plane and the guard band into p and take
+* the bounds of the visible poly from it, false when nothing is left
+*/
+bool ClipQuadPolygon(const frame_state &fs, const torus_instance &inst, visible_poly &vp, clip_polygon &p)
+{
+	const torus_mesh *mesh = &meshes[inst.level];
+	const transform_setup &frameSetup = inst.setup;
+	// the texture coordinates as an unclipped quad has them, the position
+	// again in camera space
+	quad_corner c[4];
+	QuadCorners(fs, vp, c);
+	p.count = 4;
+	for (int i = 0; i < 4; i++)
+	{
+		const VECTOR v = CameraVertex(mesh->org, frameSetup, QuadVertex(mesh->quads, vp.n, i));
+		clip_vertex &cv = p.v[i];
+		cv.x = v[0];
+		cv.y = v[1];
+		cv.z = v[2];
+		cv.tx = (float)c[i].tx;
+		cv.ty = (float)c[i].ty;
+		cv.px = (float)c[i].px;
+		cv.py = (float)c[i].py;
+	}
+	ClipPolygon(p, 0, 0, 1, -NEAR_Z);
+	ProjectPolygon(p, frameSetup.focal, frameSetup.cx, frameSetup.cy);
+	ClipGuardBand(p, renderWidth, renderHeight);
+	if (p.count < 3)
+		return false;
+	for (int i = 0; i < p.count; i++)
+	{
+		int x = (int)floor(p.v[i].x), y = (int)p.v[i].y, z = (int)(p.v[i].z * 16);
+		if (i == 0 || x < vp.minX) vp.minX = x;
+		if (i == 0 || x + 1 > vp.maxX) vp.maxX = x + 1;
+		if (i == 0 || y < vp.minY) vp.minY = y;
+		if (i == 0 || y > vp.maxY) vp.maxY = y;
+		if (i == 0 || z < vp.minZ) vp.minZ = z;
+	}
+	return true;
+}
+
+/*
+* clip a quad and keep the polygon in the clipped polygons. the tori are
+* culled in parallel, so which quads get the last slots depends on the
+* timing, but the ones left over are clipped again to the same polygon
+* when they are drawn, and the frame comes out the same
+*/
+bool ClipQuad(frame_state &fs, torus_instance &inst, visible_poly &vp)
+{
+	clip_polygon p;
+	if (!ClipQuadPolygon(fs, inst, vp, p))
+		return false;
+	const int slot = fs.clippedCount++;
+	if (slot >= clipCapacity)
+	{
+		fs.clipOverflow++;
+		vp.clip = CLIP_AGAIN;
+		return true;
+	}
+	vp.clip = slot;
+	fs.clipped[slot] = p;
+	return true;
+}
+
+// the clipped polygon of a visible poly, clipped again into scratch if it has no slot
+const clip_polygon &ClippedPolygon(const frame_state &fs, const visible_poly &vp, clip_polygon &scratch)
+{
+	if (vp.clip != CLIP_AGAIN)
+		return fs.clipped[vp.clip];
+	visible_poly bounds = vp;
+	ClipQuadPolygon(fs, fs.instances[vp.instance], bounds, scratch);
+	return scratch;
+}
+
+/*
+* cull the polies of one torus and put the visible ones at its place in
+* visible, faceList has room for the faces of the finest level
+*/
+void CullInstance(frame_state &fs, const int index, int *faceList)
+{
+	torus_instance &inst = fs.instances[index];
+	const torus_mesh *mesh = &meshes[inst.level];
+	const vertex_streams &cur = inst.cur;
+	const AFFINE view(inst.rot, inst.position);
+	// the camera is at the origin, take it to object space once (rot is
+	// a rotation) and test every quad against it there, instead of moving
+	// the centre and normal of every quad to the camera
+	const VECTOR eye = Transform(inst.rot.transposed(), inst.position) * -1.0f;
+	const face_streams &faces = mesh->faces;
+	const int facing = CullFaces(faces, eye, faceList);
+	visible_poly *out = fs.visible + (size_t)index * meshes[0].num_polies;
+	inst.visibleCount = 0;
+	for (int v = 0; v<facing; v++)
+	{
+		const int n = faceList[v];
+		// the polygon is visible, remember where it is on screen
+		visible_poly &vp = out[inst.visibleCount];
+		vp.n = n;
+		vp.instance = index;
+		vp.clip = -1;
+		bool clip = false;
+		for (int i = 0; i<4; i++)
+		{
+			const int k = QuadVertex(mesh->quads, n, i);
+			// vertices behind the near plane or far out of the screen
+			if (cur.z[k] < NEAR_Z || cur.x[k] < -GUARD_BAND || cur.x[k] > renderWidth + GUARD_BAND
+				|| cur.y[k] < -GUARD_BAND || cur.y[k] > renderHeight + GUARD_BAND)
+				clip = true;
+			// the same conversions as ScanEdge, rounded outwards in x
+			int x = (int)floor(cur.x[k]), y = (int)cur.y[k], z = (int)(cur.z[k] * 16);
+			if (i == 0 || x < vp.minX) vp.minX = x;
+			if (i == 0 || x + 1 > vp.maxX) vp.maxX = x + 1;
+			if (i == 0 || y < vp.minY) vp.minY = y;
+			if (i == 0 || y > vp.maxY) vp.maxY = y;
+			if (i == 0 || z < vp.minZ) vp.minZ = z;
+		}
+		if (clip && !ClipQuad(fs, inst, vp))
+			continue;
+		// nothing of it on the screen
+		if (vp.maxX <= 0 || vp.minX >= renderWidth || vp.maxY < 0 || vp.minY >= renderHeight)
+			continue;
+		vp.depth = Transform(view, VECTOR(faces.cx[n], faces.cy[n], faces.cz[n]))[2];
+		inst.visibleCount++;
+	}
+	PROFILE_COUNT(PROFILE_QUADS_CULLED, mesh->num_polies - inst.visibleCount);
+}
+
+// worker job: keep taking tori until there are none left
+static void CullInstances(int worker, void *data)
+{
+	frame_state &fs = *(frame_state *)data;
+	int *faceList = fs.workerFaces + (size_t)worker * meshes[0].num_polies;
+	int i;
+	while ((i = fs.nextInstance++) < (int)fs.instances.size())
+		CullInstance(fs, i, faceList);
+}
+
+/*
+* cull the polies, then draw the visible ones band by band
+*/
+void DrawPolies(frame_state &fs)
+{
+	Uint64 start = SDL_GetPerformanceCounter();
+	{
+		PROFILE_ZONE("cull");
+		fs.clippedCount = 0;
+		if (fs.instances.size() > 1)
+		{
+			fs.nextInstance = 0;
+			RunJob(fs, CullInstances);
+		}
+		else
+			// a single torus isn't worth waking the workers for
+			CullInstance(fs, 0, fs.workerFaces);
+		// close the gaps between the tori, they are in instance order then
+		fs.num_visible = 0;
+		for (size_t i = 0; i < fs.instances.size(); i++)
+		{
+			const visible_poly *list = fs.visible + i * meshes[0].num_polies;
+			if (list != fs.visible + fs.num_visible)
+				memmove(fs.visible + fs.num_visible, list, fs.instances[i].visibleCount * sizeof(visible_poly));
+			fs.num_visible += fs.instances[i].visibleCount;
+		}
+		TrackDirtyBox(fs);
+		PROFILE_COUNT(PROFILE_QUADS_DRAWN, fs.num_visible);
+	}
+	// front to back, so the hierarchical z rejects as much as possible
+	if (depthSort)
+	{
+		PROFILE_ZONE("sort");
+		std::sort(fs.visible, fs.visible + fs.num_visible, NearerPoly);
+	}
+	Uint64 culled = SDL_GetPerformanceCounter();
+	{
+		PROFILE_ZONE("raster");
+		fs.nextBand = 0;
+		RunJob(fs, DrawBands);
+	}
+	fs.stageTicks.cull += culled - start;
+	fs.stageTicks.fill += SDL_GetPerformanceCounter() - culled;
+
+	fs.statFrames++;
+	for (int b = 0; b < num_bands; b++)
+	{
+		fs.statSpanPixels += fs.bands[b].spanPixels;
+		fs.statTestedPixels += fs.bands[b].testedPixels;
+		fs.statShadedPixels += fs.bands[b].shadedPixels;
+		fs.statHiddenPolies += fs.bands[b].hiddenPolies;
+		PROFILE_COUNT(PROFILE_SPAN_PIXELS, fs.bands[b].spanPixels);
+		PROFILE_COUNT(PROFILE_POLIES_HIDDEN, fs.bands[b].hiddenPolies);
+	}
+}
+
+/*
+* the box around the visible polies of each torus and of all of them, and
+* what needs clearing, drawing and showing: where the tori are now and
+* where they were. on a partial frame only the tori that moved count, the
+* others are drawn again inside their boxes and the same as before. with
+* dynamic resolution the size changes and the frame is scaled to the whole
+* window, so all of it
+*/
+void TrackDirtyBox(frame_state &fs)
+{
+	// the polies are still in instance order
+	dirty_box moved = { 0, 0, 0, 0 };
+	fs.frameBox = moved;
+	int v = 0;
+	for (size_t i = 0; i < fs.instances.size(); i++)
+	{
+		torus_instance &t = fs.instances[i];
+		dirty_box box = { renderWidth, renderHeight, 0, 0 };
+		for (const int end = v + t.visibleCount; v < end; v++)
+		{
+			const visible_poly &vp = fs.visible[v];
+			box.x1 = std::min(box.x1, vp.minX);
+			box.y1 = std::min(box.y1, vp.minY);
+			box.x2 = std::max(box.x2, vp.maxX);
+			box.y2 = std::max(box.y2, vp.maxY + 1);
+		}
+		box = PadBox(box);
+		if (t.moved)
+			moved = BoxUnion(moved, BoxUnion(t.box, box));
+		t.box = box;
+		fs.frameBox = BoxUnion(fs.frameBox, box);
+	}
+
+	const dirty_box render = { 0, 0, renderWidth, renderHeight };
+	fs.drawBox = render;
+	if (dynamicResolution)
+	{
+		const dirty_box screen = { 0, 0, screenWidth, screenHeight };
+		fs.clearBox = render;
+		fs.presentBox = screen;
+		return;
+	}
+	if (fs.partialFrame)
+		fs.drawBox = fs.clearBox = moved;
+	else
+		fs.clearBox = BoxUnion(fs.frameBox, fs.lastBox);
+	fs.presentBox = fs.clearBox;
+	fs.lastBox = fs.frameBox;
+}
+
+// a pixel more all around for the rounding of the edges, on the screen
+dirty_box PadBox(const dirty_box &box)
+{
+	dirty_box padded = { std::max(box.x1 - 1, 0), std::max(box.y1 - 1, 0),
+		std::min(box.x2 + 1, renderWidth), std::min(box.y2 + 1, renderHeight) };
+	if (padded.x2 <= padded.x1 || padded.y2 <= padded.y1)
+		padded.x1 = padded.y1 = padded.x2 = padded.y2 = 0;
+	return padded;
+}
+
+// the box around both, an empty one is all 0
+dirty_box BoxUnion(const dirty_box &a, const dirty_box &b)
+{
+	if (a.x2 <= a.x1)
+		return b;
+	if (b.x2 <= b.x1)
+		return a;
+	const dirty_box both = { std::min(a.x1, b.x1), std::min(a.y1, b.y1), std::max(a.x2, b.x2), std::max(a.y2, b.y2) };
+	return both;
+}
+
+void setHsrMode(int mode)
+{
+	hsrMode = mode;
+	mainFrame.statFrames = mainFrame.statSpanPixels = mainFrame.statTestedPixels = mainFrame.statShadedPixels = mainFrame.statHiddenPolies = mainFrame.reusedFrames = mainFrame.partialFrames = 0;
+	std::cout << "Hidden surface removal: " << (mode == HSR_SBUFFER ? "span buffer" : "z-buffer") << std::endl;
+}
+
+void setRasterMode(int mode)
+{
+	rasterMode = mode;
+	std::cout << "Rasterizer: " << (mode == RASTER_BLOCKS ? "8x8 blocks" : "scanlines")
+		<< (hsrMode == HSR_SBUFFER ? ", the span buffer still takes scanlines" : "") << std::endl;
+}
+
+/*
+* how many pixels the spans covered, and for the span buffer how many of
+* them it didn't have to shade
+*/
+void PrintOverdraw()
+{
+	const frame_state &fs = mainFrame;
+	if (!fs.statFrames) return;
+	std::cout << std::fixed << std::setprecision(1)
+		<< "overdraw: " << (double)fs.statSpanPixels / fs.statFrames << " span pixels per frame";
+	if (hsrMode == HSR_ZBUFFER)
+	{
+		Uint64 skipped = fs.statSpanPixels - fs.statTestedPixels;
+		std::cout << ", " << (double)fs.statTestedPixels / fs.statFrames << " z-tested, "
+			<< (double)skipped / fs.statFrames << " in spans rejected by tile ("
+			<< (fs.statSpanPixels ? 100.0 * skipped / fs.statSpanPixels : 0.0) << "%), "
+			<< (double)fs.statHiddenPolies / fs.statFrames << " band polies hidden";
+	}
+	else
+	{
+		Uint64 removed = fs.statSpanPixels - fs.statShadedPixels;
+		std::cout << ", " << (double)fs.statShadedPixels / fs.statFrames << " shaded, "
+			<< (double)removed / fs.statFrames << " removed ("
+			<< (fs.statSpanPixels ? 100.0 * removed / fs.statSpanPixels : 0.0) << "%)";
 	}
+	std::cout << std::endl;
+	if (fs.clipOverflow)
+		std::cout << "clipping: " << fs.clipOverflow << " quads clipped again in the bands, the pool holds " << clipCapacity << " per frame" << std::endl;
+	if (fs.reusedFrames)
+		std::cout << "reuse: " << fs.reusedFrames << " of " << fs.statFrames + fs.reusedFrames << " frames shown again ("
+			<< 100.0 * fs.reusedFrames / (fs.statFrames + fs.reusedFrames) << "%)" << std::endl;
+	if (fs.partialFrames)
+		std::cout << "reuse: " << fs.partialFrames << " of " << fs.statFrames << " frames drawn only where tori moved" << std::endl;
+}
+
+// texture coordinate of grid line i of n, the texture wraps twice around the torus
+static int TextureRef(const int i, const int n)
+{
+	return (int)((Sint64)i * 512 / n) << 16;
 }
 
 /*
-* generate a torus object
+* generate a torus object with the given tessellation
 */
-void init_object()
+void init_object(torus_mesh &mesh, int slices, int spans)
 {
+	vertex_streams &org = mesh.org;
+	mesh.slices = slices;
+	mesh.spans = spans;
 	// allocate necessary memory for points and their normals
-	num_vertices = SLICES*SPANS;
-	org.vertices = new VECTOR[num_vertices];
-	cur.vertices = new VECTOR[num_vertices];
-	org.normals = new VECTOR[num_vertices];
-	cur.normals = new VECTOR[num_vertices];
+	mesh.num_vertices = slices*spans;
+	AllocStreams(org, mesh.num_vertices, &arena);
 	int i, j, k = 0;
 	// now create all the points and their normals, start looping
 	// round the origin (circle C1)
-	for (i = 0; i<SLICES; i++)
+	for (i = 0; i<slices; i++)
 	{
 		// find angular position
-		float ext_angle = (float)i*M_PI*2.0f / SLICES,
+		float ext_angle = (float)i*M_PI*2.0f / slices,
 			ca = cos(ext_angle),
 			sa = sin(ext_angle);
 		// now loop round C2
-		for (j = 0; j<SPANS; j++)
+		for (j = 0; j<spans; j++)
 		{
-			float int_angle = (float)j*M_PI*2.0f / SPANS,
-				int_rad = EXT_RADIUS + INT_RADIUS * cos(int_angle);
+			float int_angle = (float)j*M_PI*2.0f / spans,
+				int_rad = extRadius + intRadius * cos(int_angle);
 			// compute position of vertex by rotating it round C1
-			org.vertices[k] = VECTOR(
+			VECTOR vertex = VECTOR(
 				int_rad * ca,
-				INT_RADIUS*sin(int_angle),
+				intRadius*sin(int_angle),
 				int_rad * sa);
-            cur.vertices[k] = org.vertices[k];
 			// then find the normal, i.e. the normalised vector representing the
 			// distance to the correpsonding point on C1
-			org.normals[k] = normalize(org.vertices[k] - VECTOR(EXT_RADIUS*ca, 0, EXT_RADIUS*sa));
-            cur.normals[k] = org.normals[k];
+			VECTOR normal = normalize(vertex - VECTOR(extRadius*ca, 0, extRadius*sa));
+			org.x[k] = vertex[0];
+			org.y[k] = vertex[1];
+			org.z[k] = vertex[2];
+			org.nx[k] = normal[0];
+			org.ny[k] = normal[1];
+			org.nz[k] = normal[2];
 			k++;
 		}
 	}
 
+	PadStreams(org);
+
 	// now initialize the polygons, there are as many quads as vertices
-	num_polies = SPANS*SLICES;
-	polies = new POLY[num_polies];
+	mesh.num_polies = spans*slices;
+	mesh.quads.p16 = NULL;
+	mesh.quads.p32 = NULL;
+	if (mesh.num_vertices <= 65536)
+		mesh.quads.p16 = arena.alloc<Uint16>(mesh.num_polies * 4);
+	else
+		mesh.quads.p32 = arena.alloc<Uint32>(mesh.num_polies * 4);
+	AllocFaces(mesh.faces, mesh.num_polies, &arena);
+
+	// the static texture refs of the grid lines
+	mesh.sliceRefs = arena.alloc<int>(slices + 1);
+	mesh.spanRefs = arena.alloc<int>(spans + 1);
+	for (i = 0; i <= slices; i++)
+		mesh.sliceRefs[i] = TextureRef(i, slices);
+	for (j = 0; j <= spans; j++)
+		mesh.spanRefs[j] = TextureRef(j, spans);
+
 	// perform the same loop
-	for (i = 0; i<SLICES; i++)
+	for (i = 0; i<slices; i++)
 	{
-		for (j = 0; j<SPANS; j++)
+		for (j = 0; j<spans; j++)
 		{
-			POLY &P = polies[i*SPANS + j];
-
+			const int n = i*spans + j;
 			// setup the pointers to the 4 concerned vertices
-			P.p[0] = i*SPANS + j;
-			P.p[1] = i*SPANS + ((j + 1) % SPANS);
-			P.p[3] = ((i + 1) % SLICES)*SPANS + j;
-			P.p[2] = ((i + 1) % SLICES)*SPANS + ((j + 1) % SPANS);
-
-			// now compute the static texture refs (X)
-			P.tx[0] = (i * 512 / SLICES) << 16;
-			P.tx[1] = (i * 512 / SLICES) << 16;
-			P.tx[3] = ((i + 1) * 512 / SLICES) << 16;
-			P.tx[2] = ((i + 1) * 512 / SLICES) << 16;
-
-			// now compute the static texture refs (Y)
-			P.ty[0] = (j * 512 / SPANS) << 16;
-			P.ty[1] = ((j + 1) * 512 / SPANS) << 16;
-			P.ty[3] = (j * 512 / SPANS) << 16;
-			P.ty[2] = ((j + 1) * 512 / SPANS) << 16;
+			int p[4];
+			p[0] = i*spans + j;
+			p[1] = i*spans + ((j + 1) % spans);
+			p[3] = ((i + 1) % slices)*spans + j;
+			p[2] = ((i + 1) % slices)*spans + ((j + 1) % spans);
+
+			VECTOR corner[4];
+			for (k = 0; k < 4; k++)
+			{
+				if (mesh.quads.p16)
+					mesh.quads.p16[n * 4 + k] = (Uint16)p[k];
+				else
+					mesh.quads.p32[n * 4 + k] = (Uint32)p[k];
+				corner[k] = VECTOR(org.x[p[k]], org.y[p[k]], org.z[p[k]]);
+			}
 
 			// get the normalized diagonals
-			VECTOR d1 = normalize(org.vertices[P.p[2]] - org.vertices[P.p[0]]),
-				d2 = normalize(org.vertices[P.p[3]] - org.vertices[P.p[1]]),
+			VECTOR d1 = normalize(corner[2] - corner[0]),
+				d2 = normalize(corner[3] - corner[1]),
 				// and their dot product
-				temp = VECTOR(d1[1] * d2[2] - d1[2] * d2[1],
-					d1[2] * d2[0] - d1[0] * d2[2],
-					d1[0] * d2[1] - d1[1] * d2[0]);
-			// normalize that and we get the face's normal
-			P.normal = normalize(temp);
+				temp = cross(d1, d2);
 
-			// the centre of the face is just the average of the 4 corners
-			// we could use this for depth sorting
-			temp = org.vertices[P.p[0]] + org.vertices[P.p[1]]
-				+ org.vertices[P.p[2]] + org.vertices[P.p[3]];
-			P.centre = VECTOR(temp[0] * 0.25, temp[1] * 0.25, temp[2] * 0.25);
+			// the centre of the face is just the average of the 4 corners,
+			// we use it for depth sorting
+			VECTOR centre = corner[0] + corner[1] + corner[2] + corner[3];
+			// normalize the cross product and we get the face's normal
+			SetFace(mesh.faces, n, normalize(temp), centre * 0.25f);
 		}
 	}
+	PadFaces(mesh.faces);
+}
+/*
+* build the levels of detail from --mesh down, and what every frame works
+* on for the finest of them: the vertices of each instance in screen
+* space, the visible polies, the clipped polygons and the faces of every
+* worker. all of it replaces what was above meshMark, so nothing is
+* allocated while the frames are drawn
+*/
+void initMeshes()
+{
+	// the vertices of the tori are gone
+	mainFrame.redrawFrame = true;
+	arena.rewind(meshMark);
+	num_meshes = 0;
+	const int levels = lodLevels ? lodLevels : mainFrame.instances.size() > 1 ? MAX_LODS : 1;
+	for (int slices = meshSlices, spans = meshSpans; num_meshes < levels && slices >= 3 && spans >= 3;
+		slices /= 2, spans /= 2)
+		init_object(meshes[num_meshes++], slices, spans);
+
+	clipCapacity = (int)std::min(mainFrame.instances.size() * meshes[0].num_polies, (size_t)CLIP_POOL_MAX);
+	AllocPolies(mainFrame, workers.size());
+}
+
+/*
+* the vertices of the tori of a frame, its visible polies and clipped
+* polygons and the faces of each of the workers drawing it
+*/
+void AllocPolies(frame_state &fs, int threads)
+{
+	const size_t polies = meshes[0].num_polies;
+	for (size_t i = 0; i < fs.instances.size(); i++)
+	{
+		AllocStreams(fs.instances[i].cur, meshes[0].num_vertices, &arena);
+		fs.instances[i].level = 0;
+	}
+	fs.visible = arena.alloc<visible_poly>(fs.instances.size() * polies);
+	fs.clipped = arena.alloc<clip_polygon>(clipCapacity);
+	fs.workerFaces = arena.alloc<int>(threads * polies);
 }
 
 /*
-* rotate and project all vertices, and just rotate point normals
+* place the tori. a single one stays straight in front of the camera, more
+* go on a grid with about the proportions of the screen that fills the
+* view at the camera distance, shrunk to fit their cells (further away
+* they would run out of z-buffer depth). each one gets a random turn, depth
+* and response to the beats, and the dance spreads out from the middle in
+* a wave
 */
-void TransformPts()
+void initInstances()
 {
-    for (int i = 0; i<num_vertices; i++)
-    {
-        cur.vertices[i] = org.vertices[i] + org.normals[i] * bulk;
-        cur.vertices[i] = objScale * cur.vertices[i];
-
-        // perform rotation
-        cur.normals[i] = objrot * org.normals[i];
-        cur.vertices[i] = objrot * cur.vertices[i];
-        // now project onto the screen
-        cur.vertices[i][2] += objpos[2];
-        cur.vertices[i][0] = SCREEN_HEIGHT * (cur.vertices[i][0] + objpos[0]) / cur.vertices[i][2] + (SCREEN_WIDTH / 2);
-        cur.vertices[i][1] = SCREEN_HEIGHT * (cur.vertices[i][1] + objpos[1]) / cur.vertices[i][2] + (SCREEN_HEIGHT /2);
-    }
+	mainFrame.instances.assign(instanceCount, torus_instance());
+	for (int i = 0; i < instanceCount; i++)
+	{
+		torus_instance &t = mainFrame.instances[i];
+		t.position = VECTOR(0, 0, cameraDistance);
+		t.size = 1;
+		t.base = MATRIX::identity();
+		t.phase = 0;
+		t.response = 1;
+	}
+	if (instanceCount < 2)
+		return;
+
+	int cols = 1;
+	while ((Sint64)cols * cols * screenHeight < (Sint64)instanceCount * screenWidth)
+		cols++;
+	const int rows = (instanceCount + cols - 1) / cols;
+	// the view is as high as it is far away (the focal length is the
+	// height), leave half a cell of room at the edges
+	const float depth = cameraDistance;
+	const float spacing = std::min(depth * screenWidth / screenHeight / (cols + 0.5f), depth / (rows + 0.5f));
+	const float size = spacing / (2 * (extRadius + intRadius) * INSTANCE_SPACING);
+	const float middle = std::sqrt((float)((cols - 1) * (cols - 1) + (rows - 1) * (rows - 1))) / 2;
+	for (int i = 0; i < instanceCount; i++)
+	{
+		torus_instance &t = mainFrame.instances[i];
+		RANDOM random(MixSeed(randomSeed, i));
+		const float c = i % cols - (cols - 1) / 2.0f, r = i / cols - (rows - 1) / 2.0f;
+		t.position = VECTOR(c * spacing, r * spacing, depth + (random(1000) / 1000.0f - 0.5f) * spacing);
+		t.size = size;
+		t.base = Multiply(Multiply(rotX(random(6283) / 1000.0f), rotY(random(6283) / 1000.0f)), rotZ(random(6283) / 1000.0f));
+		t.phase = middle > 0 ? INSTANCE_WAVE_MS * std::sqrt(c * c + r * r) / middle : 0;
+		t.response = INSTANCE_RESPONSE_MIN + (INSTANCE_RESPONSE_MAX - INSTANCE_RESPONSE_MIN) * random(1000) / 1000.0f;
+	}
+	std::cout << "Scene: " << instanceCount << " tori, " << cols << "x" << rows << " at " << size << " of the size" << std::endl;
+}
+
+/*
+* pick the level of detail from the projected size of the torus: the
+* outer ring is about 2 * pi * radius pixels long on screen, and we want
+* its quads no longer than lodQuadSize. the scale pulses with every beat,
+* so going coarser waits until the quads are clearly small enough
+*/
+void SelectLod(torus_instance &t)
+{
+	if (num_meshes < 2)
+		return;
+	const float radius = (extRadius + intRadius + t.bulk) * t.uniformScale;
+	const float ring = 2.0f * (float)M_PI * renderHeight * radius / t.position[2];
+	int level = t.level;
+	while (level > 0 && ring / meshes[level].slices > lodQuadSize)
+		level--;
+	while (level + 1 < num_meshes && ring / meshes[level + 1].slices < lodQuadSize * LOD_HYSTERESIS)
+		level++;
+	t.level = level;
+}
+
+/*
+* how far the vertices of a torus could move on screen from the pose it
+* was last transformed with to a new one, in pixels, at most. a vertex
+* within reach of the centre moves by the change of the scaled rotation
+* times reach, plus the change of the bulk. the projection turns a move
+* at depth z into focal / z pixels, and as much again times how far off
+* the axis the vertex is seen, for the change of its depth. identical
+* poses give 0
+*/
+float PoseMovement(const torus_instance &t, const MATRIX &rot, float uniformScale, float bulk)
+{
+	float change = 0;
+	for (int i = 0; i < 3; i++)
+		for (int j = 0; j < 3; j++)
+		{
+			const float d = uniformScale * rot[i][j] - t.uniformScale * t.rot[i][j];
+			change += d * d;
+		}
+	const float scaled = std::max(uniformScale, t.uniformScale),
+		reach = (extRadius + intRadius + std::max(std::fabs(bulk), std::fabs(t.bulk))) * scaled,
+		move = std::sqrt(change) * reach / scaled + scaled * std::fabs(bulk - t.bulk);
+	if (move == 0)
+		return 0;
+	const float nearest = t.position[2] - reach;
+	// a torus reaching behind the camera moves anywhere
+	if (nearest <= 0)
+		return HUGE_VALF;
+	const float offAxis = (std::max(std::fabs(t.position[0]), std::fabs(t.position[1])) + reach) / nearest;
+	return renderHeight * move * (1 + offAxis) / nearest;
+}
+
+/*
+* the pose of a torus at a music time. it is a function of the time,
+* however many frames there were before this one
+*/
+void PoseInstance(const torus_instance &t, int time, MATRIX &rot, float &uniformScale, float &bulk)
+{
+	const torus_pose pose = timeline.evaluate(time - (double)t.phase);
+	rot = Multiply(Multiply(Multiply(rotX(pose.angleX), rotY(pose.angleY)), rotZ(pose.angleZ)), t.base);
+	uniformScale = (pose.scale * t.response + BASE_SCALE * (1 - t.response)) * t.size;
+	bulk = pose.bulk * t.response;
+}
+
+/*
+* pose one torus for this frame, rotate and project all its vertices, and
+* just rotate point normals
+*/
+void TransformInstance(frame_state &fs, torus_instance &t)
+{
+	PROFILE_ZONE("TransformInstance");
+	MATRIX rot;
+	float uniformScale, bulk;
+	PoseInstance(t, fs.musicTime, rot, uniformScale, bulk);
+	const int level = fs.levels.empty() ? -1 : fs.levels[&t - &fs.instances[0]];
+	// close enough to the pose its vertices were transformed with, keep them
+	t.moved = !reuseFrames || fs.redrawFrame || (level >= 0 && level != t.level) ||
+		PoseMovement(t, rot, uniformScale, bulk) > reuseTolerance;
+	if (!t.moved)
+		return;
+	t.rot = rot;
+	t.uniformScale = uniformScale;
+	t.bulk = bulk;
+	if (level < 0)
+		SelectLod(t);
+	else
+		t.level = level;
+
+	const torus_mesh &m = meshes[t.level];
+	// scale, then rotate, then move in front of the camera
+	const AFFINE object(Multiply(scale(t.uniformScale), t.rot), t.position);
+	t.setup = SetupTransform(object, t.rot, t.bulk, renderWidth, renderHeight);
+	TransformStreams(m.org, t.cur, t.setup, 0, m.org.padded);
+}
+
+// worker job: keep taking tori until there are none left
+static void TransformInstances(int, void *data)
+{
+	frame_state &fs = *(frame_state *)data;
+	int i;
+	while ((i = fs.nextInstance++) < (int)fs.instances.size())
+		TransformInstance(fs, fs.instances[i]);
 }
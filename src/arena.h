@@ -0,0 +1,234 @@
+#ifndef __ARENA_H_
+#define __ARENA_H_
+
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <vector>
+
+#if defined(__linux__)
+#include <sys/mman.h>
+#endif
+
+// everything the SIMD kernels stream through starts on a cache line
+#define ARENA_ALIGN 64
+// the arena grows in blocks of at least this, and huge pages are this big
+#define ARENA_BLOCK (16 << 20)
+#define HUGE_PAGE_SIZE (2 << 20)
+
+inline void *AlignedAlloc(size_t size)
+{
+#if defined(_MSC_VER)
+	return _aligned_malloc(size, ARENA_ALIGN);
+#else
+	void *p = NULL;
+	if (posix_memalign(&p, ARENA_ALIGN, size))
+		return NULL;
+	return p;
+#endif
+}
+
+inline void AlignedFree(void *p)
+{
+#if defined(_MSC_VER)
+	_aligned_free(p);
+#else
+	free(p);
+#endif
+}
+
+/*
+* one bump allocator for the buffers that live as long as a screen size or
+* a mesh: the light map, the z-buffer and its tiles, the edge tables, the
+* meshes and what every frame works on. allocations are 64 byte aligned
+* and zeroed, and there is no free, only rewinding to a mark (the meshes
+* are rebuilt above one when the tessellation changes) and releasing it
+* all at once. the blocks can be backed by huge pages, which the kernel
+* only has if some were reserved (vm.nr_hugepages), otherwise they are
+* asked for as transparent huge pages. elsewhere than Linux that option
+* does nothing
+*/
+class ARENA
+{
+	typedef struct {
+		char *base;
+		size_t size, used;
+		bool mapped;
+	} arena_block;
+
+	std::vector<arena_block> blocks;
+	size_t current;
+	bool hugePages;
+
+	arena_block NewBlock(size_t size)
+	{
+		arena_block b = { NULL, size, 0, false };
+#if defined(__linux__)
+		if (hugePages)
+		{
+			b.size = (size + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+			void *p = mmap(NULL, b.size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+			if (p == MAP_FAILED)
+			{
+				p = mmap(NULL, b.size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+#if defined(MADV_HUGEPAGE)
+				if (p != MAP_FAILED)
+					madvise(p, b.size, MADV_HUGEPAGE);
+#endif
+			}
+			if (p != MAP_FAILED)
+			{
+				b.base = (char *)p;
+				b.mapped = true;
+				return b;
+			}
+			b.size = size;
+		}
+#endif
+		b.base = (char *)AlignedAlloc(size);
+		if (!b.base)
+			throw std::bad_alloc();
+		return b;
+	}
+
+	static void FreeBlock(arena_block &b)
+	{
+#if defined(__linux__)
+		if (b.mapped)
+		{
+			munmap(b.base, b.size);
+			return;
+		}
+#endif
+		AlignedFree(b.base);
+	}
+
+public:
+
+	typedef struct {
+		size_t block, used;
+	} arena_mark;
+
+	ARENA() : current(0), hugePages(false) {}
+	~ARENA() { release(); }
+
+	// for the blocks taken from now on
+	void setHugePages(const bool on) { hugePages = on; }
+
+	void *alloc(size_t size)
+	{
+		size = (size + ARENA_ALIGN - 1) / ARENA_ALIGN * ARENA_ALIGN;
+		// what doesn't fit in the rest of a block goes to the next one
+		// that is big enough, kept from before a rewind or a new one
+		while (current < blocks.size() && blocks[current].used + size > blocks[current].size)
+			if (++current < blocks.size())
+				blocks[current].used = 0;
+		if (current == blocks.size())
+			blocks.push_back(NewBlock(std::max(size, (size_t)ARENA_BLOCK)));
+		arena_block &b = blocks[current];
+		char *p = b.base + b.used;
+		b.used += size;
+		memset(p, 0, size);
+		return p;
+	}
+
+	template <typename T> T *alloc(const size_t count)
+	{
+		return (T *)alloc(count * sizeof(T));
+	}
+
+	arena_mark mark() const
+	{
+		arena_mark m = { current, current < blocks.size() ? blocks[current].used : 0 };
+		return m;
+	}
+
+	// forget everything allocated since m, the blocks stay for reuse
+	void rewind(const arena_mark &m)
+	{
+		current = m.block;
+		if (current < blocks.size())
+			blocks[current].used = m.used;
+	}
+
+	void release()
+	{
+		for (size_t i = 0; i < blocks.size(); i++)
+			FreeBlock(blocks[i]);
+		blocks.clear();
+		current = 0;
+	}
+
+	// bytes taken from the system, and handed out
+	size_t reserved() const
+	{
+		size_t total = 0;
+		for (size_t i = 0; i < blocks.size(); i++)
+			total += blocks[i].size;
+		return total;
+	}
+
+	size_t used() const
+	{
+		size_t total = 0;
+		for (size_t i = 0; i <= current && i < blocks.size(); i++)
+			total += blocks[i].used;
+		return total;
+	}
+};
+
+/*
+* with TORUS_COUNT_ALLOCATIONS every operator new and new[] of the
+* program is counted (the standard containers go through them too), so
+* the headless mode can check that a frame doesn't allocate. this replaces
+* the global operators, sized deletes included, so it must be included by
+* a single source file
+*/
+#if defined(TORUS_COUNT_ALLOCATIONS)
+static std::atomic<unsigned long long> allocationCount(0);
+
+static void *CountedAlloc(size_t size)
+{
+	allocationCount.fetch_add(1, std::memory_order_relaxed);
+	void *p = malloc(size ? size : 1);
+	if (!p)
+		throw std::bad_alloc();
+	return p;
+}
+
+void *operator new(size_t size)
+{
+	return CountedAlloc(size);
+}
+
+void *operator new[](size_t size)
+{
+	return CountedAlloc(size);
+}
+
+void operator delete(void *p) noexcept
+{
+	free(p);
+}
+
+void operator delete[](void *p) noexcept
+{
+	free(p);
+}
+
+void operator delete(void *p, size_t) noexcept
+{
+	free(p);
+}
+
+void operator delete[](void *p, size_t) noexcept
+{
+	free(p);
+}
+
+inline unsigned long long AllocationCount() { return allocationCount.load(std::memory_order_relaxed); }
+#endif
+
+#endif //__ARENA_H_
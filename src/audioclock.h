@@ -0,0 +1,81 @@
+#ifndef __AUDIOCLOCK_H_
+#define __AUDIOCLOCK_H_
+
+#include <SDL.h>
+#include <algorithm>
+#include <atomic>
+
+/*
+* where the audio output is, in samples of the mixed stream. the mixer's
+* post mix callback reports every chunk it hands to the device together
+* with the performance counter time. that chunk is heard once the device
+* has played the one before it, so what is heard at a later time is about
+* a chunk behind the mixed count, plus the time since the callback. the
+* callback writes under a sequence lock, so the render thread reads a
+* consistent set without ever blocking the audio thread
+*/
+class AUDIO_CLOCK
+{
+	std::atomic<unsigned int> sequence;
+	std::atomic<Sint64> mixed;
+	std::atomic<Uint64> stamp;
+	std::atomic<int> chunk;
+	double ticksPerSample;
+
+public:
+
+	AUDIO_CLOCK() : sequence(0), mixed(0), stamp(0), chunk(0), ticksPerSample(1) {}
+
+	// before the audio starts calling advance()
+	void start(const int sampleRate)
+	{
+		mixed.store(0, std::memory_order_relaxed);
+		stamp.store(0, std::memory_order_relaxed);
+		chunk.store(0, std::memory_order_relaxed);
+		ticksPerSample = (double)SDL_GetPerformanceFrequency() / sampleRate;
+	}
+
+	// audio thread: frames more samples were just mixed
+	void advance(const int frames)
+	{
+		const unsigned int s = sequence.load(std::memory_order_relaxed);
+		sequence.store(s + 1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+		mixed.store(mixed.load(std::memory_order_relaxed) + frames, std::memory_order_relaxed);
+		stamp.store(SDL_GetPerformanceCounter(), std::memory_order_relaxed);
+		chunk.store(frames, std::memory_order_relaxed);
+		sequence.store(s + 2, std::memory_order_release);
+	}
+
+	bool running() const { return stamp.load(std::memory_order_acquire) != 0; }
+
+	Sint64 mixedSamples() const { return mixed.load(std::memory_order_acquire); }
+
+	// the size of the chunks the device asks for, the latency it buffers
+	int chunkSamples() const { return chunk.load(std::memory_order_relaxed); }
+
+	// the sample being heard at performance counter time now
+	double playing(const Uint64 now) const
+	{
+		Sint64 m;
+		Uint64 t;
+		int c;
+		for (;;)
+		{
+			const unsigned int s = sequence.load(std::memory_order_acquire);
+			m = mixed.load(std::memory_order_relaxed);
+			t = stamp.load(std::memory_order_relaxed);
+			c = chunk.load(std::memory_order_relaxed);
+			std::atomic_thread_fence(std::memory_order_acquire);
+			if (!(s & 1) && s == sequence.load(std::memory_order_relaxed))
+				break;
+		}
+		if (!t)
+			return 0;
+		// never past the end of what was mixed, if a callback is late
+		const double since = now > t ? (double)(now - t) / ticksPerSample : 0;
+		return (double)(m - c) + std::min(since, (double)c);
+	}
+};
+
+#endif //__AUDIOCLOCK_H_
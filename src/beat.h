@@ -0,0 +1,333 @@
+#ifndef __BEAT_H_
+#define __BEAT_H_
+
+#include <SDL.h>
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstring>
+
+#include "ring.h"
+
+// samples per analysis frame and between two frames, a hop is 11.6 ms at
+// 44.1 kHz
+#define ANALYSIS_SIZE 1024
+#define ANALYSIS_HOP 512
+// bass, low mids, high mids and highs, split at these frequencies
+#define ANALYSIS_BANDS 4
+static const float bandSplits[ANALYSIS_BANDS - 1] = { 150, 600, 3000 };
+// hops of onset strength the tempo is estimated from, about 6 s
+#define ONSET_HISTORY 512
+// hops between two tempo estimates
+#define TEMPO_INTERVAL 32
+#define TEMPO_MIN_BPM 60
+#define TEMPO_MAX_BPM 200
+#define AUDIO_EVENTS 256
+
+// what the analysis found in one hop of audio
+typedef struct {
+	Sint64 sample;			// samples analysed so far, the end of the frame
+	float bands[ANALYSIS_BANDS];	// band energies relative to their recent peaks, 0 to 1
+	float bpm;			// 0 until there is a tempo
+	float strength;			// onset strength over the threshold, 0 without an onset
+	bool onset, beat;
+} audio_event;
+
+/*
+* onset and tempo detection on the audio thread. every hop the frame is
+* windowed and transformed, the onset strength is the spectral flux (how
+* much the log magnitudes rose since the last frame). onsets are its peaks
+* that stand out of the recent mean by more than the recent deviation, the
+* tempo is the strongest autocorrelation lag of its history, and beats
+* follow that period, pulled towards the onsets close to them. everything
+* is relative to the track itself, so no constants need tuning per song.
+* all the memory is in the object, nothing is allocated while it runs
+*/
+class BEAT_DETECTOR
+{
+	float rate;		// hops per second
+	float input[ANALYSIS_SIZE];
+	int filled;
+	Sint64 samples;
+
+	float window[ANALYSIS_SIZE];
+	float re[ANALYSIS_SIZE], im[ANALYSIS_SIZE];
+	float cosine[ANALYSIS_SIZE / 2], sine[ANALYSIS_SIZE / 2];
+	unsigned short reversed[ANALYSIS_SIZE];
+	float magnitude[ANALYSIS_SIZE / 2 + 1];	// log magnitudes of the last frame
+	int bandStart[ANALYSIS_BANDS + 1];
+	float bandPeak[ANALYSIS_BANDS], peakDecay;
+
+	float flux[ONSET_HISTORY];	// onset strength, indexed by hop
+	float history[ONSET_HISTORY], correlation[ONSET_HISTORY];
+	Sint64 hop, lastOnset;
+	int thresholdHops, onsetGap, minLag, maxLag;
+
+	float period, candidate;	// hops per beat, 0 while unknown
+	double lastBeat, nextBeat;
+	float bpm;
+
+	float at(const Sint64 h) const { return flux[h % ONSET_HISTORY]; }
+
+	void fft()
+	{
+		for (int size = 2, step = ANALYSIS_SIZE / 2; size <= ANALYSIS_SIZE; size *= 2, step /= 2)
+			for (int start = 0; start < ANALYSIS_SIZE; start += size)
+				for (int k = 0; k < size / 2; k++)
+				{
+					const int a = start + k, b = a + size / 2;
+					const float wr = cosine[k * step], wi = sine[k * step];
+					const float tr = re[b] * wr - im[b] * wi, ti = re[b] * wi + im[b] * wr;
+					re[b] = re[a] - tr;
+					im[b] = im[a] - ti;
+					re[a] += tr;
+					im[a] += ti;
+				}
+	}
+
+	// the previous hop is an onset when it peaks above the threshold
+	bool pickOnset(float &strength)
+	{
+		strength = 0;
+		if (hop <= thresholdHops + 1 || hop - 1 - lastOnset < onsetGap)
+			return false;
+		const float peak = at(hop - 1);
+		if (peak <= at(hop - 2) || peak < at(hop))
+			return false;
+		float mean = 0, square = 0;
+		for (int i = 2; i < thresholdHops + 2; i++)
+		{
+			mean += at(hop - i);
+			square += at(hop - i) * at(hop - i);
+		}
+		mean /= thresholdHops;
+		const float threshold = mean + std::sqrt(std::max(0.0f, square / thresholdHops - mean * mean));
+		if (peak <= threshold || threshold <= 0)
+			return false;
+		strength = peak / threshold;
+		lastOnset = hop - 1;
+		return true;
+	}
+
+	/*
+	* autocorrelation of the onset strength over the tempo range, weighted
+	* towards 120 BPM so a straight beat isn't taken at half or double speed
+	*/
+	void estimateTempo()
+	{
+		const int n = ONSET_HISTORY;
+		float mean = 0;
+		for (int i = 0; i < n; i++)
+			mean += history[i] = at(hop - n + 1 + i);
+		mean /= n;
+		for (int i = 0; i < n; i++)
+			history[i] -= mean;
+
+		const float center = rate * 60 / 120;
+		int best = 0;
+		float bestWeighted = 0;
+		for (int lag = minLag - 1; lag <= maxLag + 1; lag++)
+		{
+			float r = 0;
+			for (int i = lag; i < n; i++)
+				r += history[i] * history[i - lag];
+			correlation[lag] = r / (n - lag);
+		}
+		for (int lag = minLag; lag <= maxLag; lag++)
+		{
+			const float octaves = std::log2(lag / center);
+			const float weighted = correlation[lag] * std::exp(-0.5f * octaves * octaves);
+			if (weighted > bestWeighted)
+			{
+				bestWeighted = weighted;
+				best = lag;
+			}
+		}
+		if (!best)
+			return;
+
+		// the peak between the lags
+		float p = (float)best;
+		const float l = correlation[best - 1], c = correlation[best], r = correlation[best + 1];
+		if (l - 2 * c + r < 0)
+			p += 0.5f * (l - r) / (l - 2 * c + r);
+
+		// follow small drifts smoothly, jump to a new tempo once it is seen twice
+		if (period == 0)
+			period = p;
+		else if (std::fabs(p - period) < period * 0.05f)
+			period = period * 0.75f + p * 0.25f;
+		else if (candidate && std::fabs(p - candidate) < candidate * 0.05f)
+			period = p;
+		else
+		{
+			candidate = p;
+			return;
+		}
+		candidate = 0;
+		bpm = rate * 60 / period;
+	}
+
+	// whether a beat falls on this hop
+	bool trackBeat(const bool onset)
+	{
+		// every onset is a beat until the tempo is known
+		if (period == 0)
+			return onset;
+		const double onsetAt = (double)(hop - 1);
+		if (nextBeat == 0)
+		{
+			if (!onset)
+				return false;
+			lastBeat = onsetAt;
+			nextBeat = onsetAt + period;
+			return true;
+		}
+		if (onset)
+		{
+			// pull the grid a bit towards onsets near a beat
+			const double since = onsetAt - lastBeat, until = onsetAt - nextBeat;
+			const double error = std::fabs(since) < std::fabs(until) ? since : until;
+			if (std::fabs(error) < period * 0.2)
+				nextBeat += error * 0.25;
+		}
+		if (hop < nextBeat)
+			return false;
+		lastBeat = nextBeat;
+		nextBeat += period;
+		return true;
+	}
+
+	void analyse()
+	{
+		for (int i = 0; i < ANALYSIS_SIZE; i++)
+		{
+			re[reversed[i]] = input[i] * window[i];
+			im[reversed[i]] = 0;
+		}
+		fft();
+
+		float f = 0, energy[ANALYSIS_BANDS] = {};
+		for (int k = 0, band = 0; k <= ANALYSIS_SIZE / 2; k++)
+		{
+			const float power = re[k] * re[k] + im[k] * im[k];
+			const float m = std::log(1 + std::sqrt(power));
+			if (m > magnitude[k])
+				f += m - magnitude[k];
+			magnitude[k] = m;
+			while (k >= bandStart[band + 1])
+				band++;
+			energy[band] += power;
+		}
+
+		audio_event e;
+		e.sample = samples;
+		for (int b = 0; b < ANALYSIS_BANDS; b++)
+		{
+			bandPeak[b] = std::max(bandPeak[b] * peakDecay, energy[b]);
+			e.bands[b] = bandPeak[b] > 0 ? energy[b] / bandPeak[b] : 0;
+		}
+		flux[hop % ONSET_HISTORY] = f;
+		e.onset = pickOnset(e.strength);
+		if (hop >= ONSET_HISTORY && hop % TEMPO_INTERVAL == 0)
+			estimateTempo();
+		e.beat = trackBeat(e.onset);
+		e.bpm = bpm;
+		hop++;
+
+		if (!events.push(e))
+			dropped.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	void add(const float sample)
+	{
+		input[filled++] = sample;
+		samples++;
+		if (filled < ANALYSIS_SIZE)
+			return;
+		analyse();
+		memmove(input, input + ANALYSIS_HOP, (ANALYSIS_SIZE - ANALYSIS_HOP) * sizeof(float));
+		filled = ANALYSIS_SIZE - ANALYSIS_HOP;
+	}
+
+public:
+
+	// filled on the audio thread, drained by the render thread
+	SPSC_RING<audio_event, AUDIO_EVENTS> events;
+	// events that didn't fit because nobody drained them
+	std::atomic<unsigned int> dropped;
+
+	BEAT_DETECTOR() : dropped(0) { init(44100); }
+
+	// before the audio starts calling feed()
+	void init(const int sampleRate)
+	{
+		rate = (float)sampleRate / ANALYSIS_HOP;
+		filled = 0;
+		samples = hop = 0;
+		lastOnset = -ONSET_HISTORY;
+		period = candidate = bpm = 0;
+		lastBeat = nextBeat = 0;
+
+		int bits = 0;
+		while ((1 << bits) < ANALYSIS_SIZE)
+			bits++;
+		for (int i = 0; i < ANALYSIS_SIZE; i++)
+		{
+			window[i] = 0.5f - 0.5f * std::cos(2 * (float)M_PI * i / ANALYSIS_SIZE);
+			int r = 0;
+			for (int b = 0; b < bits; b++)
+				r |= ((i >> b) & 1) << (bits - 1 - b);
+			reversed[i] = (unsigned short)r;
+		}
+		for (int k = 0; k < ANALYSIS_SIZE / 2; k++)
+		{
+			cosine[k] = std::cos(2 * (float)M_PI * k / ANALYSIS_SIZE);
+			sine[k] = -std::sin(2 * (float)M_PI * k / ANALYSIS_SIZE);
+		}
+		memset(magnitude, 0, sizeof(magnitude));
+		memset(flux, 0, sizeof(flux));
+
+		bandStart[0] = 0;
+		for (int b = 1; b < ANALYSIS_BANDS; b++)
+			bandStart[b] = (int)(bandSplits[b - 1] * ANALYSIS_SIZE / sampleRate);
+		bandStart[ANALYSIS_BANDS] = ANALYSIS_SIZE / 2 + 1;
+		for (int b = 0; b < ANALYSIS_BANDS; b++)
+			bandPeak[b] = 0;
+		// the peaks halve in 3 s
+		peakDecay = std::pow(0.5f, 1 / (3 * rate));
+
+		// the threshold looks half a second back, onsets are 100 ms apart at least
+		thresholdHops = (int)(rate * 0.5f);
+		onsetGap = (int)(rate * 0.1f);
+		minLag = (int)(rate * 60 / TEMPO_MAX_BPM);
+		maxLag = std::min((int)(rate * 60 / TEMPO_MIN_BPM) + 1, ONSET_HISTORY / 2);
+	}
+
+	// interleaved samples, as SDL_mixer hands them to the post mix callback
+	void feed(const Sint16 *in, const int frames, const int channels)
+	{
+		const float unit = 1.0f / (32768.0f * channels);
+		for (int i = 0; i < frames; i++, in += channels)
+		{
+			int sum = 0;
+			for (int c = 0; c < channels; c++)
+				sum += in[c];
+			add(sum * unit);
+		}
+	}
+
+	void feed(const float *in, const int frames, const int channels)
+	{
+		const float unit = 1.0f / channels;
+		for (int i = 0; i < frames; i++, in += channels)
+		{
+			float sum = 0;
+			for (int c = 0; c < channels; c++)
+				sum += in[c];
+			add(sum * unit);
+		}
+	}
+};
+
+#endif //__BEAT_H_
@@ -0,0 +1,117 @@
+#ifndef __BENCHMARK_H_
+#define __BENCHMARK_H_
+
+#include <SDL.h>
+#include <algorithm>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+// collects frame durations (in milliseconds) and reports the usual figures
+class FRAME_TIMINGS
+{
+	std::vector<double> samples;
+
+public:
+
+	void reserve(const int n) { samples.reserve(n); }
+	void add(const double ms) { samples.push_back(ms); }
+	int count() const { return (int)samples.size(); }
+
+	double mean() const
+	{
+		if (samples.empty()) return 0;
+		double sum = 0;
+		for (size_t i = 0; i < samples.size(); i++)
+			sum += samples[i];
+		return sum / samples.size();
+	}
+
+	// nearest-rank percentile, p in [0, 100]
+	double percentile(const double p) const
+	{
+		if (samples.empty()) return 0;
+		std::vector<double> sorted(samples);
+		std::sort(sorted.begin(), sorted.end());
+		int rank = (int)(p / 100.0 * sorted.size() + 0.5);
+		if (rank < 1) rank = 1;
+		if (rank > (int)sorted.size()) rank = (int)sorted.size();
+		return sorted[rank - 1];
+	}
+
+	double max() const
+	{
+		if (samples.empty()) return 0;
+		return *std::max_element(samples.begin(), samples.end());
+	}
+
+	void print(std::ostream &out, const char *label) const
+	{
+		out << std::fixed << std::setprecision(3)
+			<< label << ": " << count() << " frames"
+			<< "  mean " << mean() << " ms"
+			<< "  p50 " << percentile(50) << " ms"
+			<< "  p99 " << percentile(99) << " ms"
+			<< "  max " << max() << " ms";
+		if (mean() > 0)
+			out << "  (" << std::setprecision(1) << 1000.0 / mean() << " FPS)";
+		out << std::endl;
+	}
+};
+
+// elapsed milliseconds between two SDL_GetPerformanceCounter() readings
+inline double CounterToMs(const Uint64 start, const Uint64 end)
+{
+	return (double)(end - start) * 1000.0 / (double)SDL_GetPerformanceFrequency();
+}
+
+/*
+* FNV-1a hash of the visible pixels of a surface, the padding at the end
+* of each row is skipped so the result only depends on the image
+*/
+inline Uint32 SurfaceChecksum(const SDL_Surface *surface)
+{
+	Uint32 hash = 2166136261u;
+	const int rowBytes = surface->w * surface->format->BytesPerPixel;
+	for (int y = 0; y < surface->h; y++)
+	{
+		const Uint8 *row = (const Uint8 *)surface->pixels + y * surface->pitch;
+		for (int i = 0; i < rowBytes; i++)
+		{
+			hash ^= row[i];
+			hash *= 16777619u;
+		}
+	}
+	return hash;
+}
+
+/*
+* golden files are plain text, one hexadecimal checksum per frame
+*/
+inline bool LoadGoldenChecksums(const char *path, std::vector<Uint32> &checksums)
+{
+	std::ifstream in(path);
+	if (!in) return false;
+	checksums.clear();
+	std::string line;
+	while (std::getline(in, line))
+	{
+		if (line.empty() || line[0] == '#') continue;
+		checksums.push_back((Uint32)std::stoul(line, NULL, 16));
+	}
+	return true;
+}
+
+inline bool SaveGoldenChecksums(const char *path, const std::vector<Uint32> &checksums)
+{
+	std::ofstream out(path);
+	if (!out) return false;
+	out << "# Musical Torus golden frame checksums" << std::endl;
+	for (size_t i = 0; i < checksums.size(); i++)
+		out << std::hex << std::setw(8) << std::setfill('0') << checksums[i] << std::endl;
+	return (bool)out;
+}
+
+#endif //__BENCHMARK_H_
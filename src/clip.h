@@ -0,0 +1,87 @@
+#ifndef __CLIP_H_
+#define __CLIP_H_
+
+#include "transform.h"
+
+// how far off the screen a vertex may be projected and still be handed to
+// the rasterizer as it is. the edge walk is 16.16 fixed point, so larger
+// coordinates could overflow; quads that reach outside the guard band are
+// clipped against it in screen space
+#define GUARD_BAND 8192
+
+// a quad clipped by the near plane and 4 guard band edges gets at most
+// one more vertex from each
+#define CLIP_MAX_VERTICES 9
+
+// one vertex of a polygon being clipped, x and y are in camera space
+// before the projection and on the screen after it. the texture and light
+// coordinates are kept as floats of their fixed point values
+typedef struct {
+	float x, y, z;
+	float tx, ty, px, py;
+} clip_vertex;
+
+typedef struct {
+	int count;
+	clip_vertex v[CLIP_MAX_VERTICES];
+} clip_polygon;
+
+inline clip_vertex LerpVertex(const clip_vertex &a, const clip_vertex &b, const float t)
+{
+	clip_vertex r;
+	r.x = a.x + (b.x - a.x) * t;
+	r.y = a.y + (b.y - a.y) * t;
+	r.z = a.z + (b.z - a.z) * t;
+	r.tx = a.tx + (b.tx - a.tx) * t;
+	r.ty = a.ty + (b.ty - a.ty) * t;
+	r.px = a.px + (b.px - a.px) * t;
+	r.py = a.py + (b.py - a.py) * t;
+	return r;
+}
+
+/*
+* Sutherland-Hodgman against one plane: keep the part of the polygon where
+* a * x + b * y + c * z + d >= 0. vertices on the inside are copied as they
+* are, so unclipped edges stay exactly where the neighbouring quads have them
+*/
+inline void ClipPolygon(clip_polygon &p, const float a, const float b, const float c, const float d)
+{
+	clip_polygon in = p;
+	p.count = 0;
+	for (int i = 0; i < in.count; i++)
+	{
+		const clip_vertex &v1 = in.v[i], &v2 = in.v[(i + 1) % in.count];
+		const float d1 = a * v1.x + b * v1.y + c * v1.z + d,
+			d2 = a * v2.x + b * v2.y + c * v2.z + d;
+		if (d1 >= 0)
+			p.v[p.count++] = v1;
+		if ((d1 >= 0) != (d2 >= 0))
+			p.v[p.count++] = LerpVertex(v1, v2, d1 / (d1 - d2));
+	}
+}
+
+/*
+* project a polygon clipped against the near plane, with the same
+* operations as the vertex transform so unclipped vertices land exactly
+* where it put them, as long as neither gets its multiply-adds fused
+*/
+inline void ProjectPolygon(clip_polygon &p, const float focal, const float cx, const float cy)
+{
+	for (int i = 0; i < p.count; i++)
+	{
+		const float scale = focal / p.v[i].z;
+		p.v[i].x = p.v[i].x * scale + cx;
+		p.v[i].y = p.v[i].y * scale + cy;
+	}
+}
+
+// clip a projected polygon to the guard band around a width x height screen
+inline void ClipGuardBand(clip_polygon &p, const int width, const int height)
+{
+	ClipPolygon(p, 1, 0, 0, (float)GUARD_BAND);
+	ClipPolygon(p, -1, 0, 0, (float)(width + GUARD_BAND));
+	ClipPolygon(p, 0, 1, 0, (float)GUARD_BAND);
+	ClipPolygon(p, 0, -1, 0, (float)(height + GUARD_BAND));
+}
+
+#endif //__CLIP_H_
@@ -0,0 +1,124 @@
+#ifndef __CULL_H_
+#define __CULL_H_
+
+#include <cfloat>
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+#include "vector.h"
+#include "transform.h"
+
+/*
+* what the back-face test needs of every quad, in object space: the face
+* normal and the plane offset (centre . normal). the centre is only read
+* for the quads that survive, to sort them. padded like the vertex streams,
+* the padding faces can never pass the test
+*/
+typedef struct {
+	float *nx, *ny, *nz, *d;
+	float *cx, *cy, *cz;
+	int count, padded;
+} face_streams;
+
+// like the vertex streams, from an arena or for FreeFaces
+inline void AllocFaces(face_streams &f, const int count, ARENA *arena = NULL)
+{
+	f.count = count;
+	f.padded = (count + STREAM_PAD - 1) / STREAM_PAD * STREAM_PAD;
+	const size_t bytes = 7 * (size_t)f.padded * sizeof(float);
+	float *block = (float *)(arena ? arena->alloc(bytes) : AlignedAlloc(bytes));
+	f.nx = block;
+	f.ny = f.nx + f.padded;
+	f.nz = f.ny + f.padded;
+	f.d = f.nz + f.padded;
+	f.cx = f.d + f.padded;
+	f.cy = f.cx + f.padded;
+	f.cz = f.cy + f.padded;
+}
+
+inline void FreeFaces(face_streams &f)
+{
+	AlignedFree(f.nx);
+	f.nx = f.ny = f.nz = f.d = f.cx = f.cy = f.cz = NULL;
+	f.count = f.padded = 0;
+}
+
+inline void SetFace(face_streams &f, const int i, const VECTOR &normal, const VECTOR &centre)
+{
+	f.nx[i] = normal[0];
+	f.ny[i] = normal[1];
+	f.nz[i] = normal[2];
+	f.d[i] = centre.dot(normal);
+	f.cx[i] = centre[0];
+	f.cy[i] = centre[1];
+	f.cz[i] = centre[2];
+}
+
+inline void PadFaces(face_streams &f)
+{
+	for (int i = f.count; i < f.padded; i++)
+	{
+		SetFace(f, i, VECTOR(0, 0, 0), VECTOR(0, 0, 0));
+		f.d[i] = FLT_MAX;
+	}
+}
+
+inline int LowestBit(const unsigned int mask)
+{
+#if defined(_MSC_VER)
+	unsigned long bit;
+	_BitScanForward(&bit, mask);
+	return (int)bit;
+#else
+	return __builtin_ctz(mask);
+#endif
+}
+
+/*
+* a quad faces the eye when the eye is in front of its plane, normal . eye
+* > d. writes the indices of those quads to out in mesh order and returns
+* how many there are. eye is the camera position in object space
+*/
+inline int CullFaces(const face_streams &f, const VECTOR &eye, int *out)
+{
+	int count = 0, i = 0;
+#if defined(__AVX__)
+	const __m256 ex = _mm256_set1_ps(eye[0]), ey = _mm256_set1_ps(eye[1]), ez = _mm256_set1_ps(eye[2]);
+	for (; i < f.padded; i += 8)
+	{
+		__m256 dot = _mm256_add_ps(_mm256_add_ps(
+			_mm256_mul_ps(_mm256_load_ps(f.nx + i), ex),
+			_mm256_mul_ps(_mm256_load_ps(f.ny + i), ey)),
+			_mm256_mul_ps(_mm256_load_ps(f.nz + i), ez));
+		unsigned int mask = (unsigned int)_mm256_movemask_ps(_mm256_cmp_ps(dot, _mm256_load_ps(f.d + i), _CMP_GT_OQ));
+		for (; mask; mask &= mask - 1)
+			out[count++] = i + LowestBit(mask);
+	}
+#elif defined(__SSE2__)
+	const __m128 ex = _mm_set1_ps(eye[0]), ey = _mm_set1_ps(eye[1]), ez = _mm_set1_ps(eye[2]);
+	for (; i < f.padded; i += 4)
+	{
+		__m128 dot = _mm_add_ps(_mm_add_ps(
+			_mm_mul_ps(_mm_load_ps(f.nx + i), ex),
+			_mm_mul_ps(_mm_load_ps(f.ny + i), ey)),
+			_mm_mul_ps(_mm_load_ps(f.nz + i), ez));
+		unsigned int mask = (unsigned int)_mm_movemask_ps(_mm_cmpgt_ps(dot, _mm_load_ps(f.d + i)));
+		for (; mask; mask &= mask - 1)
+			out[count++] = i + LowestBit(mask);
+	}
+#endif
+	for (; i < f.count; i++)
+		if (f.nx[i] * eye[0] + f.ny[i] * eye[1] + f.nz[i] * eye[2] > f.d[i])
+			out[count++] = i;
+	return count;
+}
+
+#endif //__CULL_H_
@@ -0,0 +1,245 @@
+#ifndef __EXPORT_H_
+#define __EXPORT_H_
+
+#include <SDL.h>
+#include <SDL_image.h>
+#include <algorithm>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// a numbered PNG per frame, a YUV4MPEG2 stream, or bare BGRA frames
+#define EXPORT_PNG 0
+#define EXPORT_Y4M 1
+#define EXPORT_RAW 2
+
+/*
+* takes the rendered frames and writes them out behind the renderer. a
+* frame is copied into a free slot, encoded by one of a pool of threads
+* (the PNG compression or the YUV conversion is what takes the time, so
+* several frames are encoded at once) and a writer thread appends the
+* stream formats in frame order. there is a fixed number of slots, when
+* they are all in use submit() waits, so memory stays bounded however far
+* ahead the renderer is
+*/
+class FRAME_EXPORTER
+{
+	enum { FREE, RENDERED, ENCODING, ENCODED };
+
+	typedef struct {
+		std::vector<Uint8> pixels, encoded;
+		int frame, state;
+	} export_slot;
+
+	int format, width, height;
+	std::string path;
+	FILE *stream;
+	std::vector<export_slot> slots;
+	std::vector<std::thread> encoders;
+	std::thread writer;
+	std::mutex lock;
+	std::condition_variable changed;
+	int submitted, written;
+	bool quit, failed;
+
+	// BT.601 full range 4:2:0, what C420jpeg means
+	void encodeY4M(export_slot &s)
+	{
+		const int cw = width / 2, ch = height / 2;
+		static const char header[] = "FRAME\n";
+		s.encoded.resize(sizeof(header) - 1 + width * height + 2 * cw * ch);
+		memcpy(s.encoded.data(), header, sizeof(header) - 1);
+		Uint8 *y = s.encoded.data() + sizeof(header) - 1, *u = y + width * height, *v = u + cw * ch;
+		const Uint32 *argb = (const Uint32 *)s.pixels.data();
+		for (int j = 0; j < height; j++)
+			for (int i = 0; i < width; i++)
+			{
+				const Uint32 c = argb[j * width + i];
+				const int r = (c >> 16) & 255, g = (c >> 8) & 255, b = c & 255;
+				y[j * width + i] = (Uint8)((19595 * r + 38470 * g + 7471 * b + 32768) >> 16);
+			}
+		for (int j = 0; j < ch; j++)
+			for (int i = 0; i < cw; i++)
+			{
+				int r = 0, g = 0, b = 0;
+				for (int k = 0; k < 4; k++)
+				{
+					const Uint32 c = argb[(2 * j + (k >> 1)) * width + 2 * i + (k & 1)];
+					r += (c >> 16) & 255;
+					g += (c >> 8) & 255;
+					b += c & 255;
+				}
+				// the sums are 4x the average, the shift divides that back
+				u[j * cw + i] = (Uint8)std::min(255, (-11059 * r - 21709 * g + 32768 * b + (128 << 18) + (1 << 17)) >> 18);
+				v[j * cw + i] = (Uint8)std::min(255, (32768 * r - 27439 * g - 5329 * b + (128 << 18) + (1 << 17)) >> 18);
+			}
+	}
+
+	bool encodePNG(export_slot &s)
+	{
+		char name[4096];
+		snprintf(name, sizeof(name), path.c_str(), s.frame);
+		SDL_Surface *surface = SDL_CreateRGBSurfaceWithFormatFrom(s.pixels.data(), width, height, 32, width * 4, SDL_PIXELFORMAT_ARGB8888);
+		const bool ok = surface && IMG_SavePNG(surface, name) == 0;
+		if (!ok)
+			std::cout << "Export can't write " << name << ": " << SDL_GetError() << std::endl;
+		SDL_FreeSurface(surface);
+		return ok;
+	}
+
+	void encodeLoop()
+	{
+		std::unique_lock<std::mutex> guard(lock);
+		for (;;)
+		{
+			// the oldest frame waiting, so the writer isn't held up
+			export_slot *next = NULL;
+			for (size_t i = 0; i < slots.size(); i++)
+				if (slots[i].state == RENDERED && (!next || slots[i].frame < next->frame))
+					next = &slots[i];
+			if (!next)
+			{
+				if (quit)
+					return;
+				changed.wait(guard);
+				continue;
+			}
+			next->state = ENCODING;
+			guard.unlock();
+			bool ok = true;
+			if (format == EXPORT_PNG)
+				ok = encodePNG(*next);
+			else if (format == EXPORT_Y4M)
+				encodeY4M(*next);
+			else
+				next->encoded.swap(next->pixels);
+			guard.lock();
+			failed |= !ok;
+			next->state = format == EXPORT_PNG ? FREE : ENCODED;
+			changed.notify_all();
+		}
+	}
+
+	void writeLoop()
+	{
+		std::unique_lock<std::mutex> guard(lock);
+		for (;;)
+		{
+			export_slot *next = NULL;
+			for (size_t i = 0; i < slots.size(); i++)
+				if (slots[i].state == ENCODED && slots[i].frame == written)
+					next = &slots[i];
+			if (!next)
+			{
+				if (quit && written == submitted)
+					return;
+				changed.wait(guard);
+				continue;
+			}
+			guard.unlock();
+			const bool ok = fwrite(next->encoded.data(), 1, next->encoded.size(), stream) == next->encoded.size();
+			if (format == EXPORT_RAW)
+				next->encoded.swap(next->pixels);
+			guard.lock();
+			if (!ok && !failed)
+				std::cout << "Export can't write frame " << written << std::endl;
+			failed |= !ok;
+			next->state = FREE;
+			written++;
+			changed.notify_all();
+		}
+	}
+
+public:
+
+	FRAME_EXPORTER() : stream(NULL), submitted(0), written(0), quit(false), failed(false) {}
+
+	/*
+	* path is a printf pattern for the frame number with PNG, a file or "-"
+	* for stdout with the streams
+	*/
+	bool start(const int exportFormat, const char *exportPath, const int w, const int h, const int fps, int threads)
+	{
+		format = exportFormat;
+		path = exportPath;
+		width = w;
+		height = h;
+		if (format != EXPORT_PNG)
+		{
+			stream = path == "-" ? stdout : fopen(exportPath, "wb");
+			if (!stream)
+			{
+				std::cout << "Export can't open " << path << std::endl;
+				return false;
+			}
+			if (format == EXPORT_Y4M)
+				fprintf(stream, "YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 C420jpeg\n", width, height, fps);
+		}
+
+		if (threads <= 0)
+			threads = std::max(1, (int)std::thread::hardware_concurrency());
+		// enough for every encoder to have a frame and the next ones queued
+		slots.resize(threads * 2 + 2);
+		for (size_t i = 0; i < slots.size(); i++)
+		{
+			slots[i].pixels.resize(width * height * 4);
+			slots[i].state = FREE;
+		}
+		for (int i = 0; i < threads; i++)
+			encoders.push_back(std::thread(&FRAME_EXPORTER::encodeLoop, this));
+		if (stream)
+			writer = std::thread(&FRAME_EXPORTER::writeLoop, this);
+		return true;
+	}
+
+	// from the render thread: copies the frame, waits while every slot is busy
+	void submit(const SDL_Surface *surface)
+	{
+		std::unique_lock<std::mutex> guard(lock);
+		export_slot *slot = NULL;
+		for (;;)
+		{
+			for (size_t i = 0; i < slots.size() && !slot; i++)
+				if (slots[i].state == FREE)
+					slot = &slots[i];
+			if (slot)
+				break;
+			changed.wait(guard);
+		}
+		slot->frame = submitted++;
+		guard.unlock();
+		for (int j = 0; j < height; j++)
+			memcpy(slot->pixels.data() + j * width * 4, (const Uint8 *)surface->pixels + j * surface->pitch, width * 4);
+		guard.lock();
+		slot->state = RENDERED;
+		changed.notify_all();
+	}
+
+	// waits for everything to be written, false if anything failed
+	bool finish()
+	{
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			quit = true;
+		}
+		changed.notify_all();
+		for (size_t i = 0; i < encoders.size(); i++)
+			encoders[i].join();
+		encoders.clear();
+		if (writer.joinable())
+			writer.join();
+		if (stream && stream != stdout)
+			failed |= fclose(stream) != 0;
+		else if (stream)
+			fflush(stream);
+		stream = NULL;
+		return !failed;
+	}
+};
+
+#endif //__EXPORT_H_
@@ -3,20 +3,25 @@
 
 #include "vector.h"
 
-class MATRIX
+/*
+* 3x3 matrix of three padded rows. like the rest of the demo it multiplies
+* row vectors: M * v is v times M, and (A * B) * v applies A first
+*/
+template <typename T>
+class Matrix3
 {
 
-	VECTOR m[3];
+	Vector3<T> m[3];
 
 public:
 
-	      VECTOR &operator[](const int i)       { return m[i]; }
-	const VECTOR &operator[](const int i) const { return m[i]; }
+	constexpr       Vector3<T> &operator[](const int i)       { return m[i]; }
+	constexpr const Vector3<T> &operator[](const int i) const { return m[i]; }
 
 
-	MATRIX operator*(const MATRIX &b) const
+	constexpr Matrix3 operator*(const Matrix3 &b) const
         {
-               MATRIX r;
+               Matrix3 r;
                for (int i=0; i<3; i++)
                    for (int j=0; j<3; j++)
                    {
@@ -27,67 +32,176 @@ public:
                return r;
         }
 
-	MATRIX(	const double a11, const double a12, const double a13,
-		const double a21, const double a22, const double a23,
-		const double a31, const double a32, const double a33)
+	constexpr Matrix3(const T a11, const T a12, const T a13,
+		const T a21, const T a22, const T a23,
+		const T a31, const T a32, const T a33)
+		: m{ Vector3<T>(a11, a12, a13), Vector3<T>(a21, a22, a23), Vector3<T>(a31, a32, a33) }
 	{
-		m[0][0]=a11; m[0][1]=a12; m[0][2]=a13;
-		m[1][0]=a21; m[1][1]=a22; m[1][2]=a23;
-		m[2][0]=a31; m[2][1]=a32; m[2][2]=a33;
 	}
 
-        VECTOR operator*(const VECTOR &v) const
+        constexpr Vector3<T> operator*(const Vector3<T> &v) const
         {
-           VECTOR r;
-           r[0] = v[0] * m[0][0] + v[1] * m[1][0] + v[2] * m[2][0];
-           r[1] = v[0] * m[0][1] + v[1] * m[1][1] + v[2] * m[2][1];
-           r[2] = v[0] * m[0][2] + v[1] * m[1][2] + v[2] * m[2][2];
-           return r;
+           return Vector3<T>(
+               v[0] * m[0][0] + v[1] * m[1][0] + v[2] * m[2][0],
+               v[0] * m[0][1] + v[1] * m[1][1] + v[2] * m[2][1],
+               v[0] * m[0][2] + v[1] * m[1][2] + v[2] * m[2][2]);
         }
 
-	 MATRIX() {}
-	~MATRIX() {}
+        constexpr bool operator==(const Matrix3 &b) const
+        {
+            return m[0] == b[0] && m[1] == b[1] && m[2] == b[2];
+        }
+
+	constexpr Matrix3() {}
+
+	static constexpr Matrix3 identity()
+	{
+		return Matrix3(1, 0, 0,
+			       0, 1, 0,
+			       0, 0, 1);
+	}
+
+	// the inverse of a pure rotation
+	constexpr Matrix3 transposed() const
+	{
+		return Matrix3(m[0][0], m[1][0], m[2][0],
+			       m[0][1], m[1][1], m[2][1],
+			       m[0][2], m[1][2], m[2][2]);
+	}
+};
+
+/*
+* 3x4 affine transform: a linear part and a translation applied after it,
+* so objpos stops being added by hand
+*/
+template <typename T>
+class Affine3
+{
+public:
+
+	Matrix3<T> linear;
+	Vector3<T> translation;
+
+	constexpr Affine3() : linear(Matrix3<T>::identity()), translation() {}
+	constexpr Affine3(const Matrix3<T> &l, const Vector3<T> &t) : linear(l), translation(t) {}
+
+	// transform a point
+	constexpr Vector3<T> operator*(const Vector3<T> &p) const
+	{
+		return linear * p + translation;
+	}
+
+	// transform a direction, the translation doesn't apply
+	constexpr Vector3<T> rotate(const Vector3<T> &d) const
+	{
+		return linear * d;
+	}
+
+	// this first, then b
+	constexpr Affine3 operator*(const Affine3 &b) const
+	{
+		return Affine3(linear * b.linear, b.linear * translation + b.translation);
+	}
 };
 
-static MATRIX rotX(const double theta)
+typedef Matrix3<float> MATRIX;
+typedef Affine3<float> AFFINE;
+
+template <typename T>
+inline Matrix3<T> rotX(const T theta)
 {
-	const double c = cos(theta);
-	const double s = sin(theta);
-	return MATRIX( 1, 0, 0,
+	const T c = std::cos(theta);
+	const T s = std::sin(theta);
+	return Matrix3<T>( 1, 0, 0,
 			 0, c, s,
 			 0,-s, c);
 }
 
-static MATRIX rotY(const double theta)
+template <typename T>
+inline Matrix3<T> rotY(const T theta)
 {
-	const double c = cos(theta);
-	const double s = sin(theta);
-	return MATRIX(	 c, 0,-s,
+	const T c = std::cos(theta);
+	const T s = std::sin(theta);
+	return Matrix3<T>(	 c, 0,-s,
 			 0, 1, 0,
 			 s, 0, c);
 }
 
-static MATRIX rotZ(const double theta)
+template <typename T>
+inline Matrix3<T> rotZ(const T theta)
 {
-	const double c = cos(theta);
-	const double s = sin(theta);
-	return MATRIX(	 c, s, 0,
+	const T c = std::cos(theta);
+	const T s = std::sin(theta);
+	return Matrix3<T>(	 c, s, 0,
 			-s, c, 0,
 			 0, 0, 1);
 }
 
-static MATRIX scale(const double x, const double y, const double z)
+template <typename T>
+constexpr Matrix3<T> scale(const T x, const T y, const T z)
 {
-    return MATRIX(x, 0, 0,
+    return Matrix3<T>(x, 0, 0,
                   0, y, 0,
                   0, 0, z);
 }
 
-static MATRIX scale(const double s)
+template <typename T>
+constexpr Matrix3<T> scale(const T s)
 {
-    return MATRIX(s, 0, 0,
+    return Matrix3<T>(s, 0, 0,
                   0, s, 0,
                   0, 0, s);
 }
 
+/*
+* SIMD versions of the matrix products for the float matrices. they do the
+* same operations in the same order as the constexpr operators, so results
+* are identical, only without the per component shuffling. that holds only
+* while the compiler doesn't fuse multiply-adds (-ffp-contract=off)
+*/
+inline VECTOR Transform(const MATRIX &m, const VECTOR &v)
+{
+#if defined(__SSE2__)
+	__m128 r = _mm_add_ps(_mm_add_ps(
+		_mm_mul_ps(_mm_set1_ps(v[0]), _mm_load_ps(&m[0][0])),
+		_mm_mul_ps(_mm_set1_ps(v[1]), _mm_load_ps(&m[1][0]))),
+		_mm_mul_ps(_mm_set1_ps(v[2]), _mm_load_ps(&m[2][0])));
+	VECTOR out;
+	_mm_store_ps(&out[0], r);
+	return out;
+#else
+	return m * v;
+#endif
+}
+
+inline VECTOR Transform(const AFFINE &a, const VECTOR &p)
+{
+	return Transform(a.linear, p) + a.translation;
+}
+
+inline MATRIX Multiply(const MATRIX &a, const MATRIX &b)
+{
+	// each row of the product is that row of a transformed by b
+	MATRIX r;
+	r[0] = Transform(b, a[0]);
+	r[1] = Transform(b, a[1]);
+	r[2] = Transform(b, a[2]);
+	return r;
+}
+
+inline AFFINE Multiply(const AFFINE &a, const AFFINE &b)
+{
+	return AFFINE(Multiply(a.linear, b.linear), Transform(b.linear, a.translation) + b.translation);
+}
+
+// the operators are usable at compile time, check the conventions there
+static_assert(scale(2.0f) * scale(3.0f) == scale(6.0f), "matrix product");
+static_assert(scale(1.0f, 2.0f, 3.0f) * VECTOR(1, 1, 1) == VECTOR(1, 2, 3), "matrix * vector");
+static_assert(Matrix3<float>(0, 1, 0, -1, 0, 0, 0, 0, 1) * VECTOR(1, 0, 0) == VECTOR(0, 1, 0), "row vectors");
+static_assert(Matrix3<float>(0, 1, 0, -1, 0, 0, 0, 0, 1).transposed() * Matrix3<float>(0, 1, 0, -1, 0, 0, 0, 0, 1)
+	== MATRIX::identity(), "transpose of a rotation");
+static_assert(cross(VECTOR(1, 0, 0), VECTOR(0, 1, 0)) == VECTOR(0, 0, 1), "cross product");
+static_assert((AFFINE(scale(2.0f), VECTOR(1, 0, 0)) * AFFINE(MATRIX::identity(), VECTOR(0, 0, 5))) * VECTOR(1, 1, 1)
+	== VECTOR(3, 2, 7), "affine composition applies the left one first");
+
 #endif //__MATRIX_H_
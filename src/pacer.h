@@ -0,0 +1,169 @@
+#ifndef __PACER_H_
+#define __PACER_H_
+
+#include <SDL.h>
+#include <algorithm>
+#include <iomanip>
+#include <iostream>
+#include <string>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// run as fast as possible, sleep to a fixed rate, or let a vsynced
+// present do the waiting
+#define PACE_UNCAPPED 0
+#define PACE_FIXED 1
+#define PACE_VSYNC 2
+
+// the histogram covers the last PACE_HISTORY frames, in bins of
+// PACE_BIN_US microseconds; longer frames all land in the last bin
+#define PACE_HISTORY 256
+#define PACE_BIN_US 500
+#define PACE_BINS 100
+
+/*
+* keeps the frames on a schedule of performance counter deadlines. SDL_Delay
+* only sleeps in whole milliseconds and often longer, so the pacer sleeps
+* until a margin before the deadline and spins the rest. the margin follows
+* how much SDL_Delay has overslept lately. a frame that misses its deadline
+* by more than a whole period restarts the schedule instead of rushing the
+* next ones to catch up
+*/
+class FRAME_PACER
+{
+	int mode;
+	Uint64 frequency, period, deadline, lastFrame;
+	double sleepSlack;
+
+	unsigned char history[PACE_HISTORY];	// bin of each of the recent frames
+	bool historyLate[PACE_HISTORY];
+	int bins[PACE_BINS];
+	int recent, recentLate, next;
+	Uint64 frames, late;
+
+	void record(const Uint64 elapsed, const bool missed)
+	{
+		int bin = (int)(elapsed * 1000000 / frequency / PACE_BIN_US);
+		bin = std::min(bin, PACE_BINS - 1);
+		if (recent == PACE_HISTORY)
+		{
+			bins[history[next]]--;
+			recentLate -= historyLate[next];
+		}
+		else
+			recent++;
+		history[next] = (unsigned char)bin;
+		historyLate[next] = missed;
+		bins[bin]++;
+		recentLate += missed;
+		next = (next + 1) % PACE_HISTORY;
+		frames++;
+		late += missed;
+	}
+
+	void sleepUntil(const Uint64 until)
+	{
+		for (;;)
+		{
+			const Uint64 now = SDL_GetPerformanceCounter();
+			if (now >= until)
+				return;
+			const double remaining = (double)(until - now) * 1000.0 / frequency;
+			if (remaining <= sleepSlack + 1)
+				break;
+			const Uint32 ms = (Uint32)(remaining - sleepSlack);
+			SDL_Delay(ms);
+			const double slept = (double)(SDL_GetPerformanceCounter() - now) * 1000.0 / frequency;
+			sleepSlack = std::max(sleepSlack * 0.95, slept - ms);
+		}
+		while (SDL_GetPerformanceCounter() < until)
+		{
+#if defined(__SSE2__)
+			_mm_pause();
+#endif
+		}
+	}
+
+	// upper end of the bin the p percentile of the recent frames falls in
+	double percentile(const double p) const
+	{
+		int rank = std::max(1, (int)(p / 100.0 * recent + 0.5)), bin = 0;
+		for (int seen = bins[0]; seen < rank && bin < PACE_BINS - 1; seen += bins[++bin]);
+		return (bin + 1) * PACE_BIN_US / 1000.0;
+	}
+
+public:
+
+	FRAME_PACER() : mode(PACE_FIXED), frequency(1), period(1), deadline(0), lastFrame(0) {}
+
+	// fps is the rate to keep in fixed mode, and the display refresh in vsync
+	void start(const int paceMode, const int fps)
+	{
+		mode = paceMode;
+		frequency = SDL_GetPerformanceFrequency();
+		period = frequency / fps;
+		sleepSlack = 1;
+		std::fill(bins, bins + PACE_BINS, 0);
+		recent = recentLate = next = 0;
+		frames = late = 0;
+		lastFrame = deadline = SDL_GetPerformanceCounter();
+	}
+
+	// at the end of a frame: wait for the next one, return the time since
+	// the previous call in performance counter ticks
+	Uint64 wait()
+	{
+		Uint64 now = SDL_GetPerformanceCounter();
+		bool missed = false;
+		if (mode == PACE_FIXED)
+		{
+			deadline += period;
+			if (now > deadline)
+			{
+				missed = true;
+				if (now - deadline > period)
+					deadline = now;
+			}
+			else
+			{
+				sleepUntil(deadline);
+				now = SDL_GetPerformanceCounter();
+			}
+		}
+		// the present already waited for the blank, a frame that took
+		// half a refresh more than that skipped one
+		else if (mode == PACE_VSYNC)
+			missed = now - lastFrame > period + period / 2;
+
+		const Uint64 elapsed = now - lastFrame;
+		lastFrame = now;
+		record(elapsed, missed);
+		return elapsed;
+	}
+
+	void print(std::ostream &out) const
+	{
+		static const char *modes[] = { "uncapped", "fixed", "vsync" };
+		out << std::fixed << std::setprecision(1)
+			<< "pacing: " << modes[mode];
+		if (mode != PACE_UNCAPPED)
+			out << " at " << (double)frequency / period << " Hz";
+		out << ", " << frames << " frames, " << late << " missed deadlines" << std::endl;
+		if (!recent)
+			return;
+		out << "  last " << recent << " frames: p50 " << percentile(50) << " ms  p99 " << percentile(99)
+			<< " ms, " << recentLate << " missed" << std::endl;
+		int most = *std::max_element(bins, bins + PACE_BINS);
+		for (int b = 0; b < PACE_BINS; b++)
+		{
+			if (!bins[b])
+				continue;
+			out << "  " << (b == PACE_BINS - 1 ? ">" : " ") << std::setw(5) << b * PACE_BIN_US / 1000.0
+				<< " ms " << std::setw(4) << bins[b] << " " << std::string((bins[b] * 40 + most - 1) / most, '#') << std::endl;
+		}
+	}
+};
+
+#endif //__PACER_H_
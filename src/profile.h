@@ -0,0 +1,338 @@
+#ifndef __PROFILE_H_
+#define __PROFILE_H_
+
+/*
+* timers and counters for the stages of a frame. built with TORUS_PROFILE
+* every PROFILE_ZONE records when its scope started and ended, on the
+* thread it ran on, and PROFILE_COUNT adds to a counter of that thread.
+* each thread writes only its own buffers, without locks or atomics, and
+* PROFILE_FRAME (on the main thread, between frames, while the workers
+* wait) closes the frame and takes the sums of the counters. the zones
+* and frames are kept in rings, the oldest ones go when they are full.
+* PROFILE_DUMP writes what is kept as a Chrome trace (chrome://tracing,
+* Perfetto) or, for a .csv path, one line per frame. without TORUS_PROFILE
+* all of it compiles to nothing
+*/
+
+// the counters, summed per frame. the _ms ones add up performance counter
+// ticks of sections too short for a zone each
+enum {
+	PROFILE_QUADS_CULLED,	// facing away or off the screen
+	PROFILE_QUADS_DRAWN,	// left after culling
+	PROFILE_POLIES_HIDDEN,	// skipped in a band by the hierarchical z
+	PROFILE_SPANS,
+	PROFILE_SPAN_PIXELS,	// covered by the spans
+	PROFILE_PIXELS_WRITTEN,	// passed the z test, or shaded by the span buffer
+	PROFILE_SCAN_MS,	// the edge tables of the polies
+	PROFILE_FILL_MS,	// their spans
+	PROFILE_COUNTERS
+};
+
+#if defined(TORUS_PROFILE)
+
+#include <SDL.h>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// zones kept per thread, frames kept, threads that can record
+#define PROFILE_ZONES (1 << 16)
+#define PROFILE_FRAMES (1 << 14)
+#define PROFILE_THREADS 64
+
+typedef struct {
+	const char *name;
+	Uint64 start, end;
+	int frame;
+} profile_zone;
+
+typedef struct {
+	profile_zone *zones;
+	Uint64 zoneCount;
+	Uint64 counters[PROFILE_COUNTERS];
+} profile_thread;
+
+typedef struct {
+	Uint64 start, end;
+	Uint64 counters[PROFILE_COUNTERS];
+} profile_frame;
+
+static const char *const profileCounterNames[PROFILE_COUNTERS] = {
+	"quads_culled", "quads_drawn", "polies_hidden", "spans",
+	"span_pixels", "pixels_written", "scan_ms", "fill_ms"
+};
+
+/*
+* what all the threads share. a thread registers once, under the lock,
+* the first time it records anything
+*/
+class PROFILER
+{
+	std::mutex lock;
+	profile_thread *threads[PROFILE_THREADS];
+	int threadCount;
+	profile_frame *frames;
+	Uint64 frameCount, origin;
+
+	double ms(const Uint64 ticks) const
+	{
+		return (double)ticks * 1000.0 / (double)SDL_GetPerformanceFrequency();
+	}
+
+	double us(const Uint64 tick) const
+	{
+		return tick < origin ? 0 : (double)(tick - origin) * 1000000.0 / (double)SDL_GetPerformanceFrequency();
+	}
+
+	// a counter as it is written out, the ticks in milliseconds
+	double value(const profile_frame &f, const int c) const
+	{
+		return c == PROFILE_SCAN_MS || c == PROFILE_FILL_MS ? ms(f.counters[c]) : (double)f.counters[c];
+	}
+
+	Uint64 firstFrame() const { return frameCount > PROFILE_FRAMES ? frameCount - PROFILE_FRAMES : 0; }
+
+	bool writeTrace(FILE *out)
+	{
+		fprintf(out, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+		fprintf(out, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"Musical Torus\"}}");
+		for (int t = 0; t < threadCount; t++)
+			fprintf(out, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s %d\"}}",
+				t, t ? "worker" : "main", t);
+		for (int t = 0; t < threadCount; t++)
+		{
+			const profile_thread &p = *threads[t];
+			const Uint64 first = p.zoneCount > PROFILE_ZONES ? p.zoneCount - PROFILE_ZONES : 0;
+			for (Uint64 i = first; i < p.zoneCount; i++)
+			{
+				const profile_zone &z = p.zones[i % PROFILE_ZONES];
+				fprintf(out, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"frame\":%d}}",
+					z.name, t, us(z.start), us(z.end) - us(z.start), z.frame);
+			}
+		}
+		// the counters of each frame as counter tracks, at its start
+		for (Uint64 i = firstFrame(); i < frameCount; i++)
+		{
+			const profile_frame &f = frames[i % PROFILE_FRAMES];
+			fprintf(out, ",\n{\"name\":\"counters\",\"ph\":\"C\",\"pid\":1,\"ts\":%.3f,\"args\":{", us(f.start));
+			for (int c = 0; c < PROFILE_COUNTERS; c++)
+				fprintf(out, "%s\"%s\":%.3f", c ? "," : "", profileCounterNames[c], value(f, c));
+			fprintf(out, "}}");
+		}
+		fprintf(out, "\n]}\n");
+		return !ferror(out);
+	}
+
+	// a line per frame: its time, the counters and the time of every zone
+	// name in it, summed over the threads
+	bool writeCSV(FILE *out)
+	{
+		std::vector<const char *> names;
+		for (int t = 0; t < threadCount; t++)
+		{
+			const profile_thread &p = *threads[t];
+			const Uint64 first = p.zoneCount > PROFILE_ZONES ? p.zoneCount - PROFILE_ZONES : 0;
+			for (Uint64 i = first; i < p.zoneCount; i++)
+			{
+				const char *name = p.zones[i % PROFILE_ZONES].name;
+				size_t k = 0;
+				while (k < names.size() && strcmp(names[k], name))
+					k++;
+				if (k == names.size())
+					names.push_back(name);
+			}
+		}
+		const Uint64 first = firstFrame();
+		std::vector<double> zoneMs((size_t)(frameCount - first) * names.size());
+		for (int t = 0; t < threadCount; t++)
+		{
+			const profile_thread &p = *threads[t];
+			const Uint64 firstZone = p.zoneCount > PROFILE_ZONES ? p.zoneCount - PROFILE_ZONES : 0;
+			for (Uint64 i = firstZone; i < p.zoneCount; i++)
+			{
+				const profile_zone &z = p.zones[i % PROFILE_ZONES];
+				if ((Uint64)z.frame < first || (Uint64)z.frame >= frameCount)
+					continue;
+				size_t k = 0;
+				while (strcmp(names[k], z.name))
+					k++;
+				zoneMs[(size_t)(z.frame - first) * names.size() + k] += ms(z.end - z.start);
+			}
+		}
+
+		fprintf(out, "frame,start_ms,frame_ms");
+		for (int c = 0; c < PROFILE_COUNTERS; c++)
+			fprintf(out, ",%s", profileCounterNames[c]);
+		fprintf(out, ",pixels_hidden,overdraw");
+		for (size_t k = 0; k < names.size(); k++)
+			fprintf(out, ",%s_ms", names[k]);
+		fprintf(out, "\n");
+		for (Uint64 i = first; i < frameCount; i++)
+		{
+			const profile_frame &f = frames[i % PROFILE_FRAMES];
+			fprintf(out, "%llu,%.3f,%.3f", (unsigned long long)i, us(f.start) / 1000, ms(f.end - f.start));
+			for (int c = 0; c < PROFILE_COUNTERS; c++)
+				fprintf(out, ",%g", value(f, c));
+			// span pixels that weren't written: behind a tile, the z-buffer
+			// or another span. with the span buffer, span pixels per written
+			// one is the depth complexity
+			const Uint64 spanPixels = f.counters[PROFILE_SPAN_PIXELS], written = f.counters[PROFILE_PIXELS_WRITTEN];
+			fprintf(out, ",%llu,%.3f", (unsigned long long)(spanPixels > written ? spanPixels - written : 0),
+				written ? (double)spanPixels / written : 0.0);
+			for (size_t k = 0; k < names.size(); k++)
+				fprintf(out, ",%.4f", zoneMs[(size_t)(i - first) * names.size() + k]);
+			fprintf(out, "\n");
+		}
+		return !ferror(out);
+	}
+
+public:
+
+	PROFILER() : threadCount(0), frames(NULL), frameCount(0), origin(0) {}
+
+	profile_thread *join()
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		if (threadCount == PROFILE_THREADS)
+			return NULL;
+		profile_thread *p = new profile_thread();
+		p->zones = new profile_zone[PROFILE_ZONES];
+		threads[threadCount++] = p;
+		return p;
+	}
+
+	// ends the frame that is running and starts the next one
+	void frame(const Uint64 now)
+	{
+		// what was counted before the first frame is dropped
+		const bool first = !frames;
+		if (first)
+		{
+			frames = new profile_frame[PROFILE_FRAMES];
+			origin = now;
+		}
+		profile_frame &f = frames[frameCount % PROFILE_FRAMES];
+		for (int c = 0; c < PROFILE_COUNTERS; c++)
+		{
+			f.counters[c] = 0;
+			for (int t = 0; t < threadCount; t++)
+			{
+				f.counters[c] += threads[t]->counters[c];
+				threads[t]->counters[c] = 0;
+			}
+		}
+		if (!first)
+		{
+			f.end = now;
+			frameCount++;
+		}
+		frames[frameCount % PROFILE_FRAMES].start = now;
+	}
+
+	// the frame the zones started now belong to
+	int current() const { return (int)frameCount; }
+
+	bool dump(const char *path)
+	{
+		FILE *out = fopen(path, "w");
+		if (!out)
+		{
+			std::cout << "Profile can't be written: " << path << std::endl;
+			return false;
+		}
+		const char *dot = strrchr(path, '.');
+		bool ok = dot && !strcmp(dot, ".csv") ? writeCSV(out) : writeTrace(out);
+		ok &= fclose(out) == 0;
+		std::cout << "Profile: " << (frameCount - firstFrame()) << " frames written to " << path << std::endl;
+		return ok;
+	}
+};
+
+inline PROFILER &Profiler()
+{
+	static PROFILER profiler;
+	return profiler;
+}
+
+// the buffers of the calling thread, NULL once there are too many threads
+inline profile_thread *ProfileThread()
+{
+	static thread_local profile_thread *p = Profiler().join();
+	return p;
+}
+
+inline void ProfileCount(const int counter, const Uint64 n)
+{
+	profile_thread *p = ProfileThread();
+	if (p)
+		p->counters[counter] += n;
+}
+
+// lanes set in a movemask
+inline int ProfileBits(unsigned int mask)
+{
+	int n = 0;
+	for (; mask; mask &= mask - 1)
+		n++;
+	return n;
+}
+
+class PROFILE_SCOPE
+{
+	const char *name;
+	Uint64 start;
+
+public:
+
+	explicit PROFILE_SCOPE(const char *zoneName) : name(zoneName), start(SDL_GetPerformanceCounter()) {}
+
+	~PROFILE_SCOPE()
+	{
+		profile_thread *p = ProfileThread();
+		if (!p)
+			return;
+		profile_zone &z = p->zones[p->zoneCount++ % PROFILE_ZONES];
+		z.name = name;
+		z.start = start;
+		z.end = SDL_GetPerformanceCounter();
+		z.frame = Profiler().current();
+	}
+};
+
+// adds the ticks of its scope to one of the _ms counters
+class PROFILE_TIMER
+{
+	int counter;
+	Uint64 start;
+
+public:
+
+	explicit PROFILE_TIMER(const int c) : counter(c), start(SDL_GetPerformanceCounter()) {}
+	~PROFILE_TIMER() { ProfileCount(counter, SDL_GetPerformanceCounter() - start); }
+};
+
+#define PROFILE_JOIN2(a, b) a##b
+#define PROFILE_JOIN(a, b) PROFILE_JOIN2(a, b)
+#define PROFILE_ZONE(name) PROFILE_SCOPE PROFILE_JOIN(profileZone, __LINE__)(name)
+#define PROFILE_TIME(counter) PROFILE_TIMER PROFILE_JOIN(profileTimer, __LINE__)(counter)
+#define PROFILE_COUNT(counter, n) ProfileCount(counter, (Uint64)(n))
+#define PROFILE_FRAME() Profiler().frame(SDL_GetPerformanceCounter())
+#define PROFILE_DUMP(path) Profiler().dump(path)
+
+#else
+
+#define PROFILE_ZONE(name) do {} while (0)
+#define PROFILE_TIME(counter) do {} while (0)
+#define PROFILE_COUNT(counter, n) do {} while (0)
+#define PROFILE_FRAME() do {} while (0)
+#define PROFILE_DUMP(path) ProfileDump(path)
+
+// nothing was recorded
+inline bool ProfileDump(const char *) { return false; }
+
+#endif
+
+#endif //__PROFILE_H_
@@ -0,0 +1,47 @@
+#ifndef __RANDOM_H_
+#define __RANDOM_H_
+
+// small xorshift generator, so a given seed always produces the same
+// choreography no matter which C library we are linked against
+class RANDOM
+{
+	unsigned int state;
+
+public:
+
+	RANDOM(const unsigned int s = 1) { seed(s); }
+
+	void seed(const unsigned int s)
+	{
+		// xorshift gets stuck on zero
+		state = s ? s : 0x9E3779B9u;
+	}
+
+	unsigned int next()
+	{
+		state ^= state << 13;
+		state ^= state >> 17;
+		state ^= state << 5;
+		return state;
+	}
+
+	// integer in [0, n)
+	int operator()(const int n) { return (int)(next() % (unsigned int)n); }
+};
+
+/*
+* scrambles a seed and a counter into a new seed (murmur3's finalizer), so
+* generators seeded for neighbouring counters don't start out alike
+*/
+inline unsigned int MixSeed(const unsigned int seed, const unsigned int n)
+{
+	unsigned int h = seed ^ (n * 0x9E3779B9u);
+	h ^= h >> 16;
+	h *= 0x85EBCA6Bu;
+	h ^= h >> 13;
+	h *= 0xC2B2AE35u;
+	h ^= h >> 16;
+	return h;
+}
+
+#endif //__RANDOM_H_
@@ -0,0 +1,401 @@
+#ifndef __RASTER_H_
+#define __RASTER_H_
+
+#include <SDL.h>
+#include <algorithm>
+#include <cstdio>
+#include <vector>
+
+#include "vector.h"
+#include "transform.h"
+#include "span.h"
+#include "sbuffer.h"
+#include "clip.h"
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// one entry of the edge table
+typedef struct {
+	int x, px, py, tx, ty, z;
+} edge_data;
+
+// the screen is split in horizontal bands, each one rasterized by a single
+// thread with its own edge table, so pixels and z need no locking
+typedef struct {
+	// rows [y0, y1) of the screen
+	int y0, y1;
+	// store two edges per horizontal line of the band, room for rows lines
+	edge_data (*edge_table)[2];
+	int rows;
+	// remember the highest and the lowest point of the polygon
+	int poly_minY, poly_maxY;
+	// the spans of the band when visibility is resolved per scanline
+	SPAN_BUFFER sbuffer;
+	// pixels covered by spans, z-tested and shaded this frame
+	Uint64 spanPixels, testedPixels, shadedPixels;
+	// polies skipped entirely by the hierarchical z test
+	int hiddenPolies;
+} raster_band;
+
+// an edge of a poly from its top row down, rows [y1, y2): its values on
+// row y1 and their steps per row
+typedef struct {
+	int y1, y2;
+	edge_data e, d;
+} poly_edge;
+
+/*
+* convert the end points of an edge to fixed point and compute its steps,
+* the edge table and the blocks both start from here
+*/
+inline void SetupEdge(VECTOR p1, int tx1, int ty1, int px1, int py1,
+	VECTOR p2, int tx2, int ty2, int px2, int py2, poly_edge &edge)
+{
+	// we can't handle this case, so we recall the proc with reversed params
+	// saves having to swap all the vars, but it's not good practice
+	if (p2[1]<p1[1]) {
+		SetupEdge(p2, tx2, ty2, px2, py2, p1, tx1, ty1, px1, py1, edge);
+		return;
+	}
+	// convert to fixed point
+	int x1 = (int)(p1[0] * 65536),
+		y1 = (int)(p1[1]),
+		z1 = (int)(p1[2] * 16),
+		x2 = (int)(p2[0] * 65536),
+		y2 = (int)(p2[1]),
+		z2 = (int)(p2[2] * 16);
+	edge.y1 = y1;
+	edge.y2 = y2;
+	edge.e.x = x1;
+	edge.e.tx = tx1;
+	edge.e.ty = ty1;
+	edge.e.px = px1;
+	edge.e.py = py1;
+	edge.e.z = z1;
+	// compute deltas for interpolation
+	int dy = y2 - y1;
+	if (dy == 0) {
+		edge.d = edge_data();
+		return;
+	}
+	edge.d.x = (x2 - x1) / dy;                // assume 16.16 fixed point
+	edge.d.tx = (tx2 - tx1) / dy;
+	edge.d.ty = (ty2 - ty1) / dy;
+	edge.d.px = (px2 - px1) / dy;
+	edge.d.py = (py2 - py1) / dy;
+	edge.d.z = (z2 - z1) / dy;              // probably 12.4, but doesn't matter
+}
+
+// the values of an edge on row y, the same as stepping down to it
+inline edge_data EdgeAt(const poly_edge &edge, const int y)
+{
+	const int n = y - edge.y1;
+	edge_data e;
+	e.x = StepFixed(edge.e.x, edge.d.x, n);
+	e.px = StepFixed(edge.e.px, edge.d.px, n);
+	e.py = StepFixed(edge.e.py, edge.d.py, n);
+	e.tx = StepFixed(edge.e.tx, edge.d.tx, n);
+	e.ty = StepFixed(edge.e.ty, edge.d.ty, n);
+	e.z = StepFixed(edge.e.z, edge.d.z, n);
+	return e;
+}
+
+/*
+* scan along one edge of the poly, i.e. interpolate all values and store
+* in the edge table
+*/
+inline void ScanEdge(raster_band &band, VECTOR p1, int tx1, int ty1, int px1, int py1,
+	VECTOR p2, int tx2, int ty2, int px2, int py2)
+{
+	poly_edge edge;
+	SetupEdge(p1, tx1, ty1, px1, py1, p2, tx2, ty2, px2, py2, edge);
+	// update the min and max of the current polygon
+	if (edge.y1<band.poly_minY) band.poly_minY = edge.y1;
+	if (edge.y2>band.poly_maxY) band.poly_maxY = edge.y2;
+	if (edge.y2 == edge.y1) return;
+	// only the rows of this band are stored, jump straight to the first one
+	int start = edge.y1 > band.y0 ? edge.y1 : band.y0,
+		end = edge.y2 < band.y1 ? edge.y2 : band.y1;
+	if (start >= end) return;
+	edge_data v = EdgeAt(edge, start);
+	// interpolate along the edge
+	for (int y = start; y<end; y++)
+	{
+		edge_data *row = band.edge_table[y - band.y0];
+		// is first slot free? if so use that, otherwise use the other
+		edge_data &e = row[0].x == -1 ? row[0] : row[1];
+		e = v;
+		// interpolate our values
+		v.x += edge.d.x;
+		v.px += edge.d.px;
+		v.py += edge.d.py;
+		v.tx += edge.d.tx;
+		v.ty += edge.d.ty;
+		v.z += edge.d.z;
+	}
+}
+
+/*
+* find the on-screen part of the span between two edges and the values at
+* its first pixel on a screen width pixels wide, false if there is nothing
+* to draw
+*/
+inline bool SetupSpan(edge_data *p1, edge_data *p2, const int width, int &x1, int &x2, span_data &span)
+{
+	// quick check, if facing back then draw span in the other direction,
+	// avoids having to swap all the vars... not a very elegant
+	if (p1->x > p2->x)
+		return SetupSpan(p2, p1, width, x1, x2, span);
+	// load starting points
+	x1 = p1->x >> 16;
+	x2 = p2->x >> 16;
+	// check if it's inside the screen
+	if ((x1>(width - 1)) || (x2<0)) return false;
+	// compute deltas for interpolation
+	int dx = x2 - x1;
+	if (dx == 0) return false;
+	span.z = p1->z;
+	span.px = p1->px;
+	span.py = p1->py;
+	span.tx = p1->tx;
+	span.ty = p1->ty;
+	span.dtx = (p2->tx - p1->tx) / dx;  // assume 16.16 fixed point
+	span.dty = (p2->ty - p1->ty) / dx;
+	span.dpx = (p2->px - p1->px) / dx;
+	span.dpy = (p2->py - p1->py) / dx;
+	span.dz = (p2->z - p1->z) / dx;
+
+	// clip against the left and right borders
+	if (x1 < 0)
+	{
+		SkipSpan(span, -x1);
+		x1 = 0;
+	}
+	if (x2 > width) x2 = width;
+	return true;
+}
+
+// a corner of a quad as ScanEdge takes it: on the screen, with the static
+// and the dynamic texture coordinates
+typedef struct {
+	float x, y, z;
+	int tx, ty, px, py;
+} quad_corner;
+
+typedef struct {
+	quad_corner c[4];
+} screen_quad;
+
+/*
+* the corners of quad n of a grid with spans quads per slice, vertex[i]
+* being corner i in the transformed streams. the static texture coordinates
+* come from the grid lines, the first two corners are on slice s, the first
+* and the last on span p, the dynamic ones from the normal
+*/
+inline void QuadCorners(const vertex_streams &cur, const int vertex[4], const int n, const int spans,
+	const int *sliceRefs, const int *spanRefs, quad_corner c[4])
+{
+	const int s = n / spans, p = n - s * spans;
+	const int tx[4] = { sliceRefs[s], sliceRefs[s], sliceRefs[s + 1], sliceRefs[s + 1] };
+	const int ty[4] = { spanRefs[p], spanRefs[p + 1], spanRefs[p + 1], spanRefs[p] };
+	for (int i = 0; i < 4; i++)
+	{
+		const int a = vertex[i];
+		c[i].x = cur.x[a];
+		c[i].y = cur.y[a];
+		c[i].z = cur.z[a];
+		c[i].tx = tx[i];
+		c[i].ty = ty[i];
+		c[i].px = (int)(65536 * (128 + 127 * cur.nx[a]));
+		c[i].py = (int)(65536 * (128 + 127 * cur.ny[a]));
+	}
+}
+
+/*
+* the block rasterizer walks a poly in 8x8 blocks of the screen, the
+* tiles of the hierarchical z. it takes the edges down the two sides of a
+* convex poly: every row between its top and its bottom crosses exactly
+* one edge of each side, the same two the edge table would hold, so the
+* spans come out exactly the same
+*/
+#define BLOCK_SIZE 8
+
+typedef struct {
+	// the edges of each side, top to bottom
+	poly_edge side[2][CLIP_MAX_VERTICES];
+	int count[2];
+	// rows [y0, y1)
+	int y0, y1;
+	// the edge of each side on the row PolyRow was asked for last, and
+	// its values there
+	int next[2], row;
+	edge_data at[2];
+} block_poly;
+
+/*
+* split the edges of a poly in its two sides, the ones going down and the
+* ones going up. false if some row would cross more or fewer than one of
+* each (a poly bent or twisted on screen), that one is left to the edge
+* table
+*/
+inline bool SetupPoly(block_poly &p, const quad_corner *c, const int n)
+{
+	p.count[0] = p.count[1] = 0;
+	p.next[0] = p.next[1] = 0;
+	// no row yet, the first one asked for is looked up
+	p.row = -2;
+	for (int i = 0; i < n; i++)
+	{
+		const quad_corner &a = c[i], &b = c[i + 1 < n ? i + 1 : 0];
+		const int ya = (int)a.y, yb = (int)b.y;
+		// flat edges cover no row
+		if (ya == yb)
+			continue;
+		const int k = yb > ya ? 0 : 1;
+		poly_edge &edge = p.side[k][p.count[k]++];
+		SetupEdge(VECTOR(a.x, a.y, a.z), a.tx, a.ty, a.px, a.py,
+			VECTOR(b.x, b.y, b.z), b.tx, b.ty, b.px, b.py, edge);
+	}
+	if (!p.count[0] || !p.count[1])
+		return false;
+	// top to bottom, and each side must cover its rows once without a gap
+	for (int k = 0; k < 2; k++)
+	{
+		poly_edge *e = p.side[k];
+		for (int i = 1; i < p.count[k]; i++)
+			for (int j = i; j > 0 && e[j].y1 < e[j - 1].y1; j--)
+				std::swap(e[j], e[j - 1]);
+		for (int i = 1; i < p.count[k]; i++)
+			if (e[i].y1 != e[i - 1].y2)
+				return false;
+	}
+	p.y0 = p.side[0][0].y1;
+	p.y1 = p.side[0][p.count[0] - 1].y2;
+	return p.side[1][0].y1 == p.y0 && p.side[1][p.count[1] - 1].y2 == p.y1;
+}
+
+// the two edges on row y, asked for from the top down. the next row
+// steps from the last one like the edge table does
+inline void PolyRow(block_poly &p, const int y, edge_data &a, edge_data &b)
+{
+	for (int k = 0; k < 2; k++)
+	{
+		const poly_edge *e = &p.side[k][p.next[k]];
+		edge_data &v = p.at[k];
+		if (e->y2 <= y || y != p.row + 1)
+		{
+			while (e->y2 <= y)
+				e = &p.side[k][++p.next[k]];
+			v = EdgeAt(*e, y);
+			continue;
+		}
+		v.x += e->d.x;
+		v.px += e->d.px;
+		v.py += e->d.py;
+		v.tx += e->d.tx;
+		v.ty += e->d.ty;
+		v.z += e->d.z;
+	}
+	p.row = y;
+	a = p.at[0];
+	b = p.at[1];
+}
+
+/*
+* coverage of a block: bit i of mask[r] is set when pixel bx + i of row r
+* is inside the half-spaces of that row's edges, x >= x1[r] and x < x2[r].
+* returns 0 when no pixel is covered, 1 for some and 2 when all are
+*/
+inline int BlockCoverage(const int bx, const int *x1, const int *x2, int *mask)
+{
+	int any = 0, all = 0xFF;
+#if defined(__AVX2__)
+	const __m256i x = _mm256_add_epi32(_mm256_set1_epi32(bx), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+	for (int r = 0; r < BLOCK_SIZE; r++)
+	{
+		const __m256i in = _mm256_andnot_si256(_mm256_cmpgt_epi32(_mm256_set1_epi32(x1[r]), x),
+			_mm256_cmpgt_epi32(_mm256_set1_epi32(x2[r]), x));
+		mask[r] = _mm256_movemask_ps(_mm256_castsi256_ps(in));
+		any |= mask[r];
+		all &= mask[r];
+	}
+#elif defined(__SSE2__)
+	const __m128i lo = _mm_add_epi32(_mm_set1_epi32(bx), _mm_setr_epi32(0, 1, 2, 3)),
+		hi = _mm_add_epi32(lo, _mm_set1_epi32(4));
+	for (int r = 0; r < BLOCK_SIZE; r++)
+	{
+		const __m128i l = _mm_set1_epi32(x1[r]), h = _mm_set1_epi32(x2[r]);
+		const __m128i inLo = _mm_andnot_si128(_mm_cmpgt_epi32(l, lo), _mm_cmpgt_epi32(h, lo)),
+			inHi = _mm_andnot_si128(_mm_cmpgt_epi32(l, hi), _mm_cmpgt_epi32(h, hi));
+		mask[r] = _mm_movemask_ps(_mm_castsi128_ps(inLo)) | _mm_movemask_ps(_mm_castsi128_ps(inHi)) << 4;
+		any |= mask[r];
+		all &= mask[r];
+	}
+#else
+	for (int r = 0; r < BLOCK_SIZE; r++)
+	{
+		mask[r] = 0;
+		for (int i = 0; i < BLOCK_SIZE; i++)
+			if (bx + i >= x1[r] && bx + i < x2[r])
+				mask[r] |= 1 << i;
+		any |= mask[r];
+		all &= mask[r];
+	}
+#endif
+	return all == 0xFF ? 2 : any ? 1 : 0;
+}
+
+/*
+* quads recorded from a frame of the demo, for the kernel benchmarks to
+* scan and fill. plain text, the size of the screen and then a line of 28
+* numbers per quad
+*/
+inline bool SaveQuads(const char *path, const int width, const int height, const std::vector<screen_quad> &quads)
+{
+	FILE *out = fopen(path, "w");
+	if (!out) return false;
+	fprintf(out, "# Musical Torus quads\n%d %d\n", width, height);
+	for (size_t i = 0; i < quads.size(); i++)
+	{
+		for (int k = 0; k < 4; k++)
+		{
+			const quad_corner &c = quads[i].c[k];
+			fprintf(out, "%s%.9g %.9g %.9g %d %d %d %d", k ? " " : "", c.x, c.y, c.z, c.tx, c.ty, c.px, c.py);
+		}
+		fprintf(out, "\n");
+	}
+	return fclose(out) == 0;
+}
+
+inline bool LoadQuads(const char *path, int &width, int &height, std::vector<screen_quad> &quads)
+{
+	FILE *in = fopen(path, "r");
+	if (!in) return false;
+	char line[256];
+	bool ok = fgets(line, sizeof(line), in) && line[0] == '#' && fscanf(in, "%d %d", &width, &height) == 2;
+	quads.clear();
+	screen_quad q;
+	while (ok)
+	{
+		int k = 0;
+		for (; k < 4; k++)
+		{
+			quad_corner &c = q.c[k];
+			if (fscanf(in, "%f %f %f %d %d %d %d", &c.x, &c.y, &c.z, &c.tx, &c.ty, &c.px, &c.py) != 7)
+				break;
+		}
+		if (k == 0)
+			break;
+		ok = k == 4;
+		if (ok)
+			quads.push_back(q);
+	}
+	fclose(in);
+	return ok && width > 0 && height > 0;
+}
+
+#endif //__RASTER_H_
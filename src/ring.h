@@ -0,0 +1,49 @@
+#ifndef __RING_H_
+#define __RING_H_
+
+#include <atomic>
+
+/*
+* fixed size queue between exactly one producer thread and one consumer
+* thread, without locks: each side only writes its own counter. N must be
+* a power of two. the counters run freely and wrap, their difference is
+* the number of queued items
+*/
+template <typename T, int N>
+class SPSC_RING
+{
+	static_assert(N > 0 && (N & (N - 1)) == 0, "ring size must be a power of two");
+
+	T items[N];
+	// on separate cache lines, so the two threads don't fight over one
+	alignas(64) std::atomic<unsigned int> head;	// next slot to write, producer
+	alignas(64) std::atomic<unsigned int> tail;	// next slot to read, consumer
+
+public:
+
+	SPSC_RING() : head(0), tail(0) {}
+
+	// producer side, false when the ring is full and the item was dropped
+	bool push(const T &item)
+	{
+		const unsigned int h = head.load(std::memory_order_relaxed);
+		if (h - tail.load(std::memory_order_acquire) == (unsigned int)N)
+			return false;
+		items[h & (N - 1)] = item;
+		head.store(h + 1, std::memory_order_release);
+		return true;
+	}
+
+	// consumer side, false when there is nothing queued
+	bool pop(T &item)
+	{
+		const unsigned int t = tail.load(std::memory_order_relaxed);
+		if (t == head.load(std::memory_order_acquire))
+			return false;
+		item = items[t & (N - 1)];
+		tail.store(t + 1, std::memory_order_release);
+		return true;
+	}
+};
+
+#endif //__RING_H_
@@ -0,0 +1,172 @@
+#ifndef __SBUFFER_H_
+#define __SBUFFER_H_
+
+#include <vector>
+
+#include "span.h"
+
+// depth of the screen background, the value the z-buffer is cleared to
+#define SBUFFER_BACKGROUND_Z 0xFFFF
+// the room the spans start with, they grow past it as needed
+#define SBUFFER_SPANS_PER_ROW 256
+
+// a span as it comes out of the edge table, s holds the values at x1
+typedef struct {
+	int x1;
+	span_data s;
+} sbuffer_span;
+
+// a run of pixels [x1, x2) of one row owned by a span, -1 is the background
+typedef struct {
+	int x1, x2;
+	int span;
+} sbuffer_segment;
+
+/*
+* span buffer (S-buffer) for a block of rows: every row is a sorted list
+* of non overlapping segments covering the whole width. inserting a span
+* splits the segments it is nearer than, so once all the spans of a frame
+* are in, every pixel belongs to exactly one span and is shaded once.
+* depth is linear along a span, so against any other span the new one is
+* in front on a prefix or a suffix of the overlap, found analytically
+*/
+class SPAN_BUFFER
+{
+	int width, height, capacity;
+	std::vector<sbuffer_segment> *rows;
+	std::vector<sbuffer_segment> scratch;
+
+	// depth of a span at x, computed like stepping the span would
+	long long depth(const int span, const int x) const
+	{
+		if (span < 0) return SBUFFER_BACKGROUND_Z;
+		const sbuffer_span &p = spans[span];
+		return StepFixed(p.s.z, p.s.dz, x - p.x1);
+	}
+
+	long long slope(const int span) const
+	{
+		return span < 0 ? 0 : spans[span].s.dz;
+	}
+
+	// add a segment, merging it with the previous one when possible
+	void append(std::vector<sbuffer_segment> &out, const int x1, const int x2, const int span)
+	{
+		if (x1 >= x2) return;
+		if (!out.empty() && out.back().span == span && out.back().x2 == x1)
+		{
+			out.back().x2 = x2;
+			return;
+		}
+		sbuffer_segment seg = { x1, x2, span };
+		out.push_back(seg);
+	}
+
+	/*
+	* the part [from, to) of [lo, hi) where the new span is strictly nearer
+	* than the old one, ties stay with the old span like with a z-buffer
+	*/
+	void nearer(const int span, const int old, const int lo, const int hi, int &from, int &to) const
+	{
+		const long long d0 = depth(span, lo) - depth(old, lo),
+			dd = slope(span) - slope(old);
+		from = to = lo;
+		if (dd == 0)
+		{
+			if (d0 < 0) to = hi;
+		}
+		else if (dd > 0)
+		{
+			// nearer up to the crossing point
+			if (d0 < 0)
+			{
+				long long n = (-d0 + dd - 1) / dd;
+				to = n < hi - lo ? lo + (int)n : hi;
+			}
+		}
+		else
+		{
+			// nearer from the crossing point on
+			long long n = d0 < 0 ? 0 : d0 / -dd + 1;
+			if (n < hi - lo)
+			{
+				from = lo + (int)n;
+				to = hi;
+			}
+		}
+	}
+
+public:
+
+	std::vector<sbuffer_span> spans;
+
+	SPAN_BUFFER() : width(0), height(0), capacity(0), rows(NULL) {}
+	~SPAN_BUFFER() { delete[] rows; }
+
+	/*
+	* the rows only go when more are needed, so a smaller size (the
+	* dynamic resolution) reuses them and everything they have grown to.
+	* a segment is a pixel at least, so a row with room for one per pixel
+	* never grows
+	*/
+	void init(const int w, const int h)
+	{
+		width = w;
+		height = h;
+		if (h > capacity)
+		{
+			delete[] rows;
+			capacity = h;
+			rows = new std::vector<sbuffer_segment>[h];
+			for (int i = 0; i < h; i++)
+				rows[i].reserve(w);
+			scratch.reserve(w);
+			spans.reserve((size_t)h * SBUFFER_SPANS_PER_ROW);
+		}
+		clear();
+	}
+
+	// every row back to a single background segment
+	void clear()
+	{
+		spans.clear();
+		sbuffer_segment background = { 0, width, -1 };
+		for (int i = 0; i < height; i++)
+		{
+			rows[i].clear();
+			rows[i].push_back(background);
+		}
+	}
+
+	const std::vector<sbuffer_segment> &segments(const int row) const { return rows[row]; }
+
+	// insert the span [x1, x2) of a row, already clipped to the width
+	void insert(const int row, const int x1, const int x2, const span_data &s)
+	{
+		const int id = (int)spans.size();
+		sbuffer_span p = { x1, s };
+		spans.push_back(p);
+
+		std::vector<sbuffer_segment> &segs = rows[row];
+		scratch.clear();
+		for (size_t i = 0; i < segs.size(); i++)
+		{
+			const sbuffer_segment seg = segs[i];
+			if (seg.x2 <= x1 || seg.x1 >= x2)
+			{
+				append(scratch, seg.x1, seg.x2, seg.span);
+				continue;
+			}
+			const int lo = seg.x1 > x1 ? seg.x1 : x1,
+				hi = seg.x2 < x2 ? seg.x2 : x2;
+			int from, to;
+			nearer(id, seg.span, lo, hi, from, to);
+			append(scratch, seg.x1, from, seg.span);
+			append(scratch, from, to, id);
+			append(scratch, to, seg.x2, seg.span);
+		}
+		segs.swap(scratch);
+	}
+};
+
+#endif //__SBUFFER_H_
@@ -0,0 +1,367 @@
+#ifndef __SPAN_H_
+#define __SPAN_H_
+
+#include <SDL.h>
+
+#include "texture.h"
+#include "profile.h"
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// start values of one span and their per pixel increments, all of them
+// in the same fixed point formats as the edge table
+typedef struct {
+	int z, dz;
+	int tx, dtx, ty, dty;
+	int px, dpx, py, dpy;
+} span_data;
+
+// how the pixels of a span are coloured: texture plus the light map, one of
+// them alone, one colour for everything, or the depth in grey
+#define SHADE_TEXTURE_LIGHT 0
+#define SHADE_TEXTURE 1
+#define SHADE_LIGHT 2
+#define SHADE_FLAT 3
+#define SHADE_DEPTH 4
+#define SHADE_MODES 5
+
+// what the shading needs besides the span and the texture level
+typedef struct {
+	const unsigned char *light;	// 256x256 plus 3 bytes of padding
+	Uint32 colour;			// of the flat shading
+	int depthNear, depthShift;	// the depth shading is 255 - (z - near) >> shift
+} shade_setup;
+
+/*
+* value + n * delta, wrapping exactly like n successive additions would,
+* so clipped edges and spans land on the same values as walking them
+*/
+inline int StepFixed(const int value, const int delta, const int n)
+{
+	return (int)((unsigned int)value + (unsigned int)n * (unsigned int)delta);
+}
+
+// advance the interpolated values of a span by n pixels
+inline void SkipSpan(span_data &s, const int n)
+{
+	s.z  = StepFixed(s.z, s.dz, n);
+	s.tx = StepFixed(s.tx, s.dtx, n);
+	s.ty = StepFixed(s.ty, s.dty, n);
+	s.px = StepFixed(s.px, s.dpx, n);
+	s.py = StepFixed(s.py, s.dpy, n);
+}
+
+/*
+* the colour of one pixel, the scalar reference for the vector paths below.
+* SHADE is a constant, so each instantiation keeps only its own mode
+*/
+template <int SHADE>
+inline Uint32 ShadePixel(const texture_level &tex, const shade_setup &shade, const span_data &s)
+{
+	if (SHADE == SHADE_FLAT)
+		return shade.colour;
+	if (SHADE == SHADE_DEPTH)
+	{
+		int g = (s.z - shade.depthNear) >> shade.depthShift;
+		g = g < 0 ? 0 : g > 255 ? 255 : g;
+		return 0xFF000000 | (255 - g) * 0x00010101u;
+	}
+	const Uint32 texel = SHADE == SHADE_LIGHT ? 0 : tex.texels[TexelIndex(tex, s.tx, s.ty)];
+	const unsigned int l = SHADE == SHADE_TEXTURE ? 0 :
+		shade.light[((s.py >> 8) & 0xff00) + ((s.px >> 16) & 0xff)];
+	// saturated add of the lumel to each channel
+	unsigned int r = ((texel >> 16) & 0xff) + l,
+		g = ((texel >> 8) & 0xff) + l,
+		b = (texel & 0xff) + l;
+	if (r > 255) r = 255;
+	if (g > 255) g = 255;
+	if (b > 255) b = 255;
+	return 0xFF000000 | (r << 16) | (g << 8) | b;
+}
+
+/*
+* one pixel with the z policy: ZTEST draws it only in front of the
+* z-buffer, ZWRITE stores its depth. without either the pixel is always
+* drawn and zb is not touched (visibility was already resolved, see the
+* span buffer)
+*/
+template <int SHADE, bool ZTEST, bool ZWRITE>
+inline void DrawSpanPixel(Uint32 *dst, unsigned short *zb,
+	const texture_level &tex, const shade_setup &shade, const span_data &s)
+{
+	if (!ZTEST || s.z < *zb)
+	{
+		*dst = ShadePixel<SHADE>(tex, shade, s);
+		if (ZWRITE)
+			*zb = (unsigned short)s.z;
+	}
+}
+
+inline void StepSpan(span_data &s)
+{
+	s.z += s.dz;
+	s.tx += s.dtx;
+	s.ty += s.dty;
+	s.px += s.dpx;
+	s.py += s.dpy;
+}
+
+#if defined(__SSE2__)
+/*
+* keep the low 16 bits of each 32 bit lane and pack them, like the
+* (unsigned short) cast of the scalar path (SSE2 only has a saturating pack)
+*/
+inline __m128i PackLow16(__m128i a, __m128i b)
+{
+	a = _mm_srai_epi32(_mm_slli_epi32(a, 16), 16);
+	b = _mm_srai_epi32(_mm_slli_epi32(b, 16), 16);
+	return _mm_packs_epi32(a, b);
+}
+#endif
+
+/*
+* largest value of a w x h block of the z-buffer
+*/
+inline unsigned short MaxDepth(const unsigned short *zb, const int pitch, const int w, const int h)
+{
+	int y = 0;
+	unsigned short maxZ = 0;
+#if defined(__SSE2__)
+	// full 8 wide rows, SSE2 only has a signed 16 bit max so flip the top bit
+	if (w == 8)
+	{
+		const __m128i bias = _mm_set1_epi16((short)0x8000);
+		__m128i m = _mm_set1_epi16((short)0x8000);
+		for (; y < h; y++)
+			m = _mm_max_epi16(m, _mm_xor_si128(_mm_loadu_si128((const __m128i *)(zb + y * pitch)), bias));
+		m = _mm_max_epi16(m, _mm_srli_si128(m, 8));
+		m = _mm_max_epi16(m, _mm_srli_si128(m, 4));
+		m = _mm_max_epi16(m, _mm_srli_si128(m, 2));
+		return (unsigned short)(_mm_cvtsi128_si32(m) ^ 0x8000);
+	}
+#endif
+	for (; y < h; y++)
+		for (int x = 0; x < w; x++)
+			if (zb[y * pitch + x] > maxZ) maxZ = zb[y * pitch + x];
+	return maxZ;
+}
+
+#if defined(__AVX2__)
+// ShadePixel for 8 pixels at once
+template <int SHADE>
+inline __m256i ShadeLanes(const texture_level &tex, const shade_setup &shade,
+	const __m256i z, const __m256i tx, const __m256i ty, const __m256i px, const __m256i py)
+{
+	const __m256i byteMask = _mm256_set1_epi32(0xff);
+	const __m256i splat = _mm256_set1_epi32(0x00010101);
+	const __m256i alpha = _mm256_set1_epi32((int)0xFF000000);
+	if (SHADE == SHADE_FLAT)
+		return _mm256_set1_epi32((int)shade.colour);
+	if (SHADE == SHADE_DEPTH)
+	{
+		__m256i g = _mm256_sra_epi32(_mm256_sub_epi32(z, _mm256_set1_epi32(shade.depthNear)),
+			_mm_cvtsi32_si128(shade.depthShift));
+		g = _mm256_min_epi32(_mm256_max_epi32(g, _mm256_setzero_si256()), byteMask);
+		return _mm256_or_si256(_mm256_mullo_epi32(_mm256_sub_epi32(byteMask, g), splat), alpha);
+	}
+	__m256i texel = _mm256_setzero_si256(), lumel = _mm256_setzero_si256();
+	if (SHADE != SHADE_LIGHT)
+	{
+		// TexelIndex, 8 at a time
+		const __m128i texShift = _mm_cvtsi32_si128(tex.shift), rowShift = _mm_cvtsi32_si128(tex.bits);
+		const __m256i texMask = _mm256_set1_epi32(tex.mask);
+		const __m256i tileMask = _mm256_set1_epi32(~3), inTileMask = _mm256_set1_epi32(3);
+		const __m256i u = _mm256_and_si256(_mm256_sra_epi32(tx, texShift), texMask),
+			v = _mm256_and_si256(_mm256_sra_epi32(ty, texShift), texMask);
+		const __m256i tindex = _mm256_or_si256(
+			_mm256_or_si256(_mm256_sll_epi32(_mm256_and_si256(v, tileMask), rowShift),
+				_mm256_slli_epi32(_mm256_and_si256(u, tileMask), 2)),
+			_mm256_or_si256(_mm256_slli_epi32(_mm256_and_si256(v, inTileMask), 2),
+				_mm256_and_si256(u, inTileMask)));
+		texel = _mm256_i32gather_epi32((const int *)tex.texels, tindex, 4);
+	}
+	if (SHADE != SHADE_TEXTURE)
+	{
+		const __m256i rowMask = _mm256_set1_epi32(0xff00);
+		const __m256i lindex = _mm256_add_epi32(
+			_mm256_and_si256(_mm256_srai_epi32(py, 8), rowMask),
+			_mm256_and_si256(_mm256_srai_epi32(px, 16), byteMask));
+		lumel = _mm256_mullo_epi32(_mm256_and_si256(
+			_mm256_i32gather_epi32((const int *)shade.light, lindex, 1), byteMask), splat);
+	}
+	return _mm256_or_si256(_mm256_adds_epu8(texel, lumel), alpha);
+}
+#elif defined(__SSE2__)
+// ShadePixel for the 4 pixels from s on, z holds their depths
+template <int SHADE>
+inline __m128i ShadeLanes(const texture_level &tex, const shade_setup &shade, const __m128i z, span_data s)
+{
+	const __m128i alpha = _mm_set1_epi32((int)0xFF000000);
+	if (SHADE == SHADE_FLAT)
+		return _mm_set1_epi32((int)shade.colour);
+	if (SHADE == SHADE_DEPTH)
+	{
+		// the saturating packs clamp to 0..255, ~g is 255 - g in a byte
+		__m128i g = _mm_sra_epi32(_mm_sub_epi32(z, _mm_set1_epi32(shade.depthNear)), _mm_cvtsi32_si128(shade.depthShift));
+		g = _mm_packus_epi16(_mm_packs_epi32(g, g), _mm_setzero_si128());
+		g = _mm_unpacklo_epi8(g, g);
+		g = _mm_unpacklo_epi16(g, g);
+		return _mm_or_si128(_mm_xor_si128(g, _mm_set1_epi32(-1)), alpha);
+	}
+	// no gather in SSE2, fetch the four texels and lumels one by one
+	Uint32 t[4] = {}, l[4] = {};
+	for (int k = 0; k < 4; k++)
+	{
+		if (SHADE != SHADE_LIGHT)
+			t[k] = tex.texels[TexelIndex(tex, s.tx, s.ty)];
+		if (SHADE != SHADE_TEXTURE)
+			l[k] = shade.light[((s.py >> 8) & 0xff00) + ((s.px >> 16) & 0xff)] * 0x00010101u;
+		StepSpan(s);
+	}
+	const __m128i texel = _mm_loadu_si128((const __m128i *)t);
+	const __m128i lumel = _mm_loadu_si128((const __m128i *)l);
+	return _mm_or_si128(_mm_adds_epu8(texel, lumel), alpha);
+}
+#endif
+
+/*
+* draw count pixels of a span: shade them, z test / z write them as the
+* policy says. dst and zb point to the first pixel, the span must already
+* be clipped. every combination is its own function, nothing is decided
+* per pixel
+*/
+template <int SHADE, bool ZTEST, bool ZWRITE>
+inline void DrawSpanPixels(Uint32 *dst, unsigned short *zb, int count,
+	const texture_level &tex, const shade_setup &shade, span_data s)
+{
+	int i = 0;
+	// without the z test every pixel is written, with it only the lanes
+	// that pass are counted (profile builds only)
+	if (!ZTEST)
+		PROFILE_COUNT(PROFILE_PIXELS_WRITTEN, count);
+#if defined(__AVX2__)
+	const __m256i lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+	__m256i z = _mm256_add_epi32(_mm256_set1_epi32(s.z), _mm256_mullo_epi32(lanes, _mm256_set1_epi32(s.dz))),
+		tx = _mm256_add_epi32(_mm256_set1_epi32(s.tx), _mm256_mullo_epi32(lanes, _mm256_set1_epi32(s.dtx))),
+		ty = _mm256_add_epi32(_mm256_set1_epi32(s.ty), _mm256_mullo_epi32(lanes, _mm256_set1_epi32(s.dty))),
+		px = _mm256_add_epi32(_mm256_set1_epi32(s.px), _mm256_mullo_epi32(lanes, _mm256_set1_epi32(s.dpx))),
+		py = _mm256_add_epi32(_mm256_set1_epi32(s.py), _mm256_mullo_epi32(lanes, _mm256_set1_epi32(s.dpy)));
+	const __m256i dz = _mm256_set1_epi32(s.dz * 8),
+		dtx = _mm256_set1_epi32(s.dtx * 8),
+		dty = _mm256_set1_epi32(s.dty * 8),
+		dpx = _mm256_set1_epi32(s.dpx * 8),
+		dpy = _mm256_set1_epi32(s.dpy * 8);
+
+	for (; i + 8 <= count; i += 8)
+	{
+		__m256i zold = _mm256_setzero_si256(), visible = _mm256_set1_epi32(-1);
+		if (ZTEST || ZWRITE)
+			zold = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)(zb + i)));
+		if (ZTEST)
+		{
+			visible = _mm256_cmpgt_epi32(zold, z);
+			PROFILE_COUNT(PROFILE_PIXELS_WRITTEN, ProfileBits(_mm256_movemask_ps(_mm256_castsi256_ps(visible))));
+		}
+		if (!ZTEST || _mm256_movemask_epi8(visible))
+		{
+			const __m256i colour = ShadeLanes<SHADE>(tex, shade, z, tx, ty, px, py);
+			if (ZTEST)
+			{
+				__m256i old = _mm256_loadu_si256((const __m256i *)(dst + i));
+				_mm256_storeu_si256((__m256i *)(dst + i), _mm256_blendv_epi8(old, colour, visible));
+			}
+			else
+				_mm256_storeu_si256((__m256i *)(dst + i), colour);
+			if (ZWRITE)
+			{
+				__m256i znew = _mm256_blendv_epi8(zold, z, visible);
+				_mm_storeu_si128((__m128i *)(zb + i),
+					PackLow16(_mm256_castsi256_si128(znew), _mm256_extracti128_si256(znew, 1)));
+			}
+		}
+
+		z = _mm256_add_epi32(z, dz);
+		tx = _mm256_add_epi32(tx, dtx);
+		ty = _mm256_add_epi32(ty, dty);
+		px = _mm256_add_epi32(px, dpx);
+		py = _mm256_add_epi32(py, dpy);
+	}
+	if (i)
+		SkipSpan(s, i);
+#elif defined(__SSE2__)
+	const __m128i zero = _mm_setzero_si128();
+	// SSE2 has no 32 bit multiply, so build the first 4 lanes by adding
+	__m128i z = _mm_setr_epi32(s.z, s.z + s.dz, s.z + 2 * s.dz, s.z + 3 * s.dz);
+	const __m128i dz = _mm_set1_epi32(s.dz * 4);
+
+	for (; i + 4 <= count; i += 4)
+	{
+		__m128i zold = zero, visible = _mm_set1_epi32(-1);
+		if (ZTEST || ZWRITE)
+			zold = _mm_unpacklo_epi16(_mm_loadl_epi64((const __m128i *)(zb + i)), zero);
+		if (ZTEST)
+		{
+			visible = _mm_cmplt_epi32(z, zold);
+			PROFILE_COUNT(PROFILE_PIXELS_WRITTEN, ProfileBits(_mm_movemask_ps(_mm_castsi128_ps(visible))));
+		}
+		if (!ZTEST || _mm_movemask_epi8(visible))
+		{
+			const __m128i colour = ShadeLanes<SHADE>(tex, shade, z, s);
+			if (ZTEST)
+			{
+				__m128i old = _mm_loadu_si128((const __m128i *)(dst + i));
+				_mm_storeu_si128((__m128i *)(dst + i),
+					_mm_or_si128(_mm_and_si128(visible, colour), _mm_andnot_si128(visible, old)));
+			}
+			else
+				_mm_storeu_si128((__m128i *)(dst + i), colour);
+			if (ZWRITE)
+			{
+				__m128i znew = _mm_or_si128(_mm_and_si128(visible, z), _mm_andnot_si128(visible, zold));
+				_mm_storel_epi64((__m128i *)(zb + i), PackLow16(znew, znew));
+			}
+		}
+		z = _mm_add_epi32(z, dz);
+		SkipSpan(s, 4);
+	}
+#endif
+	// what's left, or everything when there is no vector unit
+	for (; i < count; i++)
+	{
+		if (ZTEST)
+			PROFILE_COUNT(PROFILE_PIXELS_WRITTEN, s.z < zb[i]);
+		DrawSpanPixel<SHADE, ZTEST, ZWRITE>(dst + i, zb + i, tex, shade, s);
+		StepSpan(s);
+	}
+}
+
+typedef void (*span_function)(Uint32 *dst, unsigned short *zb, int count,
+	const texture_level &tex, const shade_setup &shade, span_data s);
+
+template <int SHADE>
+inline span_function SpanFunction(const bool zbuffer)
+{
+	return zbuffer ? DrawSpanPixels<SHADE, true, true> : DrawSpanPixels<SHADE, false, false>;
+}
+
+/*
+* the span routine for a shading mode, with the z-buffer or for spans that
+* are already visible. picked once per frame, the spans call it directly
+*/
+inline span_function SpanFunction(const int shadeMode, const bool zbuffer)
+{
+	switch (shadeMode)
+	{
+	case SHADE_TEXTURE: return SpanFunction<SHADE_TEXTURE>(zbuffer);
+	case SHADE_LIGHT: return SpanFunction<SHADE_LIGHT>(zbuffer);
+	case SHADE_FLAT: return SpanFunction<SHADE_FLAT>(zbuffer);
+	case SHADE_DEPTH: return SpanFunction<SHADE_DEPTH>(zbuffer);
+	default: return SpanFunction<SHADE_TEXTURE_LIGHT>(zbuffer);
+	}
+}
+
+#endif //__SPAN_H_
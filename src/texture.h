@@ -0,0 +1,165 @@
+#ifndef __TEXTURE_H_
+#define __TEXTURE_H_
+
+#include <SDL.h>
+#include <algorithm>
+#include <cstdlib>
+
+// the texture coordinates are 16.16 fixed point with TEXTURE_SIZE units to
+// a repeat of the texture, whatever its size. images are sampled as the
+// power of two at least as large, up to TEXTURE_MAX_BITS, and repeat to
+// fill it like the smaller ones always did
+#define TEXTURE_SIZE 256
+#define TEXTURE_BITS 8
+#define TEXTURE_MAX_BITS 12
+// the last mip level is a single 4x4 tile
+#define TEXTURE_MIN_BITS 2
+#define TEXTURE_LEVELS (TEXTURE_MAX_BITS - TEXTURE_MIN_BITS + 1)
+
+// one level of the mip chain, stored in 4x4 tiles of 64 bytes (a cache
+// line) in rows, each tile row major
+typedef struct {
+	const Uint32 *texels;
+	int bits;	// log2 of the size
+	int shift;	// the coordinates shifted right by this are texels
+	int mask;	// size - 1
+} texture_level;
+
+/*
+* where the texel at coordinates tx, ty is. a span that walks down the
+* texture stays in the same tile for 4 texels instead of using a line for
+* each, which is what the rows cost when the torus turns sideways
+*/
+inline int TexelIndex(const texture_level &t, const int tx, const int ty)
+{
+	const int u = (tx >> t.shift) & t.mask, v = (ty >> t.shift) & t.mask;
+	return ((v & ~3) << t.bits) | ((u & ~3) << 2) | ((v & 3) << 2) | (u & 3);
+}
+
+/*
+* the texture in tiles with its mip chain, every level a box filtered half
+* of the one before. a span takes the largest level where a pixel step
+* moves less than two texels, so the far and small parts of the torus read
+* a few tiles of a small level instead of skipping over the whole texture
+*/
+class MIP_TEXTURE
+{
+	Uint32 *storage;
+	texture_level levels[TEXTURE_LEVELS];
+	int count;
+	bool mipmapped;
+
+	static void Tile(Uint32 *tiled, const Uint32 *linear, const int bits)
+	{
+		texture_level t = { tiled, bits, 0, (1 << bits) - 1 };
+		for (int v = 0; v < 1 << bits; v++)
+			for (int u = 0; u < 1 << bits; u++)
+				tiled[TexelIndex(t, u, v)] = linear[(v << bits) + u];
+	}
+
+public:
+
+	MIP_TEXTURE() : storage(NULL), count(0), mipmapped(true) {}
+	~MIP_TEXTURE() { delete[] storage; }
+
+	// without mip mapping every span reads the full size level
+	void setMipmapped(const bool on) { mipmapped = on; }
+
+	int size() const { return count ? 1 << levels[0].bits : 0; }
+
+	// the colour of the whole texture, from the last level
+	Uint32 average() const
+	{
+		if (!count)
+			return 0;
+		const texture_level &t = levels[count - 1];
+		const int n = 1 << (2 * t.bits);
+		Uint32 out = 0;
+		for (int shift = 0; shift < 32; shift += 8)
+		{
+			unsigned int sum = n / 2;
+			for (int i = 0; i < n; i++)
+				sum += (t.texels[i] >> shift) & 0xff;
+			out |= (sum / n) << shift;
+		}
+		return out;
+	}
+
+	// from an ARGB8888 surface
+	void load(const SDL_Surface *image)
+	{
+		int bits = TEXTURE_MIN_BITS;
+		while (bits < TEXTURE_MAX_BITS && (1 << bits) < std::max(image->w, image->h))
+			bits++;
+		const int size = 1 << bits;
+
+		size_t total = 0;
+		for (int b = bits; b >= TEXTURE_MIN_BITS; b--)
+			total += (size_t)1 << (2 * b);
+		delete[] storage;
+		storage = new Uint32[total];
+
+		// the levels are built row major and tiled once they are done
+		Uint32 *linear = new Uint32[size * size], *half = new Uint32[size * size / 4];
+		for (int j = 0; j < size; j++)
+		{
+			const Uint32 *row = (const Uint32 *)((const Uint8 *)image->pixels + (j % image->h) * image->pitch);
+			for (int i = 0; i < size; i++)
+				linear[j * size + i] = row[i % image->w];
+		}
+
+		Uint32 *tiled = storage;
+		count = 0;
+		for (int b = bits; b >= TEXTURE_MIN_BITS; b--)
+		{
+			Tile(tiled, linear, b);
+			texture_level &t = levels[count++];
+			t.texels = tiled;
+			t.bits = b;
+			t.shift = 16 + TEXTURE_BITS - b;
+			t.mask = (1 << b) - 1;
+			tiled += (size_t)1 << (2 * b);
+			if (b == TEXTURE_MIN_BITS)
+				break;
+
+			// average each 2x2 block, rounded, channel by channel
+			const int s = 1 << b, h = s / 2;
+			for (int j = 0; j < h; j++)
+				for (int i = 0; i < h; i++)
+				{
+					const Uint32 *p = linear + 2 * j * s + 2 * i;
+					const Uint32 c[4] = { p[0], p[1], p[s], p[s + 1] };
+					Uint32 out = 0;
+					for (int shift = 0; shift < 32; shift += 8)
+					{
+						unsigned int sum = 2;
+						for (int k = 0; k < 4; k++)
+							sum += (c[k] >> shift) & 0xff;
+						out |= (sum / 4) << shift;
+					}
+					half[j * h + i] = out;
+				}
+			std::swap(linear, half);
+		}
+		delete[] linear;
+		delete[] half;
+	}
+
+	// the level for a span stepping dtx, dty per pixel
+	const texture_level &select(const int dtx, const int dty) const
+	{
+		if (!mipmapped)
+			return levels[0];
+		// texels of the full size level per pixel, 16.16
+		Uint64 step = (Uint64)std::max(std::abs(dtx), std::abs(dty)) << levels[0].bits >> TEXTURE_BITS;
+		int level = 0;
+		while (step >= 2 << 16 && level < count - 1)
+		{
+			step >>= 1;
+			level++;
+		}
+		return levels[level];
+	}
+};
+
+#endif //__TEXTURE_H_
@@ -0,0 +1,190 @@
+#ifndef __TIMELINE_H_
+#define __TIMELINE_H_
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include "vector.h"
+#include "random.h"
+
+// the choreography: the torus pulses for the first beats and starts to
+// spin a while before the end of that, then every beat sends it tumbling
+// in a random direction and pulses its scale
+#define INTRO_BEATS 20
+#define SPIN_BEAT 12
+
+#define BASE_ANGULAR_VELOCITY 0.01f
+#define ANGULAR_VELOCITY_DECAY 0.91f
+#define CONSTANT_ANGULAR_VELOCITY 0.001f
+
+#define BASE_BULK_MODIFIER 0
+#define BULK_CHANGE_SPEED 0.05f
+#define BULK_SPEED_DECAY 0.95f
+
+#define BASE_SCALE 1.0f
+#define SCALE_CHANGE_SPEED 0.005f
+#define SCALE_CHANGE_DECAY 0.91f
+
+// a detected tempo plays the moves out faster or slower by at most this
+#define TEMPO_PACE_MIN 0.5f
+#define TEMPO_PACE_MAX 2.0f
+
+// room for an hour at 136 BPM before the beats allocate again
+#define TIMELINE_RESERVE 8192
+
+// the decays above are per frame of this length, they were applied once
+// per frame at 60 FPS
+#define DECAY_FRAME_MS (1000.0 / 60)
+
+typedef struct {
+	float angleX, angleY, angleZ;
+	float scale, bulk;
+} torus_pose;
+
+/*
+* the pose of the torus as a function of the music time. every speed set
+* on a beat decays exponentially, so what it adds up to since the beat has
+* a closed form. the beats keep the rotation they start at, summed over
+* the beats before, so a pose anywhere in the song is one lookup and a few
+* exponentials, the same at any frame rate. the random direction of each
+* beat comes from the seed and the beat's index alone. evaluate() doesn't
+* change anything, so any number of frames can be evaluated at once
+*/
+class TIMELINE
+{
+	typedef struct {
+		double time;		// ms
+		float strength;		// scales the rotation of the beat
+		float pulse;		// scales its pulse of the scale or bulk
+		float pace;			// how fast its moves decay, 1 at the fixed tempo
+		VECTOR velocity;	// the angular velocity it starts with
+		double angle[3];	// the rotation when it starts
+	} timeline_beat;
+
+	std::vector<timeline_beat> beats;
+	unsigned int seed;
+	// ms per beat with a fixed tempo, 0 when the beats are added as detected
+	double period;
+
+	// what a speed decaying by decay per frame adds up to over ms
+	static double Decayed(const double decay, const double ms)
+	{
+		const double rate = -std::log(decay) / DECAY_FRAME_MS;
+		return (1 - std::exp(-rate * ms)) / rate;
+	}
+
+	// the rotation of beat index after ms of it
+	void Rotate(const int index, const double ms, double angle[3]) const
+	{
+		const timeline_beat &b = beats[index];
+		if (index >= INTRO_BEATS)
+		{
+			const double d = Decayed(ANGULAR_VELOCITY_DECAY, ms * b.pace);
+			for (int i = 0; i < 3; i++)
+				angle[i] = b.angle[i] + b.velocity[i] * d;
+		}
+		else
+		{
+			for (int i = 0; i < 3; i++)
+				angle[i] = b.angle[i];
+			if (index >= SPIN_BEAT)
+				angle[2] += CONSTANT_ANGULAR_VELOCITY * ms;
+		}
+	}
+
+	// the beat playing at time, -1 before the first
+	int Find(const double time) const
+	{
+		if (beats.empty() || time < beats[0].time)
+			return -1;
+		if (period > 0)
+			return std::min((int)(time / period), (int)beats.size() - 1);
+		int lo = 0, hi = (int)beats.size() - 1;
+		while (lo < hi)
+		{
+			const int mid = (lo + hi + 1) / 2;
+			if (beats[mid].time <= time)
+				lo = mid;
+			else
+				hi = mid - 1;
+		}
+		return lo;
+	}
+
+public:
+
+	TIMELINE() : seed(1), period(0) {}
+
+	// beatPeriod is the ms per beat of a fixed tempo, 0 for detected beats
+	void start(const unsigned int randomSeed, const double beatPeriod)
+	{
+		seed = randomSeed;
+		period = beatPeriod;
+		beats.clear();
+		// adding the beats as they come doesn't allocate for a long while
+		beats.reserve(TIMELINE_RESERVE);
+	}
+
+	// pace > 1 plays the moves of the beat out faster, over the same
+	// distance, for a faster tempo
+	void addBeat(const double time, const float strength, const float pulse = 1, const float pace = 1)
+	{
+		timeline_beat b;
+		const int index = (int)beats.size();
+		b.time = time;
+		b.strength = strength;
+		b.pulse = pulse;
+		b.pace = std::min(std::max(pace, TEMPO_PACE_MIN), TEMPO_PACE_MAX);
+		RANDOM random(MixSeed(seed, index));
+		b.velocity[0] = (float)random(10);
+		b.velocity[1] = (float)random(10);
+		b.velocity[2] = (float)random(10);
+		b.velocity.setMagnitude(BASE_ANGULAR_VELOCITY * strength);
+		if (index)
+			Rotate(index - 1, time - beats[index - 1].time, b.angle);
+		else
+		{
+			b.angle[0] = M_PI_2;
+			b.angle[1] = b.angle[2] = 0;
+		}
+		beats.push_back(b);
+	}
+
+	// with a fixed tempo, add the beats up to time
+	void extendTo(const double time)
+	{
+		if (period > 0)
+			while (beats.empty() || beats.back().time <= time)
+				addBeat(beats.size() * period, 1);
+	}
+
+	int beatCount() const { return (int)beats.size(); }
+
+	torus_pose evaluate(const double time) const
+	{
+		torus_pose pose = { (float)M_PI_2, 0, 0, BASE_SCALE, BASE_BULK_MODIFIER };
+		const int index = Find(time);
+		if (index < 0)
+			return pose;
+		const timeline_beat &b = beats[index];
+		const double ms = time - b.time;
+		double angle[3];
+		Rotate(index, ms, angle);
+		pose.angleX = (float)angle[0];
+		pose.angleY = (float)angle[1];
+		pose.angleZ = (float)angle[2];
+		if (index < INTRO_BEATS)
+			pose.bulk = (float)(BASE_BULK_MODIFIER + BULK_CHANGE_SPEED * b.pulse * Decayed(BULK_SPEED_DECAY, ms * b.pace));
+		else
+		{
+			// growing on the even beats, shrinking on the odd ones
+			const double pulse = SCALE_CHANGE_SPEED * b.pulse * Decayed(SCALE_CHANGE_DECAY, ms * b.pace);
+			pose.scale = (float)(BASE_SCALE + (index % 2 ? -pulse : pulse));
+			pose.bulk = 0;
+		}
+		return pose;
+	}
+};
+
+#endif //__TIMELINE_H_
@@ -0,0 +1,223 @@
+#ifndef __TRANSFORM_H_
+#define __TRANSFORM_H_
+
+#include <cstdlib>
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "vector.h"
+#include "matrix.h"
+#include "arena.h"
+
+// streams are aligned to a cache line and padded to a multiple of the
+// widest vector, so the kernel has no tail to take care of
+#define STREAM_ALIGN ARENA_ALIGN
+#define STREAM_PAD 8
+
+// vertices nearer to the camera than this are not projected properly (the
+// divide is clamped so nothing blows up), the quads that use them must be
+// clipped against the plane z = NEAR_Z instead, see clip.h
+#define NEAR_Z 1.0f
+
+// structure of arrays: one stream per component of position and normal
+typedef struct {
+	float *x, *y, *z;
+	float *nx, *ny, *nz;
+	// real vertices, and the padded length of every stream
+	int count, padded;
+} vertex_streams;
+
+// all six streams live in one aligned block, x points at its start. a
+// block from an arena goes with the arena, FreeStreams is for the others
+inline void AllocStreams(vertex_streams &s, const int count, ARENA *arena = NULL)
+{
+	s.count = count;
+	s.padded = (count + STREAM_PAD - 1) / STREAM_PAD * STREAM_PAD;
+	const size_t bytes = 6 * (size_t)s.padded * sizeof(float);
+	float *block = (float *)(arena ? arena->alloc(bytes) : AlignedAlloc(bytes));
+	s.x = block;
+	s.y = s.x + s.padded;
+	s.z = s.y + s.padded;
+	s.nx = s.z + s.padded;
+	s.ny = s.nx + s.padded;
+	s.nz = s.ny + s.padded;
+}
+
+inline void FreeStreams(vertex_streams &s)
+{
+	AlignedFree(s.x);
+	s.x = s.y = s.z = s.nx = s.ny = s.nz = NULL;
+	s.count = s.padded = 0;
+}
+
+// fill the padding with copies of the first vertex, so it transforms
+// to something harmless
+inline void PadStreams(vertex_streams &s)
+{
+	for (int i = s.count; i < s.padded; i++)
+	{
+		s.x[i] = s.x[0]; s.y[i] = s.y[0]; s.z[i] = s.z[0];
+		s.nx[i] = s.nx[0]; s.ny[i] = s.ny[0]; s.nz[i] = s.nz[0];
+	}
+}
+
+/*
+* everything the kernel needs for one frame: the object transform (scale
+* and rotation fused, then the translation), and the projection
+*/
+typedef struct {
+	float m[3][3];  // the linear part of the object transform, for positions
+	float r[3][3];  // objrot, for normals
+	float t[3];     // its translation
+	float bulk;     // displacement along the normal, in object space
+	float focal;    // the screen height, our projection has a 90 degree fov
+	float cx, cy;   // centre of the screen
+} transform_setup;
+
+inline transform_setup SetupTransform(const AFFINE &object, const MATRIX &rot,
+	const float bulk, const int width, const int height)
+{
+	transform_setup s;
+	for (int i = 0; i < 3; i++)
+	{
+		for (int j = 0; j < 3; j++)
+		{
+			s.m[i][j] = object.linear[i][j];
+			s.r[i][j] = rot[i][j];
+		}
+		s.t[i] = object.translation[i];
+	}
+	s.bulk = bulk;
+	s.focal = (float)height;
+	s.cx = (float)(width / 2);
+	s.cy = (float)(height / 2);
+	return s;
+}
+
+/*
+* displace, scale, rotate, translate and project a run of vertices, and
+* rotate their normals. out gets the screen x and y, the camera space z and
+* the x and y of the normal (the only ones the light map needs). first and
+* last must be multiples of STREAM_PAD
+*/
+inline void TransformStreams(const vertex_streams &in, vertex_streams &out,
+	const transform_setup &s, const int first, const int last)
+{
+	int i = first;
+#if defined(__AVX__)
+	const __m256 m00 = _mm256_set1_ps(s.m[0][0]), m01 = _mm256_set1_ps(s.m[0][1]), m02 = _mm256_set1_ps(s.m[0][2]),
+		m10 = _mm256_set1_ps(s.m[1][0]), m11 = _mm256_set1_ps(s.m[1][1]), m12 = _mm256_set1_ps(s.m[1][2]),
+		m20 = _mm256_set1_ps(s.m[2][0]), m21 = _mm256_set1_ps(s.m[2][1]), m22 = _mm256_set1_ps(s.m[2][2]),
+		r00 = _mm256_set1_ps(s.r[0][0]), r01 = _mm256_set1_ps(s.r[0][1]),
+		r10 = _mm256_set1_ps(s.r[1][0]), r11 = _mm256_set1_ps(s.r[1][1]),
+		r20 = _mm256_set1_ps(s.r[2][0]), r21 = _mm256_set1_ps(s.r[2][1]),
+		tx = _mm256_set1_ps(s.t[0]), ty = _mm256_set1_ps(s.t[1]), tz = _mm256_set1_ps(s.t[2]),
+		bulk = _mm256_set1_ps(s.bulk), focal = _mm256_set1_ps(s.focal),
+		cx = _mm256_set1_ps(s.cx), cy = _mm256_set1_ps(s.cy), nearZ = _mm256_set1_ps(NEAR_Z);
+	for (; i < last; i += 8)
+	{
+		__m256 nx = _mm256_load_ps(in.nx + i), ny = _mm256_load_ps(in.ny + i), nz = _mm256_load_ps(in.nz + i);
+		__m256 x = _mm256_add_ps(_mm256_load_ps(in.x + i), _mm256_mul_ps(nx, bulk)),
+			y = _mm256_add_ps(_mm256_load_ps(in.y + i), _mm256_mul_ps(ny, bulk)),
+			z = _mm256_add_ps(_mm256_load_ps(in.z + i), _mm256_mul_ps(nz, bulk));
+		__m256 wx = _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(x, m00), _mm256_mul_ps(y, m10)), _mm256_mul_ps(z, m20)), tx),
+			wy = _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(x, m01), _mm256_mul_ps(y, m11)), _mm256_mul_ps(z, m21)), ty),
+			wz = _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(x, m02), _mm256_mul_ps(y, m12)), _mm256_mul_ps(z, m22)), tz);
+		__m256 scale = _mm256_div_ps(focal, _mm256_max_ps(wz, nearZ));
+		_mm256_store_ps(out.x + i, _mm256_add_ps(_mm256_mul_ps(wx, scale), cx));
+		_mm256_store_ps(out.y + i, _mm256_add_ps(_mm256_mul_ps(wy, scale), cy));
+		_mm256_store_ps(out.z + i, wz);
+		_mm256_store_ps(out.nx + i, _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(nx, r00), _mm256_mul_ps(ny, r10)), _mm256_mul_ps(nz, r20)));
+		_mm256_store_ps(out.ny + i, _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(nx, r01), _mm256_mul_ps(ny, r11)), _mm256_mul_ps(nz, r21)));
+	}
+#elif defined(__SSE2__)
+	const __m128 m00 = _mm_set1_ps(s.m[0][0]), m01 = _mm_set1_ps(s.m[0][1]), m02 = _mm_set1_ps(s.m[0][2]),
+		m10 = _mm_set1_ps(s.m[1][0]), m11 = _mm_set1_ps(s.m[1][1]), m12 = _mm_set1_ps(s.m[1][2]),
+		m20 = _mm_set1_ps(s.m[2][0]), m21 = _mm_set1_ps(s.m[2][1]), m22 = _mm_set1_ps(s.m[2][2]),
+		r00 = _mm_set1_ps(s.r[0][0]), r01 = _mm_set1_ps(s.r[0][1]),
+		r10 = _mm_set1_ps(s.r[1][0]), r11 = _mm_set1_ps(s.r[1][1]),
+		r20 = _mm_set1_ps(s.r[2][0]), r21 = _mm_set1_ps(s.r[2][1]),
+		tx = _mm_set1_ps(s.t[0]), ty = _mm_set1_ps(s.t[1]), tz = _mm_set1_ps(s.t[2]),
+		bulk = _mm_set1_ps(s.bulk), focal = _mm_set1_ps(s.focal),
+		cx = _mm_set1_ps(s.cx), cy = _mm_set1_ps(s.cy), nearZ = _mm_set1_ps(NEAR_Z);
+	for (; i < last; i += 4)
+	{
+		__m128 nx = _mm_load_ps(in.nx + i), ny = _mm_load_ps(in.ny + i), nz = _mm_load_ps(in.nz + i);
+		__m128 x = _mm_add_ps(_mm_load_ps(in.x + i), _mm_mul_ps(nx, bulk)),
+			y = _mm_add_ps(_mm_load_ps(in.y + i), _mm_mul_ps(ny, bulk)),
+			z = _mm_add_ps(_mm_load_ps(in.z + i), _mm_mul_ps(nz, bulk));
+		__m128 wx = _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(x, m00), _mm_mul_ps(y, m10)), _mm_mul_ps(z, m20)), tx),
+			wy = _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(x, m01), _mm_mul_ps(y, m11)), _mm_mul_ps(z, m21)), ty),
+			wz = _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(x, m02), _mm_mul_ps(y, m12)), _mm_mul_ps(z, m22)), tz);
+		__m128 scale = _mm_div_ps(focal, _mm_max_ps(wz, nearZ));
+		_mm_store_ps(out.x + i, _mm_add_ps(_mm_mul_ps(wx, scale), cx));
+		_mm_store_ps(out.y + i, _mm_add_ps(_mm_mul_ps(wy, scale), cy));
+		_mm_store_ps(out.z + i, wz);
+		_mm_store_ps(out.nx + i, _mm_add_ps(_mm_add_ps(_mm_mul_ps(nx, r00), _mm_mul_ps(ny, r10)), _mm_mul_ps(nz, r20)));
+		_mm_store_ps(out.ny + i, _mm_add_ps(_mm_add_ps(_mm_mul_ps(nx, r01), _mm_mul_ps(ny, r11)), _mm_mul_ps(nz, r21)));
+	}
+#endif
+	// no vector unit, same operations one vertex at a time
+	for (; i < last; i++)
+	{
+		float nx = in.nx[i], ny = in.ny[i], nz = in.nz[i];
+		float x = in.x[i] + nx * s.bulk,
+			y = in.y[i] + ny * s.bulk,
+			z = in.z[i] + nz * s.bulk;
+		float wx = x * s.m[0][0] + y * s.m[1][0] + z * s.m[2][0] + s.t[0],
+			wy = x * s.m[0][1] + y * s.m[1][1] + z * s.m[2][1] + s.t[1],
+			wz = x * s.m[0][2] + y * s.m[1][2] + z * s.m[2][2] + s.t[2];
+		float scale = s.focal / (wz > NEAR_Z ? wz : NEAR_Z);
+		out.x[i] = wx * scale + s.cx;
+		out.y[i] = wy * scale + s.cy;
+		out.z[i] = wz;
+		out.nx[i] = nx * s.r[0][0] + ny * s.r[1][0] + nz * s.r[2][0];
+		out.ny[i] = nx * s.r[0][1] + ny * s.r[1][1] + nz * s.r[2][1];
+	}
+}
+
+/*
+* camera space position of vertex i, the same operations as the kernel
+* above, for the quads that have to be clipped. the results match the
+* kernel only while multiply-adds aren't fused (-ffp-contract=off)
+*/
+inline VECTOR CameraVertex(const vertex_streams &in, const transform_setup &s, const int i)
+{
+	float x = in.x[i] + in.nx[i] * s.bulk,
+		y = in.y[i] + in.ny[i] * s.bulk,
+		z = in.z[i] + in.nz[i] * s.bulk;
+	return VECTOR(x * s.m[0][0] + y * s.m[1][0] + z * s.m[2][0] + s.t[0],
+		x * s.m[0][1] + y * s.m[1][1] + z * s.m[2][1] + s.t[1],
+		x * s.m[0][2] + y * s.m[1][2] + z * s.m[2][2] + s.t[2]);
+}
+
+/*
+* the original one vertex at a time path on arrays of VECTOR, kept as the
+* reference for the benchmark
+*/
+inline void TransformVectors(const VECTOR *orgVertices, const VECTOR *orgNormals,
+	VECTOR *curVertices, VECTOR *curNormals, const int count,
+	const MATRIX &objScale, const MATRIX &objrot, const VECTOR &objpos, const float bulk,
+	const int width, const int height)
+{
+	for (int i = 0; i<count; i++)
+	{
+		VECTOR n = orgNormals[i];
+		curVertices[i] = orgVertices[i] + n * bulk;
+		curVertices[i] = objScale * curVertices[i];
+
+		// perform rotation
+		curNormals[i] = objrot * orgNormals[i];
+		curVertices[i] = objrot * curVertices[i];
+		// now project onto the screen
+		curVertices[i][2] += objpos[2];
+		curVertices[i][0] = height * (curVertices[i][0] + objpos[0]) / curVertices[i][2] + (width / 2);
+		curVertices[i][1] = height * (curVertices[i][1] + objpos[1]) / curVertices[i][2] + (height / 2);
+	}
+}
+
+#endif //__TRANSFORM_H_
@@ -3,52 +3,43 @@
 
 #include <cmath>
 
-class VECTOR
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+/*
+* 3 component vector, stored padded to 4 components (the 4th stays 0) and
+* aligned so the float version loads straight into a SIMD register. all
+* the operators are constexpr, the SIMD versions of the heavy ones are the
+* free functions at the end
+*/
+template <typename T>
+class alignas(4 * sizeof(T)) Vector3
 {
-	float v[3];
+	T v[4];
 
 public:
 
-	      float &operator[](const int i)       { return v[i]; }
-	const float &operator[](const int i) const { return v[i]; }
+	constexpr       T &operator[](const int i)       { return v[i]; }
+	constexpr const T &operator[](const int i) const { return v[i]; }
 
 
-	VECTOR operator+(const VECTOR &a) const
+	constexpr Vector3 operator+(const Vector3 &a) const
         {
-               VECTOR r;
-               r[0] = v[0] + a[0];
-               r[1] = v[1] + a[1];
-               r[2] = v[2] + a[2];
-               return r;
+               return Vector3(v[0] + a[0], v[1] + a[1], v[2] + a[2]);
         }
 
-	VECTOR operator-(const VECTOR &a) const
+	constexpr Vector3 operator-(const Vector3 &a) const
         {
-               VECTOR r;
-               r[0] = v[0] - a[0];
-               r[1] = v[1] - a[1];
-               r[2] = v[2] - a[2];
-               return r;
+               return Vector3(v[0] - a[0], v[1] - a[1], v[2] - a[2]);
         }
 
-	VECTOR &operator=(const VECTOR &a)
-	{
-		v[0] = a[0];
-		v[1] = a[1];
-		v[2] = a[2];
-		return *this;
-	}
-
-    VECTOR operator*(const float a)
+    constexpr Vector3 operator*(const T a) const
     {
-        VECTOR r;
-        r[0] = v[0] * a;
-        r[1] = v[1] * a;
-        r[2] = v[2] * a;
-        return r;
+        return Vector3(v[0] * a, v[1] * a, v[2] * a);
     }
 
-    VECTOR &operator*=(const float a)
+    constexpr Vector3 &operator*=(const T a)
     {
         v[0] *= a;
         v[1] *= a;
@@ -56,48 +47,79 @@ public:
         return *this;
     }
 
-    VECTOR operator/(const float a)
+    constexpr Vector3 operator/(const T a) const
+    {
+        return Vector3(v[0] / a, v[1] / a, v[2] / a);
+    }
+
+    constexpr bool operator==(const Vector3 &a) const
     {
-        VECTOR r;
-        r[0] = v[0] / a;
-        r[1] = v[1] / a;
-        r[2] = v[2] / a;
-        return r;
+        return v[0] == a[0] && v[1] == a[1] && v[2] == a[2];
     }
 
-        VECTOR() {}
-        VECTOR(const float X, const float Y, const float Z) { v[0]=X; v[1]=Y; v[2]=Z; }
-        ~VECTOR() {}
+        constexpr Vector3() : v{ 0, 0, 0, 0 } {}
+        constexpr Vector3(const T X, const T Y, const T Z) : v{ X, Y, Z, 0 } {}
+
+        constexpr T dot(const Vector3 &a) const
+        {
+            return v[0] * a[0] + v[1] * a[1] + v[2] * a[2];
+        }
 
         void normalize()
         {
-            float id = 1 / sqrt(v[0] * v[0] + v[1] * v[1] + v[2] * v[2]);
+            T id = 1 / std::sqrt(dot(*this));
             v[0] *= id;
             v[1] *= id;
             v[2] *= id;
         }
 
-        void setMagnitude(float magnitude)
+        // a zero vector has no direction, it stays zero instead of NaN
+        // (a beat can roll an angular velocity of exactly 0, 0, 0)
+        void setMagnitude(T magnitude)
         {
-            float id = 1 / sqrt(v[0] * v[0] + v[1] * v[1] + v[2] * v[2]) * magnitude;
+            if (dot(*this) == 0)
+                return;
+            T id = 1 / std::sqrt(dot(*this)) * magnitude;
             v[0] *= id;
             v[1] *= id;
             v[2] *= id;
         }
 };
 
-inline VECTOR normalize(const VECTOR &a)
+typedef Vector3<float> VECTOR;
+
+template <typename T>
+inline Vector3<T> normalize(const Vector3<T> &a)
 {
-   float  id = 1/sqrt(a[0]*a[0] + a[1]*a[1] + a[2]*a[2]);
-   return VECTOR( a[0]*id, a[1]*id, a[2]*id );
+   T id = 1 / std::sqrt(a.dot(a));
+   return Vector3<T>( a[0]*id, a[1]*id, a[2]*id );
 }
 
-inline VECTOR cross(const VECTOR &vector1, const VECTOR &vector2)
+template <typename T>
+constexpr Vector3<T> cross(const Vector3<T> &vector1, const Vector3<T> &vector2)
 {
-    return VECTOR(
+    return Vector3<T>(
             vector1[1] * vector2[2] - vector1[2] * vector2[1],
             vector1[2] * vector2[0] - vector1[0] * vector2[2],
             vector1[0] * vector2[1] - vector1[1] * vector2[0]);
-};
+}
+
+#if defined(__SSE2__)
+/*
+* same operations in the same order as normalize() above, so the results
+* are identical, just without going through the components one by one
+*/
+template <>
+inline Vector3<float> normalize(const Vector3<float> &a)
+{
+    __m128 v = _mm_load_ps(&a[0]);
+    __m128 sq = _mm_mul_ps(v, v);
+    __m128 d = _mm_add_ss(_mm_add_ss(sq, _mm_shuffle_ps(sq, sq, 1)), _mm_shuffle_ps(sq, sq, 2));
+    __m128 id = _mm_div_ss(_mm_set_ss(1.0f), _mm_sqrt_ss(d));
+    Vector3<float> r;
+    _mm_store_ps(&r[0], _mm_mul_ps(v, _mm_shuffle_ps(id, id, 0)));
+    return r;
+}
+#endif
 
 #endif
@@ -0,0 +1,113 @@
+#ifndef __WORKERS_H_
+#define __WORKERS_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/*
+* a fixed set of threads that all run the same job once per call to
+* run(), the calling thread takes part as worker 0. jobs hand out work
+* among themselves (e.g. with an atomic counter), so the pool doesn't
+* need a queue
+*/
+class WORKER_POOL
+{
+	typedef void (*JOB)(int worker, void *data);
+
+	std::vector<std::thread> threads;
+	std::mutex lock;
+	std::condition_variable wake, done;
+	JOB job;
+	void *data;
+	unsigned int generation;
+	int pending;
+	bool quit;
+
+	void loop(const int worker)
+	{
+		unsigned int seen = 0;
+		for (;;)
+		{
+			JOB j;
+			void *d;
+			{
+				std::unique_lock<std::mutex> guard(lock);
+				wake.wait(guard, [&] { return quit || generation != seen; });
+				if (quit) return;
+				seen = generation;
+				j = job;
+				d = data;
+			}
+			j(worker, d);
+			{
+				std::lock_guard<std::mutex> guard(lock);
+				if (--pending == 0)
+					done.notify_one();
+			}
+		}
+	}
+
+public:
+
+	WORKER_POOL() : job(NULL), data(NULL), generation(0), pending(0), quit(false) {}
+	~WORKER_POOL() { stop(); }
+
+	// start count - 1 extra threads, count < 1 means one per CPU
+	void start(int count)
+	{
+		stop();
+		if (count < 1)
+			count = (int)std::thread::hardware_concurrency();
+		if (count < 1)
+			count = 1;
+		{
+			// the new threads start with seen = 0, a stale generation would wake them
+			std::lock_guard<std::mutex> guard(lock);
+			quit = false;
+			generation = 0;
+			pending = 0;
+		}
+		for (int i = 1; i < count; i++)
+			threads.push_back(std::thread(&WORKER_POOL::loop, this, i));
+	}
+
+	void stop()
+	{
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			quit = true;
+		}
+		wake.notify_all();
+		for (size_t i = 0; i < threads.size(); i++)
+			threads[i].join();
+		threads.clear();
+	}
+
+	int size() const { return (int)threads.size() + 1; }
+
+	// run j on every worker and wait until all of them are finished
+	void run(JOB j, void *d)
+	{
+		if (threads.empty())
+		{
+			j(0, d);
+			return;
+		}
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			job = j;
+			data = d;
+			pending = (int)threads.size();
+			generation++;
+		}
+		wake.notify_all();
+		j(0, d);
+		std::unique_lock<std::mutex> guard(lock);
+		done.wait(guard, [&] { return pending == 0; });
+	}
+};
+
+#endif //__WORKERS_H_